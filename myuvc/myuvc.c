@@ -1,4 +1,4 @@
-﻿
+
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/module.h>
@@ -12,6 +12,17 @@
 #include <linux/usb/input.h>
 #include <linux/mm.h>
 #include <linux/hid.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/random.h>
+#include <linux/log2.h>
+#include <linux/hrtimer.h>
+#include <linux/kref.h>
 
 #include <media/v4l2-common.h>
 #include <media/v4l2-ioctl.h>
@@ -19,6 +30,9 @@
 
 #include "uvcvideo.h"
 
+#define CREATE_TRACE_POINTS
+#include "myuvc_trace.h"
+
 #define  UVC_URBS  5
 
 /* 2.4.3.3. Payload Header Information */
@@ -31,11 +45,55 @@
 #define UVC_STREAM_EOF					(1 << 1)
 #define UVC_STREAM_FID					(1 << 0)
 
+/* 本驱动自己的quirk, 与uvcvideo.h中的UVC_QUIRK_*一起使用
+ * UVC_QUIRK_STREAM_NO_FID : FID位不可靠, 根据JPEG文件头判断新的一帧
+ * MYUVC_QUIRK_FIX_SOI     : 每帧的JPEG数据缺少SOI标记的第1个字节0xFF
+ */
+#define MYUVC_QUIRK_FIX_SOI				0x00000100
+
+/* 2.6.31的videodev2.h里还没有时间戳来源的标志 */
+#ifndef V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+#define V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC		0x00002000
+#endif
+#ifndef V4L2_BUF_FLAG_TSTAMP_SRC_SOE
+#define V4L2_BUF_FLAG_TSTAMP_SRC_SOE			0x00010000
+#endif
+#ifndef V4L2_BUF_FLAG_ERROR
+#define V4L2_BUF_FLAG_ERROR				0x00000040
+#endif
+
+/* 数据有问题的帧: v4l2_buffer.flags中设置V4L2_BUF_FLAG_ERROR,
+ * 是什么问题(下面这些位)记在统计和myuvc_buffer_done跟踪事件中
+ */
+#define MYUVC_BUF_PACKET_LOST				(1 << 0)	/* 同步传输丢了packet */
+#define MYUVC_BUF_STREAM_ERR				(1 << 1)	/* payload头部设置了错误位 */
+#define MYUVC_BUF_TRUNCATED				(1 << 2)	/* 缓冲区太小, 一帧数据没有存完 */
+#define MYUVC_BUF_URB_ERR				(1 << 3)	/* URB传输出错(-EPROTO等) */
+
+/* GET_INFO请求返回的控制的能力 */
+#define MYUVC_CTRL_INFO_GET				(1 << 0)
+#define MYUVC_CTRL_INFO_SET				(1 << 1)
+#define MYUVC_CTRL_INFO_DISABLED			(1 << 2)	/* 自动模式下不能设置 */
+#define MYUVC_CTRL_INFO_AUTOUPDATE			(1 << 3)	/* 摄像头自己会改变它的值 */
+#define MYUVC_CTRL_INFO_ASYNC				(1 << 4)
+
+/* myuvc_control.data中各份数据 */
+#define MYUVC_CTRL_DATA_CUR				0
+#define MYUVC_CTRL_DATA_MIN				1
+#define MYUVC_CTRL_DATA_MAX				2
+#define MYUVC_CTRL_DATA_RES				3
+#define MYUVC_CTRL_DATA_DEF				4
+#define MYUVC_CTRL_DATA_BACKUP				5	/* 扩展控制失败时回滚用 */
+#define MYUVC_CTRL_DATA_LAST				6
+
+/* myuvc_control.stale: 状态中断(不持有ctrl_mutex)作废缓存时设置, 使用缓存前检查 */
+#define MYUVC_CTRL_STALE_CUR				0	/* 当前值 */
+#define MYUVC_CTRL_STALE_INFO				1	/* GET_INFO和范围 */
+
+#define MYUVC_MAX_CONTROLS				64
+#define MYUVC_MAX_XUS					8
+#define MYUVC_XU_MAX_SIZE				1024	/* UVCIOC_CTRL_ADD: 一个控制最多的字节数 */
 
-struct frame_desc {
-    int width;
-    int height;
-};
 
 struct myuvc_streaming_control {
 	__u16 bmHint;
@@ -62,47 +120,330 @@ struct myuvc_buffer {
     struct v4l2_buffer buf;
     int state;
     int vma_use_count;       /* 表示是否已经被mmap */
-    wait_queue_head_t wait;  /* APP要读某个缓冲区,如果无数据,在此休眠 */
+	void *mem;               /* 解析URB时写入数据的内核地址 */
+	struct page **pages;     /* V4L2_MEMORY_USERPTR: 锁定的APP内存 */
+	unsigned int npages;
+	void *vaddr;             /* pages在内核中的映射(vmap) */
 	struct list_head stream;
 	struct list_head irq; 
+	__u32 pts;               /* 这一帧第1个payload头部中的PTS */
+	ktime_t first_time;      /* 这一帧第1个payload到达的时间 */
+	int pts_valid;
+	unsigned int error;      /* MYUVC_BUF_* */
+	int complete;            /* 解析完一帧, 等myuvc_queue_next_buffer把它从irqqueue中删除 */
 };
 
 struct myuvc_queue {
     void *mem;
     int count;
     int buf_size;    
+	enum v4l2_memory memory;      /* REQBUFS时确定: MMAP或USERPTR */
     struct myuvc_buffer buffer[32];
 	struct list_head mainqueue;   /* 供APP消费用 */
 	struct list_head irqqueue;    /* 供底层驱动生产用 */
 
+	/* mutex : 保护mainqueue和缓冲区的分配, ioctl之间互斥, 只在进程上下文使用
+	 * irqlock: 保护irqqueue, URB完成函数(中断上下文)也要使用,
+	 *          只在链表操作时持有, 复制数据时不持有
+	 */
+	struct mutex mutex;
+	spinlock_t irqlock;
+
+	/* APP要读缓冲区, 如果无数据, 在此休眠; 每填满一帧唤醒一次 */
+	wait_queue_head_t wait;
+
 	struct urb *urb[32];
 	char *urb_buffer[32];
 	dma_addr_t urb_dma[32];
+	ktime_t urb_time[32];         /* URB完成的时间, 用于统计帧延迟 */
+	__u16 urb_sof[32];            /* URB完成时主机的USB帧号 */
 	unsigned int urb_size;
 };
 
-static struct myuvc_queue myuvc_queue;
+/* deferred_decode = 1 时, URB完成函数只把URB放入链表,
+ * 由工作队列在进程上下文里解析数据并重新提交URB, 缩短中断处理时间
+ */
+static int deferred_decode = 0;
+module_param(deferred_decode, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(deferred_decode, "Decode video URBs in a workqueue instead of the completion handler");
+
+/* latest_frame = 1 时, DQBUF总是返回最新的一帧: 没有空闲缓冲区时, 完成函数把
+ * 最旧的还没有被APP取走的帧重新用来接收数据, 刚完成的一帧留给APP;
+ * DQBUF取走最新的一帧时, 比它旧的帧也重新用来接收数据
+ */
+static int latest_frame = 0;
+module_param(latest_frame, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(latest_frame, "DQBUF returns the newest frame, older undequeued frames are recycled");
+
+/* async_controls = 1 时, S_CTRL/S_EXT_CTRLS把SET_CUR用控制URB发出后就返回,
+ * 不等待摄像头响应; 完成或失败在debugfs的ctrl_events文件中报告
+ */
+static int async_controls = 0;
+module_param(async_controls, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(async_controls, "Submit SET_CUR requests without waiting, report completion in debugfs ctrl_events");
+
+/* debug = 1 时, STREAMON打印和摄像头协商的参数, STREAMOFF打印这次传输的
+ * 完成函数耗时和唤醒延迟(debugfs的stats中有同样的统计)
+ */
+static int debug = 0;
+module_param(debug, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(debug, "Print streaming parameters at STREAMON and decode timing at STREAMOFF");
+
+/* SCR样本: 设备时钟(STC)和USB帧号(SOF)的对应关系,
+ * 以及URB完成时主机的USB帧号和单调时间, 用于把PTS换算成主机时间
+ */
+struct myuvc_clock_sample {
+	__u32 dev_stc;
+	__u16 dev_sof;
+	__u16 host_sof;
+	ktime_t host_time;
+};
+
+#define MYUVC_CLOCK_SAMPLES	16
+
+/* 运行统计, 每个CPU一份, 中断里只加自己CPU的计数, 不需要锁,
+ * 读debugfs的stats文件时把所有CPU的加起来
+ * irq_hist[i] : 完成函数运行时间在[2^(i-1), 2^i)微秒之间的次数, 最后一项包括更长的
+ * latency_hist[i] : 从一帧第1个payload到达到APP DQBUF取走这一帧的时间, 单位同上
+ */
+#define MYUVC_HIST_BUCKETS	12
+#define MYUVC_LATENCY_BUCKETS	20
+
+struct myuvc_stats {
+	unsigned long urbs;                /* 完成的URB */
+	unsigned long packets;             /* 收到的payload(同步传输是packet) */
+	unsigned long packets_lost;        /* 同步传输丢失的packet */
+	unsigned long packets_error;       /* 头部无效或设置了错误位的payload */
+	unsigned long bytes;               /* 复制到缓冲区的视频数据 */
+	unsigned long frames;              /* 交给APP的帧 */
+	unsigned long frames_dropped;      /* 没有缓冲区而丢掉的帧 */
+	unsigned long frames_truncated;    /* 缓冲区太小的帧 */
+	unsigned long frames_error;        /* 设置了V4L2_BUF_FLAG_ERROR的帧 */
+	unsigned long frames_packet_lost;  /* 其中丢了packet的帧 */
+	unsigned long frames_stream_err;   /* 其中payload头部设置了错误位的帧 */
+	unsigned long frames_recycled;     /* latest_frame: 没有被APP取走就被覆盖的帧 */
+	unsigned long resubmit_failed;     /* 重新提交URB失败 */
+	unsigned long urbs_error;          /* 传输出错(-EPROTO等)后重新提交的URB */
+	unsigned long irq_ns;              /* 完成函数的运行时间 */
+	unsigned long work_ns;             /* deferred_decode时工作队列解析URB的时间 */
+	unsigned long irq_hist[MYUVC_HIST_BUCKETS];
+	unsigned long latency_hist[MYUVC_LATENCY_BUCKETS];
+};
+
+#define MYUVC_STATS_ADD(dev, field, n)						\
+	do {									\
+		per_cpu_ptr((dev)->stats, get_cpu())->field += (n);		\
+		put_cpu();							\
+	} while (0)
+#define MYUVC_STATS_INC(dev, field)	MYUVC_STATS_ADD(dev, field, 1)
+
+/* 控制的缓存: GET_INFO和范围在第一次使用时读出,
+ * 摄像头不会自己改变的控制, 当前值也缓存, 状态中断报告变化时作废
+ */
+struct myuvc_control {
+	struct uvc_control_info *info;     /* myuvc_ctrl_infos中的一项 */
+	__u8 unit;                         /* 所属Terminal/Unit的ID */
+	int loaded;                        /* caps和范围有效 */
+	__u8 caps;                         /* GET_INFO, MYUVC_CTRL_INFO_* */
+	int cur_valid;
+	unsigned long stale;               /* MYUVC_CTRL_STALE_*, 用原子位操作 */
+	int dirty;                         /* 已经放入ctrl_batch, 还没发给摄像头 */
+	int backup;                        /* MYUVC_CTRL_DATA_BACKUP有效 */
+	__u8 *data;                        /* 每个MYUVC_CTRL_DATA_*一份, 每份info->size字节 */
+};
+
+/* 扩展单元(Extension Unit) */
+struct myuvc_xu {
+	__u8 id;                           /* bUnitID */
+	__u8 guid[16];                     /* guidExtensionCode */
+	unsigned int control_size;         /* bControlSize */
+	__u8 *bmControls;
+};
 
-static struct video_device *myuvc_vdev;
+/* async_controls: 一个V4L2控制的SET_CUR完成或失败 */
+struct myuvc_ctrl_event {
+	__u32 sequence;
+	__u32 id;
+	__s32 value;
+	int status;                        /* 0或错误码 */
+};
 
-static struct v4l2_format myuvc_format;
-static struct frame_desc frames[] = {{640, 480}, {320, 240}, {160, 120}};
-static int frame_idx = 1;
-static int bBitsPerPixel = 0; /* 压缩的MJPEG数据, 不需要这个位 */
-static int myuvc_version = 0x0100;
-static struct myuvc_streaming_control  myuvc_streaming_ctl; 
-static struct usb_device  *mydev;
-static int myuvc_streaming_intf;
-static int myuvc_control_intf;
-static int myuvc_streaming_bAlternateSetting = 5;
-static int myuvc_bEndpointAddress = 0x82;    /* 流接口 端点地址 */
-static int myuvc_bInterval  = 1;
-static int ProcessingUnitID = 3;
+#define MYUVC_CTRL_EVENTS				64
 
-static int wMaxPacketSize      = 800;
-static int dwMaxVideoFrameSize = 77312;
+/* 每个摄像头一个myuvc_device, probe时分配, video_device和打开的debugfs文件
+ * 各持有一个引用, 最后一个APP关闭设备并且debugfs文件都关闭以后释放
+ */
+struct myuvc_device {
+	struct kref kref;
+	int disconnected;
+	struct usb_device *udev;
+	struct usb_interface *intf;        /* VideoControl Interface */
+	struct usb_interface *vs_intf;     /* VideoStreaming Interface, probe时占用 */
+	struct video_device *vdev;
+	int control_intf;
+	int streaming_intf;
+	__u16 uvc_version;
+	__u32 clock_frequency;             /* VC头部描述符中的dwClockFrequency */
+
+	/* 控制: probe时根据Camera Terminal和Processing Unit描述符找出来,
+	 * ctrl_mutex保证同一时刻只有一个控制请求, 并保护缓存
+	 */
+	struct mutex ctrl_mutex;
+	struct myuvc_control controls[MYUVC_MAX_CONTROLS];
+	unsigned int ncontrols;
+	struct myuvc_control *ctrl_batch[MYUVC_MAX_CONTROLS]; /* 正在设置的一批控制, 按设置的顺序 */
+	unsigned int nbatch;
+
+	/* 扩展单元, 以及APP用UVCIOC_CTRL_ADD/MAP加入的控制和映射 */
+	struct myuvc_xu xus[MYUVC_MAX_XUS];
+	unsigned int nxus;
+	struct list_head xu_infos;         /* struct uvc_control_info */
+	struct list_head xu_mappings;      /* struct uvc_control_mapping */
+
+	/* async_controls: busy时ctrl_batch中的控制正在用urb发出,
+	 * 完成后work更新缓存, 记录事件, 清除busy
+	 */
+	struct {
+		struct urb *urb;
+		struct usb_ctrlrequest setup;
+		__u8 *data;                    /* 这一批控制要写入的数据 */
+		unsigned int offset;           /* 正在发送的控制的数据在data中的位置 */
+		unsigned int sent;             /* 已经完成的SET_CUR */
+		int status;
+		int busy;
+		struct v4l2_ext_control *xctrls;
+		unsigned int count;
+		struct workqueue_struct *workqueue; /* 回滚时会阻塞, 不用系统的工作队列 */
+		struct work_struct work;
+		wait_queue_head_t wait;        /* 等待busy为0, 等待事件 */
+		spinlock_t lock;               /* 保护events */
+		struct myuvc_ctrl_event events[MYUVC_CTRL_EVENTS];
+		unsigned int head, tail;
+		__u32 sequence;
+	} async;
+	struct urb *int_urb;               /* 状态中断 */
+	__u8 *status;
+
+	/* probe时从VideoStreaming Interface的描述符中解析出来的格式和分辨率 */
+	struct uvc_format *formats;
+	unsigned int nformats;
+	struct uvc_format *cur_format;
+	struct uvc_frame  *cur_frame;
+	__u32 frame_interval;              /* APP要求的帧间隔, 单位100ns */
+	struct v4l2_format format;
+	struct myuvc_streaming_control streaming_ctl;
+
+	/* 视频数据端点 */
+	int streaming_bulk;                /* 传输类型: 0 - 同步(isochronous), 1 - 批量(bulk) */
+	int bEndpointAddress;
+	int bAlternateSetting;             /* STREAMON时根据带宽选择 */
+	int bInterval;
+	int wMaxPacketSize;                /* 所选setting的端点每个(微)帧最多能传输的字节数 */
+
+	/* probe时根据myuvc_quirks_table确定的quirk, 以及解析URB数据的函数 */
+	unsigned long quirks;
+	void (*decode)(struct myuvc_device *dev, struct urb *urb, struct myuvc_buffer *buf);
+
+	struct myuvc_queue queue;
+	int last_fid;
+	__u32 sequence;                    /* 帧序号, 没有缓冲区而丢掉的帧也计数 */
+
+	/* 批量传输时一个payload可能跨越多个URB, 用它记录当前payload的解析状态 */
+	struct {
+		__u8 header[256];
+		unsigned int header_size;
+		int skip_payload;
+		__u32 payload_size;
+		__u32 max_payload_size;
+	} bulk;
+
+	int deferred;                      /* STREAMON时确定的模式 */
+	int latest;                        /* STREAMON时确定的latest_frame */
+	int streaming;                     /* 正在传输, 工作队列可以重新提交URB */
+	struct workqueue_struct *workqueue;
+	struct work_struct work;
+	struct list_head urb_done;         /* 等待工作队列处理的URB */
+	spinlock_t urb_lock;               /* 保护urb_done */
+	ktime_t decode_time;               /* 正在解析的URB的完成时间 */
+	__u16 decode_sof;                  /* 正在解析的URB完成时主机的USB帧号 */
+
+	/* PTS/SCR时钟恢复, 最近的MYUVC_CLOCK_SAMPLES个SCR样本 */
+	struct {
+		struct myuvc_clock_sample samples[MYUVC_CLOCK_SAMPLES];
+		unsigned int head;
+		unsigned int count;
+		__u32 frequency;               /* 设备时钟频率, STREAMON时确定 */
+	} clock;
+
+	/* 中断处理时间和帧延迟(从URB完成到唤醒APP)的统计, STREAMOFF时打印 */
+	struct {
+		unsigned int urbs;
+		s64 irq_ns_total;
+		s64 irq_ns_max;
+		unsigned int frames;
+		s64 latency_ns_total;
+		s64 latency_ns_max;
+	} timing;
+
+	struct myuvc_stats *stats;         /* alloc_percpu */
+	struct dentry *debugfs;            /* debugfs中的videoN目录 */
+
+#ifdef CONFIG_MYUVC_TESTING
+	/* 最近一次解析速度测试(debugfs中的bench文件)的结果 */
+	struct {
+		unsigned int frames;
+		unsigned int packets;
+		unsigned long long bytes;
+		s64 ns;
+	} bench;
+#endif
 
-static int last_fid = -1;
+	/* 抓取原始URB数据(debugfs中的capture文件), 完成函数写入环形缓冲区 */
+	struct {
+		int enabled;
+		unsigned int snaplen;          /* 每个packet最多记录多少字节, 0 - 全部 */
+		u8 *ring;                      /* vmalloc, 大小是2的幂 */
+		unsigned int size;
+		unsigned int head;             /* 写入位置, 只增不减, 完成函数修改 */
+		unsigned int tail;             /* 读出位置, 只增不减, 读capture文件时修改 */
+		unsigned int dropped;          /* 空间不够丢掉的记录, 写入下一条记录后清零 */
+		unsigned long records;
+		unsigned long lost;            /* 丢掉的记录总数 */
+		spinlock_t lock;               /* 保护head/tail和enabled */
+		struct mutex mutex;            /* 读数据和开始/停止之间互斥 */
+		wait_queue_head_t wait;
+	} capture;
+
+#ifdef CONFIG_MYUVC_TESTING
+	/* 回放抓取的数据(debugfs中的replay文件), 一条记录可能分几次write写入 */
+	struct {
+		int active;
+		u8 *rec;                       /* 正在接收的记录 */
+		u8 *data;                      /* 还原出来的URB数据 */
+		unsigned int len;              /* 已经收到的字节数 */
+		struct urb *urb;
+		unsigned int records;
+		unsigned int frames;
+		unsigned int packets;
+		unsigned long long bytes;
+		s64 ns;
+	} replay;
+
+	/* 虚拟数据源(debugfs中的vsource文件), fps不为0时STREAMON不使用摄像头 */
+	struct {
+		unsigned int fps;
+		unsigned int frame_size;
+		unsigned int psize;
+		int active;                    /* 这次STREAMON使用了虚拟数据源 */
+		struct hrtimer timer;
+		ktime_t period;
+		struct urb *urb;
+		u8 *mem;
+		unsigned int pos;              /* 当前帧已经生成的字节数 */
+		unsigned int frame;            /* 已经生成的帧数 */
+	} vsource;
+#endif
+};
 
 static const char *get_guid(const unsigned char *buf)
 {
@@ -560,8 +901,335 @@ static void parse_videostreaming_interface(struct usb_interface *intf, unsigned
     }
 }
 
+/* 非压缩格式的GUID与V4L2像素格式的对应关系 */
+static struct uvc_format_desc myuvc_fmts[] = {
+	{
+		.name		= "YUV 4:2:2 (YUYV)",
+		.guid		= UVC_GUID_FORMAT_YUY2,
+		.fcc		= V4L2_PIX_FMT_YUYV,
+	},
+	{
+		.name		= "YUV 4:2:0 (NV12)",
+		.guid		= UVC_GUID_FORMAT_NV12,
+		.fcc		= V4L2_PIX_FMT_NV12,
+	},
+	{
+		.name		= "YUV 4:2:0 (YV12)",
+		.guid		= UVC_GUID_FORMAT_YV12,
+		.fcc		= V4L2_PIX_FMT_YVU420,
+	},
+	{
+		.name		= "YUV 4:2:0 (I420)",
+		.guid		= UVC_GUID_FORMAT_I420,
+		.fcc		= V4L2_PIX_FMT_YUV420,
+	},
+	{
+		.name		= "YUV 4:2:2 (UYVY)",
+		.guid		= UVC_GUID_FORMAT_UYVY,
+		.fcc		= V4L2_PIX_FMT_UYVY,
+	},
+	{
+		.name		= "Greyscale (Y800)",
+		.guid		= UVC_GUID_FORMAT_Y800,
+		.fcc		= V4L2_PIX_FMT_GREY,
+	},
+	{
+		.name		= "RGB Bayer (BY8)",
+		.guid		= UVC_GUID_FORMAT_BY8,
+		.fcc		= V4L2_PIX_FMT_SBGGR8,
+	},
+};
+
+static struct uvc_format_desc *myuvc_format_by_guid(const __u8 guid[16])
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(myuvc_fmts); ++i) {
+		if (memcmp(guid, myuvc_fmts[i].guid, 16) == 0)
+			return &myuvc_fmts[i];
+	}
+
+	return NULL;
+}
+
+static void myuvc_free_formats(struct myuvc_device *dev)
+{
+	kfree(dev->formats);
+	dev->formats = NULL;
+	dev->nformats = 0;
+	dev->cur_format = NULL;
+	dev->cur_frame = NULL;
+}
+
+/* 把VideoStreaming Interface的格式描述符和帧描述符解析成dev->formats表格,
+ * 只在probe时做一次. 目前支持MJPEG和非压缩格式.
+ * 所有的格式, 帧, 帧间隔都放在一块内存里:
+ *   struct uvc_format [nformats] | struct uvc_frame [nframes] | __u32 [nintervals]
+ */
+static int myuvc_parse_formats(struct myuvc_device *dev, struct usb_interface *intf)
+{
+	unsigned char *buffer = intf->altsetting[0].extra;
+	int buflen = intf->altsetting[0].extralen;
+	unsigned int nformats = 0, nframes = 0, nintervals = 0;
+	struct uvc_format *format = NULL;
+	struct uvc_format_desc *fmtdesc;
+	struct uvc_frame *frame;
+	__u32 *interval;
+	unsigned char *buf;
+	unsigned int n, i;
+	int len;
+
+	/* 1. 统计格式, 帧, 帧间隔的个数 */
+	for (buf = buffer, len = buflen; len > 2; len -= buf[0], buf += buf[0]) {
+		if (buf[0] < 3 || buf[0] > len || buf[1] != USB_DT_CS_INTERFACE)
+			break;
+
+		switch (buf[2]) {
+		case VS_FORMAT_UNCOMPRESSED:
+		case VS_FORMAT_MJPEG:
+			nformats++;
+			break;
+
+		case VS_FRAME_UNCOMPRESSED:
+		case VS_FRAME_MJPEG:
+			if (buf[0] < 26)
+				break;
+			nframes++;
+			/* bFrameIntervalType = 0 表示连续的帧间隔: min, max, step */
+			nintervals += buf[25] ? buf[25] : 3;
+			break;
+		}
+	}
+
+	if (nformats == 0) {
+		printk("myuvc: no supported format found.\n");
+		return -EINVAL;
+	}
+
+	dev->formats = kzalloc(nformats * sizeof(*format) + nframes * sizeof(*frame)
+				+ nintervals * sizeof(*interval), GFP_KERNEL);
+	if (dev->formats == NULL)
+		return -ENOMEM;
+
+	frame = (struct uvc_frame *)&dev->formats[nformats];
+	interval = (__u32 *)&frame[nframes];
+
+	/* 2. 填充表格 */
+	for (buf = buffer, len = buflen; len > 2; len -= buf[0], buf += buf[0]) {
+		if (buf[0] < 3 || buf[0] > len || buf[1] != USB_DT_CS_INTERFACE)
+			break;
+
+		switch (buf[2]) {
+		case VS_FORMAT_MJPEG:
+			if (buf[0] < 11) {
+				format = NULL;
+				break;
+			}
+			format = &dev->formats[dev->nformats++];
+			format->type  = buf[2];
+			format->index = buf[3];
+			format->bpp   = 0;
+			format->fcc   = V4L2_PIX_FMT_MJPEG;
+			format->flags = UVC_FMT_FLAG_COMPRESSED;
+			format->colorspace = V4L2_COLORSPACE_SRGB;
+			strlcpy(format->name, "MJPEG", sizeof format->name);
+			format->frame = frame;
+			break;
+
+		case VS_FORMAT_UNCOMPRESSED:
+			fmtdesc = buf[0] >= 27 ? myuvc_format_by_guid(&buf[5]) : NULL;
+			if (fmtdesc == NULL) {
+				/* 不认识的格式, 后面的帧描述符也跳过 */
+				format = NULL;
+				break;
+			}
+			format = &dev->formats[dev->nformats++];
+			format->type  = buf[2];
+			format->index = buf[3];
+			format->bpp   = buf[21];
+			format->fcc   = fmtdesc->fcc;
+			format->flags = 0;
+			format->colorspace = V4L2_COLORSPACE_SRGB;
+			strlcpy(format->name, fmtdesc->name, sizeof format->name);
+			format->frame = frame;
+			break;
+
+		case VS_FORMAT_MPEG2TS:
+		case VS_FORMAT_DV:
+		case VS_FORMAT_FRAME_BASED:
+		case VS_FORMAT_STREAM_BASED:
+			format = NULL;
+			break;
+
+		case VS_FRAME_UNCOMPRESSED:
+		case VS_FRAME_MJPEG:
+			if (format == NULL || buf[0] < 26 ||
+			    (buf[2] == VS_FRAME_MJPEG) != (format->type == VS_FORMAT_MJPEG))
+				break;
+
+			n = buf[25] ? buf[25] : 3;
+			if (buf[0] < 26 + 4 * n)
+				break;
+
+			frame->bFrameIndex    = buf[3];
+			frame->bmCapabilities = buf[4];
+			frame->wWidth         = get_unaligned_le16(&buf[5]);
+			frame->wHeight        = get_unaligned_le16(&buf[7]);
+			frame->dwMinBitRate   = get_unaligned_le32(&buf[9]);
+			frame->dwMaxBitRate   = get_unaligned_le32(&buf[13]);
+			frame->dwMaxVideoFrameBufferSize = get_unaligned_le32(&buf[17]);
+			frame->dwDefaultFrameInterval    = get_unaligned_le32(&buf[21]);
+			frame->bFrameIntervalType        = buf[25];
+			frame->dwFrameInterval = interval;
+
+			for (i = 0; i < n; ++i)
+				*interval++ = get_unaligned_le32(&buf[26 + 4 * i]);
+
+			/* 非压缩格式的帧大小可以直接算出来 */
+			if (!(format->flags & UVC_FMT_FLAG_COMPRESSED))
+				frame->dwMaxVideoFrameBufferSize = format->bpp
+					* frame->wWidth * frame->wHeight / 8;
+
+			format->nframes++;
+			frame++;
+			break;
+		}
+	}
+
+	/* 丢掉没有任何分辨率的格式 */
+	for (i = 0; i < dev->nformats; ) {
+		if (dev->formats[i].nframes == 0) {
+			memmove(&dev->formats[i], &dev->formats[i + 1],
+				(dev->nformats - i - 1) * sizeof(*format));
+			dev->nformats--;
+		} else {
+			i++;
+		}
+	}
+
+	if (dev->nformats == 0) {
+		printk("myuvc: no supported frame found.\n");
+		myuvc_free_formats(dev);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < dev->nformats; ++i) {
+		format = &dev->formats[i];
+		for (n = 0; n < format->nframes; ++n)
+			printk("myuvc: format %u (%s) frame %u: %ux%u\n",
+			       format->index, format->name,
+			       format->frame[n].bFrameIndex,
+			       format->frame[n].wWidth, format->frame[n].wHeight);
+	}
+
+	return 0;
+}
+
+static struct uvc_format *myuvc_find_format(struct myuvc_device *dev, __u32 fcc)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->nformats; ++i) {
+		if (dev->formats[i].fcc == fcc)
+			return &dev->formats[i];
+	}
+
+	return NULL;
+}
+
+/* 找出与要求的分辨率最接近的帧: 两个矩形不重叠部分的面积最小.
+ * APP给的宽高可以很大, 面积用64位计算
+ */
+static struct uvc_frame *myuvc_find_closest_frame(struct uvc_format *format,
+		__u32 width, __u32 height)
+{
+	struct uvc_frame *frame = NULL;
+	__u64 d, maxd = (__u64)-1;
+	unsigned int i;
+	__u16 w, h;
+
+	for (i = 0; i < format->nframes; ++i) {
+		w = format->frame[i].wWidth;
+		h = format->frame[i].wHeight;
+
+		d = (__u64)min_t(__u32, w, width) * min_t(__u32, h, height);
+		d = (__u64)w * h + (__u64)width * height - 2 * d;
+		if (d < maxd) {
+			maxd = d;
+			frame = &format->frame[i];
+		}
+
+		if (maxd == 0)
+			break;
+	}
+
+	return frame;
+}
+
+static void myuvc_fill_pix_format(struct v4l2_format *f, struct uvc_format *format,
+		struct uvc_frame *frame)
+{
+	f->fmt.pix.pixelformat = format->fcc;
+	f->fmt.pix.width  = frame->wWidth;
+	f->fmt.pix.height = frame->wHeight;
+	f->fmt.pix.bytesperline =
+		(f->fmt.pix.width * format->bpp) >> 3;
+	f->fmt.pix.sizeimage = frame->dwMaxVideoFrameBufferSize;
+
+	f->fmt.pix.field      = V4L2_FIELD_NONE;
+	f->fmt.pix.colorspace = format->colorspace;
+	f->fmt.pix.priv       = 0;		/* private data, depends on pixelformat */
+}
+
+/* probe时默认使用第1种格式的第1个分辨率 */
+static void myuvc_set_default_format(struct myuvc_device *dev)
+{
+	struct uvc_format *format = &dev->formats[0];
+	struct uvc_frame *frame = &format->frame[0];
+
+	memset(&dev->format, 0, sizeof(dev->format));
+	dev->format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	myuvc_fill_pix_format(&dev->format, format, frame);
+	dev->cur_format = format;
+	dev->cur_frame  = frame;
+	dev->frame_interval = frame->dwDefaultFrameInterval;
+}
+
+static int myuvc_free_buffers(struct myuvc_device *dev);
+static void myuvc_free_controls(struct myuvc_device *dev);
+
+/* 释放设备结构体 */
+static void myuvc_delete(struct myuvc_device *dev)
+{
+	myuvc_free_buffers(dev);
+	myuvc_free_formats(dev);
+	myuvc_free_controls(dev);
+	if (dev->vs_intf)
+		usb_put_intf(dev->vs_intf);
+	usb_put_dev(dev->udev);
+	if (dev->stats)
+		free_percpu(dev->stats);
+	vfree(dev->capture.ring);
+	usb_free_urb(dev->int_urb);
+	usb_free_urb(dev->async.urb);
+	if (dev->async.workqueue)
+		destroy_workqueue(dev->async.workqueue);
+	kfree(dev->status);
+	kfree(dev);
+}
+
+static void myuvc_kref_release(struct kref *kref)
+{
+	myuvc_delete(container_of(kref, struct myuvc_device, kref));
+}
+
+/* 摄像头已经拔出并且最后一个APP关闭了设备 */
 static void myuvc_release(struct video_device *vdev)
 {
+	struct myuvc_device *dev = video_get_drvdata(vdev);
+
+	video_device_release(vdev);
+	kref_put(&dev->kref, myuvc_kref_release);
 }
 
 /* S1 打开 */
@@ -587,13 +1255,19 @@ static int myuvc_vidioc_querycap(struct file *file, void  *priv,
 static int myuvc_vidioc_enum_fmt_vid_cap(struct file *file, void  *priv,
 					struct v4l2_fmtdesc *f)
 {
-	/* 人工查看描述符可知我们用的摄像头只支持1种格式 */
-	if (f->index >= 1)
+	struct myuvc_device *dev = video_drvdata(file);
+	struct uvc_format *format;
+
+	/* 支持的格式在probe时已经从描述符中解析出来 */
+	if (f->index >= dev->nformats)
 		return -EINVAL;
 
-	strcpy(f->description, "MJPEG");
-	f->pixelformat = V4L2_PIX_FMT_MJPEG;   
-	//f->flags        = ;
+	format = &dev->formats[f->index];
+	strlcpy(f->description, format->name, sizeof f->description);
+	f->pixelformat = format->fcc;
+	f->flags       = 0;
+	if (format->flags & UVC_FMT_FLAG_COMPRESSED)
+		f->flags |= V4L2_FMT_FLAG_COMPRESSED;
 	f->type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     
 	return 0;
@@ -603,124 +1277,330 @@ static int myuvc_vidioc_enum_fmt_vid_cap(struct file *file, void  *priv,
 static int myuvc_vidioc_g_fmt_vid_cap(struct file *file, void *priv,
 					struct v4l2_format *f)
 {
-	memcpy(f, &myuvc_format, sizeof(myuvc_format));
+	struct myuvc_device *dev = video_drvdata(file);
+	memcpy(f, &dev->format, sizeof(dev->format));
 	return (0);
 
 }
 
-/* S5 测试驱动程序是否支持某种格式,并设置为该格式的分辨率 */
-static int myuvc_vidioc_try_fmt_vid_cap(struct file *file, void *priv,
-			struct v4l2_format *f)
+/* 测试格式, 返回对应的format和frame */
+static int myuvc_try_format(struct myuvc_device *dev, struct v4l2_format *f,
+		struct uvc_format **pformat, struct uvc_frame **pframe)
 {
+	struct uvc_format *format;
+	struct uvc_frame *frame;
+
 	if (f->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
     {
         return -EINVAL;
     }
 
-    if (f->fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG)
+    format = myuvc_find_format(dev, f->fmt.pix.pixelformat);
+    if (format == NULL)
         return -EINVAL;
     
     /* 调整format的width, height, 
      * 计算bytesperline, sizeimage
      */
 
-    /* 人工查看描述符, 确定支持哪几种分辨率 */
-    f->fmt.pix.width  = frames[frame_idx].width;
-    f->fmt.pix.height = frames[frame_idx].height;
-    
-	f->fmt.pix.bytesperline =
-		(f->fmt.pix.width * bBitsPerPixel) >> 3;
-        f->fmt.pix.sizeimage = dwMaxVideoFrameSize;
+    /* 从描述符解析出的分辨率中选择最接近APP要求的那个 */
+    frame = myuvc_find_closest_frame(format, f->fmt.pix.width, f->fmt.pix.height);
+    if (frame == NULL)
+        return -EINVAL;
+
+    myuvc_fill_pix_format(f, format, frame);
+
+    if (pformat)
+        *pformat = format;
+    if (pframe)
+        *pframe = frame;
 
-	f->fmt.pix.field      = V4L2_FIELD_NONE;
-	f->fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
-	f->fmt.pix.priv       = 0;		/* private data, depends on pixelformat */
-	
     return 0;
 }
 
+/* S5 测试驱动程序是否支持某种格式,并设置为该格式的分辨率 */
+static int myuvc_vidioc_try_fmt_vid_cap(struct file *file, void *priv,
+			struct v4l2_format *f)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+
+	return myuvc_try_format(dev, f, NULL, NULL);
+}
+
 /* S6 设置format */
 static int myuvc_vidioc_s_fmt_vid_cap(struct file *file, void *priv,
 				struct v4l2_format *f)
 {
-	int  ret = myuvc_vidioc_try_fmt_vid_cap(file, NULL, f);
+	struct myuvc_device *dev = video_drvdata(file);
+	struct uvc_format *format;
+	struct uvc_frame *frame;
+	int  ret = myuvc_try_format(dev, f, &format, &frame);
 	if(ret < 0)
 		return ret;
 
-	memcpy(&myuvc_format, f, sizeof myuvc_format);
-	
+	/* 已经分配的缓冲区是按原来的sizeimage分配的, 不能再改格式 */
+	mutex_lock(&dev->queue.mutex);
+	if (dev->streaming || dev->queue.count) {
+		ret = -EBUSY;
+		goto done;
+	}
+
+	memcpy(&dev->format, f, sizeof dev->format);
+	dev->cur_format = format;
+	dev->cur_frame  = frame;
+	dev->frame_interval = frame->dwDefaultFrameInterval;
+
+done:
+	mutex_unlock(&dev->queue.mutex);
+	return ret;
+}
+
+/* 列举某种格式支持的分辨率 */
+static int myuvc_vidioc_enum_framesizes(struct file *file, void *priv,
+				struct v4l2_frmsizeenum *fsize)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	struct uvc_format *format;
+	struct uvc_frame *frame;
+
+	format = myuvc_find_format(dev, fsize->pixel_format);
+	if (format == NULL)
+		return -EINVAL;
+
+	if (fsize->index >= format->nframes)
+		return -EINVAL;
+
+	frame = &format->frame[fsize->index];
+	fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+	fsize->discrete.width  = frame->wWidth;
+	fsize->discrete.height = frame->wHeight;
+
+	return 0;
+}
+
+/* 列举某种格式某个分辨率支持的帧间隔(单位100ns) */
+static int myuvc_vidioc_enum_frameintervals(struct file *file, void *priv,
+				struct v4l2_frmivalenum *fival)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	struct uvc_format *format;
+	struct uvc_frame *frame = NULL;
+	unsigned int i;
+
+	format = myuvc_find_format(dev, fival->pixel_format);
+	if (format == NULL)
+		return -EINVAL;
+
+	for (i = 0; i < format->nframes; ++i) {
+		if (format->frame[i].wWidth == fival->width &&
+		    format->frame[i].wHeight == fival->height) {
+			frame = &format->frame[i];
+			break;
+		}
+	}
+
+	if (frame == NULL)
+		return -EINVAL;
+
+	if (frame->bFrameIntervalType) {
+		if (fival->index >= frame->bFrameIntervalType)
+			return -EINVAL;
+
+		fival->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+		fival->discrete.numerator = frame->dwFrameInterval[fival->index];
+		fival->discrete.denominator = 10000000;
+	} else {
+		if (fival->index)
+			return -EINVAL;
+
+		fival->type = V4L2_FRMIVAL_TYPE_STEPWISE;
+		fival->stepwise.min.numerator = frame->dwFrameInterval[0];
+		fival->stepwise.min.denominator = 10000000;
+		fival->stepwise.max.numerator = frame->dwFrameInterval[1];
+		fival->stepwise.max.denominator = 10000000;
+		fival->stepwise.step.numerator = frame->dwFrameInterval[2];
+		fival->stepwise.step.denominator = 10000000;
+	}
+
+	return 0;
+}
+
+/* V4L2_MEMORY_USERPTR: 锁定APP的内存并映射到内核, URB完成函数直接把数据
+ * 写到APP的内存里, APP不需要再复制一次
+ */
+static int myuvc_buffer_pin(struct myuvc_buffer *buf, unsigned long userptr,
+		unsigned int length)
+{
+	unsigned long first = userptr >> PAGE_SHIFT;
+	unsigned long last  = (userptr + length - 1) >> PAGE_SHIFT;
+	unsigned int npages = last - first + 1;
+	struct page **pages;
+	void *vaddr;
+	int ret, i;
+
+	pages = kmalloc(npages * sizeof(*pages), GFP_KERNEL);
+	if (pages == NULL)
+		return -ENOMEM;
+
+	down_read(&current->mm->mmap_sem);
+	ret = get_user_pages(current, current->mm, userptr & PAGE_MASK, npages,
+			     1, 0, pages, NULL);
+	up_read(&current->mm->mmap_sem);
+
+	if (ret != npages) {
+		for (i = 0; i < ret; ++i)
+			put_page(pages[i]);
+		kfree(pages);
+		return ret < 0 ? ret : -EFAULT;
+	}
+
+	vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	if (vaddr == NULL) {
+		for (i = 0; i < npages; ++i)
+			put_page(pages[i]);
+		kfree(pages);
+		return -ENOMEM;
+	}
+
+	buf->pages  = pages;
+	buf->npages = npages;
+	buf->vaddr  = vaddr;
+	buf->mem    = vaddr + (userptr & ~PAGE_MASK);
+	buf->buf.m.userptr = userptr;
+	buf->buf.length    = length;
 	return 0;
 }
 
-static int myuvc_free_buffers(void)
+static void myuvc_buffer_unpin(struct myuvc_buffer *buf)
+{
+	unsigned int i;
+
+	if (buf->pages == NULL)
+		return;
+
+	vunmap(buf->vaddr);
+	for (i = 0; i < buf->npages; ++i) {
+		set_page_dirty_lock(buf->pages[i]);
+		put_page(buf->pages[i]);
+	}
+	kfree(buf->pages);
+
+	buf->pages  = NULL;
+	buf->npages = 0;
+	buf->vaddr  = NULL;
+	buf->mem    = NULL;
+}
+
+static int myuvc_free_buffers(struct myuvc_device *dev)
 {
-	if (myuvc_queue.mem)
+	unsigned int i;
+
+	for (i = 0; i < dev->queue.count; ++i)
+		myuvc_buffer_unpin(&dev->queue.buffer[i]);
+
+	if (dev->queue.mem)
 	{
-	    vfree(myuvc_queue.mem);
-	    memset(&myuvc_queue, 0, sizeof(myuvc_queue));
-	    myuvc_queue.mem = NULL;
+	    vfree(dev->queue.mem);
+	    dev->queue.mem = NULL;
 	}
+	dev->queue.count = 0;
 	return 0;
 }
 
 
+/* bench, replay和vsource只用于测试, 用 make MYUVC_TESTING=y 编译进来 */
+#ifdef CONFIG_MYUVC_TESTING
+static int myuvc_vsource_start(struct myuvc_device *dev);
+static void myuvc_vsource_stop(struct myuvc_device *dev);
+#define myuvc_vsource_enabled(dev)	((dev)->vsource.fps != 0)
+#define myuvc_vsource_active(dev)	((dev)->vsource.active)
+#define myuvc_replay_active(dev)	((dev)->replay.active)
+#else
+#define myuvc_vsource_start(dev)	(-ENODEV)
+#define myuvc_vsource_stop(dev)		do { } while (0)
+#define myuvc_vsource_enabled(dev)	0
+#define myuvc_vsource_active(dev)	0
+#define myuvc_replay_active(dev)	0
+#endif
+
 /* S7 申请缓冲区 参考：uvc_alloc_buffers
  * APP调用该ioctl让驱动程序分配若干个缓存, APP将从这些缓存中读到视频数据 
  */
 static int myuvc_vidioc_reqbufs(struct file *file, void *priv,
 			  struct v4l2_requestbuffers *p)
 {
+	struct myuvc_device *dev = video_drvdata(file);
     int nbuffers = p->count;
-    int bufsize  = PAGE_ALIGN(myuvc_format.fmt.pix.sizeimage);
+    int bufsize  = PAGE_ALIGN(dev->format.fmt.pix.sizeimage);
     unsigned int i;
     void *mem = NULL;
     int ret;
 
-    if ((ret = myuvc_free_buffers()) < 0)
+    if (p->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
+        (p->memory != V4L2_MEMORY_MMAP && p->memory != V4L2_MEMORY_USERPTR))
+        return -EINVAL;
+
+    if (nbuffers > (int)ARRAY_SIZE(dev->queue.buffer))
+        nbuffers = ARRAY_SIZE(dev->queue.buffer);
+
+    mutex_lock(&dev->queue.mutex);
+
+    /* 传输或者回放(replay文件)过程中还在使用这些缓冲区 */
+    if (dev->streaming || myuvc_replay_active(dev)) {
+        ret = -EBUSY;
+        goto done;
+    }
+
+    if ((ret = myuvc_free_buffers(dev)) < 0)
         goto done;
 
     /* Bail out if no buffers should be allocated. */
     if (nbuffers == 0)
         goto done;
 
-    /* Decrement the number of buffers until allocation succeeds. */
-    for (; nbuffers > 0; --nbuffers) {
+    /* USERPTR的内存由APP在QBUF时提供, 这里不用分配 */
+    for (; nbuffers > 0 && p->memory == V4L2_MEMORY_MMAP; --nbuffers) {
+        /* Decrement the number of buffers until allocation succeeds. */
         mem = vmalloc_32(nbuffers * bufsize);  /* 分配内存的总大小 */
         if (mem != NULL)
             break;
     }
 
-    if (mem == NULL) {
+    if (nbuffers == 0) {
         ret = -ENOMEM;
         goto done;
     }
 
     /* 这些缓存是一次性作为一个整体来分配的 */
-    memset(&myuvc_queue, 0, sizeof(myuvc_queue));
+    memset(dev->queue.buffer, 0, sizeof(dev->queue.buffer));
 
 	/* 初始化两个队列 */
-	INIT_LIST_HEAD(&myuvc_queue.mainqueue);
-	INIT_LIST_HEAD(&myuvc_queue.irqqueue);
+	INIT_LIST_HEAD(&dev->queue.mainqueue);
+	INIT_LIST_HEAD(&dev->queue.irqqueue);
 
     for (i = 0; i < nbuffers; ++i) {
-        myuvc_queue.buffer[i].buf.index = i;
-        myuvc_queue.buffer[i].buf.m.offset = i * bufsize;
-        myuvc_queue.buffer[i].buf.length = myuvc_format.fmt.pix.sizeimage;
-        myuvc_queue.buffer[i].buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        myuvc_queue.buffer[i].buf.sequence = 0;
-        myuvc_queue.buffer[i].buf.field = V4L2_FIELD_NONE;
-        myuvc_queue.buffer[i].buf.memory = V4L2_MEMORY_MMAP;
-        myuvc_queue.buffer[i].buf.flags = 0;
-        myuvc_queue.buffer[i].state     = VIDEOBUF_IDLE;
-        init_waitqueue_head(&myuvc_queue.buffer[i].wait);
+        dev->queue.buffer[i].buf.index = i;
+        if (p->memory == V4L2_MEMORY_MMAP) {
+            dev->queue.buffer[i].buf.m.offset = i * bufsize;
+            dev->queue.buffer[i].mem = mem + i * bufsize;
+        }
+        dev->queue.buffer[i].buf.length = dev->format.fmt.pix.sizeimage;
+        dev->queue.buffer[i].buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        dev->queue.buffer[i].buf.sequence = 0;
+        dev->queue.buffer[i].buf.field = V4L2_FIELD_NONE;
+        dev->queue.buffer[i].buf.memory = p->memory;
+        dev->queue.buffer[i].buf.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+        dev->queue.buffer[i].state     = VIDEOBUF_IDLE;
     }
 
-    myuvc_queue.mem = mem;
-    myuvc_queue.count = nbuffers;
-    myuvc_queue.buf_size = bufsize;
+    dev->queue.mem = mem;
+    dev->queue.memory = p->memory;
+    dev->queue.count = nbuffers;
+    dev->queue.buf_size = bufsize;
     ret = nbuffers;
 
 done:
+    mutex_unlock(&dev->queue.mutex);
     return ret;
 
 }
@@ -746,6 +1626,7 @@ static struct vm_operations_struct myuvc_vm_ops = {
 /* S8 映射内存mmap */
 static int myuvc_mmap(struct file *file, struct vm_area_struct *vma)
 {
+	struct myuvc_device *dev = video_drvdata(file);
 	struct myuvc_buffer *buffer;
     struct page *page;
     unsigned long addr, start, size;
@@ -755,16 +1636,23 @@ static int myuvc_mmap(struct file *file, struct vm_area_struct *vma)
     start = vma->vm_start;
     size = vma->vm_end - vma->vm_start;
 
+    mutex_lock(&dev->queue.mutex);
+
+    if (dev->queue.memory != V4L2_MEMORY_MMAP) {
+        ret = -EINVAL;
+        goto done;
+    }
+
     /* 应用程序调用mmap函数时, 会传入offset参数
      * 根据这个offset找出指定的缓冲区
      */
-    for (i = 0; i < myuvc_queue.count; ++i) {
-        buffer = &myuvc_queue.buffer[i];
+    for (i = 0; i < dev->queue.count; ++i) {
+        buffer = &dev->queue.buffer[i];
         if ((buffer->buf.m.offset >> PAGE_SHIFT) == vma->vm_pgoff)
             break;
     }
 
-    if (i == myuvc_queue.count || size != myuvc_queue.buf_size) {
+    if (i == dev->queue.count || size != dev->queue.buf_size) {
         ret = -EINVAL;
         goto done;
     }
@@ -776,7 +1664,7 @@ static int myuvc_mmap(struct file *file, struct vm_area_struct *vma)
     vma->vm_flags |= VM_IO;
 
     /* 根据虚拟地址找到缓冲区对应的page构体 */
-    addr = (unsigned long)myuvc_queue.mem + buffer->buf.m.offset;
+    addr = (unsigned long)dev->queue.mem + buffer->buf.m.offset;
     while (size > 0) {
         page = vmalloc_to_page((void *)addr);
 
@@ -794,6 +1682,7 @@ static int myuvc_mmap(struct file *file, struct vm_area_struct *vma)
     myuvc_vm_open(vma);
 
 done:
+    mutex_unlock(&dev->queue.mutex);
     return ret;
 }
 
@@ -801,21 +1690,23 @@ done:
 /* S9 查询缓冲区 */
 static int myuvc_vidioc_querybuf(struct file *file, void *priv, struct v4l2_buffer *v4l2_buf)
 {
+	struct myuvc_device *dev = video_drvdata(file);
 	int ret = 0;
     
-	if (v4l2_buf->index >= myuvc_queue.count) {
+	mutex_lock(&dev->queue.mutex);
+	if (v4l2_buf->index >= dev->queue.count) {
 		ret = -EINVAL;
 		goto done;
 	}
 
-    memcpy(v4l2_buf, &myuvc_queue.buffer[v4l2_buf->index].buf, sizeof(*v4l2_buf));
+    memcpy(v4l2_buf, &dev->queue.buffer[v4l2_buf->index].buf, sizeof(*v4l2_buf));
 
     /* 更新flags */
-	if (myuvc_queue.buffer[v4l2_buf->index].vma_use_count)
+	if (dev->queue.buffer[v4l2_buf->index].vma_use_count)
 		v4l2_buf->flags |= V4L2_BUF_FLAG_MAPPED;
 
 
-	switch (myuvc_queue.buffer[v4l2_buf->index].state) {
+	switch (dev->queue.buffer[v4l2_buf->index].state) {
     	case VIDEOBUF_ERROR:
     	case VIDEOBUF_DONE:
     		v4l2_buf->flags |= V4L2_BUF_FLAG_DONE;
@@ -830,6 +1721,7 @@ static int myuvc_vidioc_querybuf(struct file *file, void *priv, struct v4l2_buff
 	}
 
 done:    
+	mutex_unlock(&dev->queue.mutex);
 	return ret;
 
 }
@@ -837,45 +1729,78 @@ done:
 /* S10 把缓冲区放入队列, 并打开IO */
 static int myuvc_vidioc_qbuf(struct file *file, void *priv, struct v4l2_buffer *v4l2_buf)
 {
+	struct myuvc_device *dev = video_drvdata(file);
 	 struct myuvc_buffer *buf;
+	unsigned long flags;
+	int ret = 0;
 
     /* 0. APP传入的v4l2_buf可能有问题, 要做判断 */
 
-	if (v4l2_buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
-	    v4l2_buf->memory != V4L2_MEMORY_MMAP) {
+	if (v4l2_buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
 		return -EINVAL;
 	}
 
-	if (v4l2_buf->index >= myuvc_queue.count) {
-		return -EINVAL;
+	mutex_lock(&dev->queue.mutex);
+	if (v4l2_buf->index >= dev->queue.count ||
+	    v4l2_buf->memory != dev->queue.memory) {
+		ret = -EINVAL;
+		goto done;
 	}
 
-    buf = &myuvc_queue.buffer[v4l2_buf->index];
+    buf = &dev->queue.buffer[v4l2_buf->index];
 
 	if (buf->state != VIDEOBUF_IDLE) {
-		return -EINVAL;
+		ret = -EINVAL;
+		goto done;
+	}
+
+	/* USERPTR: APP每次可以传入不同的内存, 和上次相同时不用重新锁定 */
+	if (dev->queue.memory == V4L2_MEMORY_USERPTR &&
+	    (buf->pages == NULL || buf->buf.m.userptr != v4l2_buf->m.userptr ||
+	     buf->buf.length != v4l2_buf->length)) {
+		myuvc_buffer_unpin(buf);
+		if (v4l2_buf->m.userptr == 0 || v4l2_buf->length == 0) {
+			ret = -EINVAL;
+			goto done;
+		}
+		if ((ret = myuvc_buffer_pin(buf, v4l2_buf->m.userptr,
+					    v4l2_buf->length)) < 0)
+			goto done;
 	}
 
     /* 1. 修改状态 */
 	buf->state = VIDEOBUF_QUEUED;
 	buf->buf.bytesused = 0;
+	buf->buf.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	buf->buf.reserved = 0;
+	buf->pts_valid = 0;
+	buf->error = 0;
+	buf->complete = 0;
 
     /* 2. 放入2个队列 */
     /* 队列1: 供APP使用 
      * 当缓冲区没有数据时,放入mainqueue队列
      * 当缓冲区有数据时, APP从mainqueue队列中取出
      */
-	list_add_tail(&buf->stream, &myuvc_queue.mainqueue);
+	list_add_tail(&buf->stream, &dev->queue.mainqueue);
 
     /* 队列2: 供产生数据的函数使用
      * 当采集到数据时,从irqqueue队列中取出第1个缓冲区,存入数据
+     * URB完成函数会同时修改irqqueue, 要关中断加锁
      */
-	list_add_tail(&buf->irq, &myuvc_queue.irqqueue);
-    
-	return 0;
+	spin_lock_irqsave(&dev->queue.irqlock, flags);
+	list_add_tail(&buf->irq, &dev->queue.irqqueue);
+	spin_unlock_irqrestore(&dev->queue.irqlock, flags);
+
+	trace_myuvc_qbuf(dev->vdev->num, buf->buf.index);
+
+done:
+	mutex_unlock(&dev->queue.mutex);
+	return ret;
 }
 
-static int myuvc_try_streaming_params(struct myuvc_streaming_control *ctrl)
+static int myuvc_try_streaming_params(struct myuvc_device *dev,
+		struct myuvc_streaming_control *ctrl)
 {
 	__u8 *data;
     __u16 size;
@@ -886,11 +1811,11 @@ static int myuvc_try_streaming_params(struct myuvc_streaming_control *ctrl)
 	memset(ctrl, 0, sizeof *ctrl);
     
 	ctrl->bmHint = 1;	/* dwFrameInterval */
-	ctrl->bFormatIndex = 1;
-	ctrl->bFrameIndex  = frame_idx + 1;
-	ctrl->dwFrameInterval = 333333;
+	ctrl->bFormatIndex = dev->cur_format->index;
+	ctrl->bFrameIndex  = dev->cur_frame->bFrameIndex;
+	ctrl->dwFrameInterval = dev->frame_interval;
 
-    size = myuvc_version >= 0x0110 ? 34 : 26;
+    size = dev->uvc_version >= 0x0110 ? 34 : 26;
     data = kzalloc(size, GFP_KERNEL);
     if (data == NULL)
         return -ENOMEM;
@@ -915,12 +1840,12 @@ static int myuvc_try_streaming_params(struct myuvc_streaming_control *ctrl)
         data[33] = ctrl->bMaxVersion;
     }
 
-    pipe = (GET_CUR & 0x80) ? usb_rcvctrlpipe(mydev, 0)
-                  : usb_sndctrlpipe(mydev, 0);
-    type |= (GET_CUR & 0x80) ? USB_DIR_IN : USB_DIR_OUT;
+    pipe = (SET_CUR & 0x80) ? usb_rcvctrlpipe(dev->udev, 0)
+                  : usb_sndctrlpipe(dev->udev, 0);
+    type |= (SET_CUR & 0x80) ? USB_DIR_IN : USB_DIR_OUT;
 
-    ret = usb_control_msg(mydev, pipe, GET_CUR, type, 0x01 << 8,
-            0 << 8 | myuvc_streaming_intf, data, size, 5000);
+    ret = usb_control_msg(dev->udev, pipe, SET_CUR, type, VS_PROBE_CONTROL << 8,
+            0 << 8 | dev->streaming_intf, data, size, 5000);
 
     kfree(data);
     
@@ -928,7 +1853,8 @@ static int myuvc_try_streaming_params(struct myuvc_streaming_control *ctrl)
     
 }
 
-static int myuvc_get_streaming_params(struct myuvc_streaming_control *ctrl)
+static int myuvc_get_streaming_params(struct myuvc_device *dev,
+		struct myuvc_streaming_control *ctrl)
 {
 	__u8 *data;
 	__u16 size;
@@ -936,17 +1862,17 @@ static int myuvc_get_streaming_params(struct myuvc_streaming_control *ctrl)
 	unsigned int pipe;
 	int ret;
 
-	size = myuvc_version >= 0x0110 ? 34 : 26;
+	size = dev->uvc_version >= 0x0110 ? 34 : 26;
 	data = kmalloc(size, GFP_KERNEL);
 	if (data == NULL)
 		return -ENOMEM;
 
-	pipe  = (GET_CUR & 0x80) ? usb_rcvctrlpipe(mydev, 0)
-			      : usb_sndctrlpipe(mydev, 0);
+	pipe  = (GET_CUR & 0x80) ? usb_rcvctrlpipe(dev->udev, 0)
+			      : usb_sndctrlpipe(dev->udev, 0);
 	type |= (GET_CUR & 0x80) ? USB_DIR_IN : USB_DIR_OUT;
 
-	ret = usb_control_msg(mydev, pipe, GET_CUR, type, 0x01 << 8,
-			0 << 8 | myuvc_streaming_intf, data, size, 5000);
+	ret = usb_control_msg(dev->udev, pipe, GET_CUR, type, VS_PROBE_CONTROL << 8,
+			0 << 8 | dev->streaming_intf, data, size, 5000);
 	if(ret < 0)
 		goto done;
 
@@ -969,7 +1895,7 @@ static int myuvc_get_streaming_params(struct myuvc_streaming_control *ctrl)
 		ctrl->bMinVersion = data[32];
 		ctrl->bMaxVersion = data[33];
 	} else {
-		//ctrl->dwClockFrequency = stream->dev->clock_frequency;
+		ctrl->dwClockFrequency = dev->clock_frequency;
 		ctrl->bmFramingInfo = 0;
 		ctrl->bPreferedVersion = 0;
 		ctrl->bMinVersion = 0;
@@ -982,7 +1908,8 @@ done:
 	return (ret < 0) ? ret : 0;
 }
 
-static int myuvc_set_streaming_params(struct myuvc_streaming_control *ctrl)
+static int myuvc_set_streaming_params(struct myuvc_device *dev,
+		struct myuvc_streaming_control *ctrl)
 {
 	__u8 *data;
 	__u16 size;
@@ -990,7 +1917,7 @@ static int myuvc_set_streaming_params(struct myuvc_streaming_control *ctrl)
 	unsigned int pipe;
 	int ret;
 
-	size = myuvc_version >= 0x0110 ? 34 : 26;
+	size = dev->uvc_version >= 0x0110 ? 34 : 26;
 	data = kzalloc(size, GFP_KERNEL);
 	if (data == NULL)
 		return -ENOMEM;
@@ -1015,12 +1942,12 @@ static int myuvc_set_streaming_params(struct myuvc_streaming_control *ctrl)
 		data[33] = ctrl->bMaxVersion;
 	}
 
-	pipe  = (GET_CUR & 0x80) ? usb_rcvctrlpipe(mydev, 0)
-			      : usb_sndctrlpipe(mydev, 0);
-	type |= (GET_CUR & 0x80) ? USB_DIR_IN : USB_DIR_OUT;
+	pipe  = (SET_CUR & 0x80) ? usb_rcvctrlpipe(dev->udev, 0)
+			      : usb_sndctrlpipe(dev->udev, 0);
+	type |= (SET_CUR & 0x80) ? USB_DIR_IN : USB_DIR_OUT;
 
-	ret = usb_control_msg(mydev, pipe, GET_CUR, type, 0x01 << 8,
-			0 << 8 | myuvc_streaming_intf, data, size, 5000);
+	ret = usb_control_msg(dev->udev, pipe, SET_CUR, type, VS_COMMIT_CONTROL << 8,
+			0 << 8 | dev->streaming_intf, data, size, 5000);
 
 	kfree(data);
 
@@ -1049,644 +1976,4188 @@ static void myuvc_print_streaming_params(struct myuvc_streaming_control *ctrl)
 }
 
 
-static int myuvc_uninit_video(void)
+/* 帧间隔(单位100ns)转换为V4L2的分数形式(单位秒) */
+static void myuvc_interval_to_fract(__u32 interval, struct v4l2_fract *fract)
 {
-	int i;
-	for(i = 0; i < UVC_URBS; ++i)
-	{
-		usb_buffer_free(mydev, myuvc_queue.urb_size,
-				myuvc_queue.urb_buffer[i], myuvc_queue.urb_dma[i]);
-		myuvc_queue.urb_buffer[i] = NULL;
+	__u32 a = interval, b = 10000000, t;
 
-		usb_free_urb(myuvc_queue.urb[i]);
-		myuvc_queue.urb[i] = NULL;
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
 	}
 
-	return 0;
-}
+	if (a == 0)
+		a = 1;
 
+	fract->numerator   = interval / a;
+	fract->denominator = 10000000 / a;
+}
 
-static void myuvc_video_complete(struct urb *urb)
+/* 在帧描述符给出的帧间隔中找出与要求的值最接近的那个 */
+static __u32 myuvc_find_closest_interval(struct uvc_frame *frame, __u32 interval)
 {
-	u8 *src;
-    u8 *dest;
-	int ret, i;
-    int len;
-    int maxlen;
-    int nbytes;
-    struct myuvc_buffer *buf;
-	static int fid;
+	__u32 best = frame->dwDefaultFrameInterval;
+	__u32 d, maxd = (__u32)-1;
+	__u32 imin, imax, istep;
+	unsigned int i;
 
-    // 要修改影像資料，必須先宣告一個特別型態的指標變數，才能正確存取記憶體中的資料
-    unsigned char *point_mem;
-    static unsigned char *mem_temp = NULL;
+	if (frame->bFrameIntervalType) {
+		for (i = 0; i < frame->bFrameIntervalType; ++i) {
+			d = abs((int)(frame->dwFrameInterval[i] - interval));
+			if (d < maxd) {
+				maxd = d;
+				best = frame->dwFrameInterval[i];
+			}
+		}
+		return best;
+	}
 
-    // 初始化暫存用的記憶體位置
-    static unsigned int nArrayTemp_Size = 1000;
+	/* 连续的帧间隔: min, max, step */
+	imin  = frame->dwFrameInterval[0];
+	imax  = frame->dwFrameInterval[1];
+	istep = frame->dwFrameInterval[2];
 
-	u8* mem;
-	int data_len;
-    
-	switch (urb->status) {
-	case 0:
-		break;
+	interval = clamp(interval, imin, imax);
+	if (istep)
+		interval = imin + (interval - imin + istep / 2) / istep * istep;
 
-	default:
-		printk("Non-zero status (%d) in video "
-			"completion handler.\n", urb->status);
-		return;
-	}
+	return min(interval, imax);
+}
 
-    /* 从irqqueue队列中取出第1个缓冲区 */
-	if (!list_empty(&myuvc_queue.irqqueue))
-	{
-		buf = list_first_entry(&myuvc_queue.irqqueue, struct myuvc_buffer, irq);
-	}
-	else
-	{
-		buf = NULL;
-	}
-    
+/* 返回当前使用的帧率 */
+static int myuvc_vidioc_g_parm(struct file *file, void *priv,
+				struct v4l2_streamparm *parm)
+{
+	struct myuvc_device *dev = video_drvdata(file);
 
-	for (i = 0; i < urb->number_of_packets; ++i) {
-		if (urb->iso_frame_desc[i].status < 0) {
-			//printk("USB isochronous frame "
-			//	"lost (%d).\n", urb->iso_frame_desc[i].status);
+	if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+
+	memset(parm, 0, sizeof *parm);
+	parm->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+	parm->parm.capture.capturemode = 0;
+	parm->parm.capture.readbuffers = 0;
+	myuvc_interval_to_fract(dev->frame_interval,
+				&parm->parm.capture.timeperframe);
+
+	return 0;
+}
+
+/* 设置帧率: 先对照帧描述符选出支持的帧间隔, 再通过PROBE控制和摄像头协商,
+ * 协商结果在STREAMON时提交(COMMIT), 并用来选择setting和URB的大小
+ */
+static int myuvc_vidioc_s_parm(struct file *file, void *priv,
+				struct v4l2_streamparm *parm)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	struct v4l2_fract *timeperframe = &parm->parm.capture.timeperframe;
+	__u32 interval, old_interval;
+	int ret;
+
+	if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+
+	/* STREAMON也会改写streaming_ctl */
+	mutex_lock(&dev->queue.mutex);
+
+	/* 传输过程中不能修改, 否则带宽会变化 */
+	if (dev->streaming) {
+		ret = -EBUSY;
+		goto done;
+	}
+
+	if (timeperframe->numerator == 0 || timeperframe->denominator == 0)
+		interval = dev->cur_frame->dwDefaultFrameInterval;
+	else
+		interval = div_u64((u64)timeperframe->numerator * 10000000,
+				   timeperframe->denominator);
+
+	old_interval = dev->frame_interval;
+	dev->frame_interval = myuvc_find_closest_interval(dev->cur_frame, interval);
+
+	/* 问一下摄像头实际能用的帧间隔, 失败时保持原来的帧间隔 */
+	ret = myuvc_try_streaming_params(dev, &dev->streaming_ctl);
+	if (ret == 0)
+		ret = myuvc_get_streaming_params(dev, &dev->streaming_ctl);
+	if (ret < 0) {
+		dev->frame_interval = old_interval;
+		goto done;
+	}
+	if (dev->streaming_ctl.dwFrameInterval)
+		dev->frame_interval = dev->streaming_ctl.dwFrameInterval;
+
+done:
+	mutex_unlock(&dev->queue.mutex);
+	if (ret < 0)
+		return ret;
+
+	return myuvc_vidioc_g_parm(file, priv, parm);
+}
+
+static int myuvc_uninit_video(struct myuvc_device *dev)
+{
+	int i;
+	for(i = 0; i < UVC_URBS; ++i)
+	{
+		usb_buffer_free(dev->udev, dev->queue.urb_size,
+				dev->queue.urb_buffer[i], dev->queue.urb_dma[i]);
+		dev->queue.urb_buffer[i] = NULL;
+
+		usb_free_urb(dev->queue.urb[i]);
+		dev->queue.urb[i] = NULL;
+	}
+
+	return 0;
+}
+
+
+/* 记录payload头部中的SCR. 头部格式:
+ * data[0] 头部长度, data[1] 标志, 之后依次是PTS(4字节), SCR(STC 4字节 + SOF 2字节)
+ */
+static void myuvc_clock_add_sample(struct myuvc_device *dev, const __u8 *data)
+{
+	struct myuvc_clock_sample *sample;
+	unsigned int offset = (data[1] & UVC_STREAM_PTS) ? 6 : 2;
+	__u16 dev_sof;
+
+	if (data[0] < offset + 6)
+		return;
+
+	dev_sof = get_unaligned_le16(&data[offset + 4]) & 0x7ff;
+
+	/* 同一个USB帧里的payload只记录一次 */
+	if (dev->clock.count) {
+		sample = &dev->clock.samples[(dev->clock.head + MYUVC_CLOCK_SAMPLES - 1)
+					     % MYUVC_CLOCK_SAMPLES];
+		if (sample->dev_sof == dev_sof)
+			return;
+	}
+
+	sample = &dev->clock.samples[dev->clock.head];
+	sample->dev_stc   = get_unaligned_le32(&data[offset]);
+	sample->dev_sof   = dev_sof;
+	sample->host_sof  = dev->decode_sof;
+	sample->host_time = dev->decode_time;
+
+	dev->clock.head = (dev->clock.head + 1) % MYUVC_CLOCK_SAMPLES;
+	if (dev->clock.count < MYUVC_CLOCK_SAMPLES)
+		dev->clock.count++;
+}
+
+/* 把这一帧的PTS换算成主机的单调时间:
+ * 1. 最近的SCR样本给出设备在USB帧dev_sof时的时钟, 由时钟频率算出PTS比这个帧早多久
+ * 2. USB帧dev_sof开始的时间 = URB完成时间 - 相差的帧数 * 1ms. URB完成的时间
+ *    有中断和调度的延迟, 所以在所有样本算出的值中取最小的, 滤掉这些抖动
+ * 没有PTS或SCR的摄像头, 使用第1个payload到达的时间
+ */
+static void myuvc_clock_timestamp(struct myuvc_device *dev, struct myuvc_buffer *buf)
+{
+	struct myuvc_clock_sample *last, *sample;
+	s64 sof_ns = 0, ns;
+	unsigned int i;
+	int frames, found = 0;
+
+	if (!buf->pts_valid || dev->clock.count == 0 || dev->clock.frequency == 0)
+		return;
+
+	last = &dev->clock.samples[(dev->clock.head + MYUVC_CLOCK_SAMPLES - 1)
+				   % MYUVC_CLOCK_SAMPLES];
+
+	for (i = 0; i < dev->clock.count; ++i) {
+		sample = &dev->clock.samples[i];
+
+		/* 主机的帧号可能只有10位(EHCI), 相差太远的样本不使用 */
+		frames = (sample->host_sof - last->dev_sof) & 0x3ff;
+		if (frames >= 512)
+			frames -= 1024;
+		if (frames < -256 || frames > 256)
 			continue;
+
+		ns = ktime_to_ns(sample->host_time) - (s64)frames * NSEC_PER_MSEC;
+		if (!found || ns < sof_ns) {
+			sof_ns = ns;
+			found = 1;
 		}
+	}
 
-        src  = urb->transfer_buffer + urb->iso_frame_desc[i].offset;
+	if (!found)
+		return;
 
+	ns = sof_ns - div_s64((s64)(__s32)(last->dev_stc - buf->pts) * NSEC_PER_SEC,
+			      dev->clock.frequency);
+	buf->buf.timestamp = ktime_to_timeval(ns_to_ktime(ns));
+	buf->buf.flags |= V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+}
 
-        len = urb->iso_frame_desc[i].actual_length;
-        /* 判断数据是否有效 */
-        /* URB数据含义:
-         * data[0] : 头部长度
-         * data[1] : 错误状态
-         */
-        if (len < 2 || src[0] < 2 || src[0] > len)
-            continue;
-        
-        /* Skip payloads marked with the error bit ("error frames"). */
-        if (src[1] & UVC_STREAM_ERR) {
-            //printk("Dropping payload (error bit set).\n");
-            continue;
-        }
+/* 已经填满但APP还没有取走的缓冲区中最新(newest = 1)或最旧的一个, 不包括except.
+ * 只有myuvc_queue_next_buffer在irqlock中把缓冲区从irqqueue删除时才设置VIDEOBUF_DONE,
+ * 所以找到的缓冲区都已经不在irqqueue中. 调用者持有irqlock
+ */
+static struct myuvc_buffer *myuvc_queue_done(struct myuvc_device *dev,
+		struct myuvc_buffer *except, int newest)
+{
+	struct myuvc_buffer *buf, *found = NULL;
+	unsigned int i;
+	__s32 age;
 
-	    /* ip2970/ip2977 */
-	    if (mydev->descriptor.idVendor == 0x1B3B)
-	    {
-	        if ( len >= 16 ) // have data in buffer
-	        {
-	            // 資料必須從data[12]開始判斷，是因為前面的資料是封包專用
-	            if ( (src[12]==0xFF && src[13]==0xD8 && src[14]==0xFF) ||
-	                (src[12]==0xD8 && src[13]==0xFF && src[14]==0xC4)) 
-	            {
-	                if(last_fid)
-	                    fid &= ~UVC_STREAM_FID;
-	                else
-	                    fid |= UVC_STREAM_FID;
-	            }
-	        }
-	    }
-	    else
-	    {
-	    	fid = src[1] & UVC_STREAM_FID;
-	    }
-
-		/* Store the payload FID bit and return immediately when the buffer is
-		 * NULL.
-		 */
-		if (buf == NULL) {
-			last_fid = fid;
+	for (i = 0; i < dev->queue.count; ++i) {
+		buf = &dev->queue.buffer[i];
+		if (buf == except || buf->state != VIDEOBUF_DONE)
 			continue;
+		if (found != NULL) {
+			age = (__s32)(buf->buf.sequence - found->buf.sequence);
+			if (newest ? age < 0 : age > 0)
+				continue;
 		}
+		found = buf;
+	}
 
-		/* 根据FID判断当前帧的数据是否结束 */
-		if (buf->state != VIDEOBUF_ACTIVE) {   /* != VIDEOBUF_ACTIVE, 表示"之前还未接收数据" */			
-			if (fid == last_fid) {
-				/* 既然你刚开始接收数据, 那么FID应该是一个新的值,不应该等于原来的last_fid */
-				continue;
-			}
+	return found;
+}
 
-			/* 表示开始接收第1个数据 */
-			buf->state = VIDEOBUF_ACTIVE;
-		}
+/* latest_frame: 把一个填满的缓冲区重新放入irqqueue接收数据, 调用者持有irqlock */
+static void myuvc_queue_recycle(struct myuvc_device *dev, struct myuvc_buffer *buf)
+{
+	buf->state = VIDEOBUF_QUEUED;
+	buf->buf.bytesused = 0;
+	buf->buf.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	buf->buf.reserved = 0;
+	buf->pts_valid = 0;
+	buf->error = 0;
+	buf->complete = 0;
+	list_add_tail(&buf->irq, &dev->queue.irqqueue);
+	MYUVC_STATS_INC(dev, frames_recycled);
+}
+
+/* 从irqqueue中删除已经填满的缓冲区, 唤醒等待数据的进程,
+ * 并返回下一个可以存放数据的缓冲区
+ */
+static struct myuvc_buffer *myuvc_queue_next_buffer(struct myuvc_device *dev,
+		struct myuvc_buffer *buf)
+{
+	struct myuvc_buffer *nextbuf, *oldest;
+	unsigned long flags;
+	s64 latency;
+
+	myuvc_clock_timestamp(dev, buf);
+
+	if (buf->error) {
+		MYUVC_STATS_INC(dev, frames_error);
+		if (buf->error & MYUVC_BUF_PACKET_LOST)
+			MYUVC_STATS_INC(dev, frames_packet_lost);
+		if (buf->error & MYUVC_BUF_STREAM_ERR)
+			MYUVC_STATS_INC(dev, frames_stream_err);
+	}
+	MYUVC_STATS_INC(dev, frames);
 
-		/* fid != last_fid 表示开始新一帧了 */
-		if (fid != last_fid && buf->buf.bytesused != 0) {
-			buf->state = VIDEOBUF_DONE;
+	/* 序号, 状态和从irqqueue删除在同一个irqlock中完成,
+	 * DQBUF/poll看到VIDEOBUF_DONE时缓冲区已经不属于完成函数了
+	 */
+	spin_lock_irqsave(&dev->queue.irqlock, flags);
+	buf->buf.sequence = dev->sequence++;
+	if (buf->error)
+		buf->buf.flags |= V4L2_BUF_FLAG_ERROR;
+	buf->state = VIDEOBUF_DONE;
+	trace_myuvc_buffer_done(dev->vdev->num, buf->buf.index, buf->buf.sequence,
+				buf->buf.bytesused, buf->error);
+	list_del(&buf->irq);
+	/* latest_frame: 不让irqqueue变空, 刚完成的一帧留给APP */
+	if (dev->latest && list_empty(&dev->queue.irqqueue) &&
+	    (oldest = myuvc_queue_done(dev, buf, 0)) != NULL)
+		myuvc_queue_recycle(dev, oldest);
+	if (!list_empty(&dev->queue.irqqueue))
+		nextbuf = list_first_entry(&dev->queue.irqqueue, struct myuvc_buffer, irq);
+	else
+		nextbuf = NULL;
+	spin_unlock_irqrestore(&dev->queue.irqlock, flags);
 
-			/* 从队列中删除, 唤醒进程 */
-	        list_del(&buf->irq);
-	        wake_up(&buf->wait);
+	wake_up(&dev->queue.wait);
+	trace_myuvc_wakeup(dev->vdev->num, buf->buf.index);
 
-			mem = myuvc_queue.mem + buf->buf.m.offset;
-			data_len = buf->buf.bytesused;
-			//printk("wake_up %d : %s %d, start data: %02x %02x, end data: %02x %02x", wake_cnt++, __FUNCTION__, __LINE__, mem[0], mem[1], mem[data_len - 2], mem[data_len - 1]);
+	latency = ktime_to_ns(ktime_sub(ktime_get(), dev->decode_time));
+	dev->timing.frames++;
+	dev->timing.latency_ns_total += latency;
+	if (latency > dev->timing.latency_ns_max)
+		dev->timing.latency_ns_max = latency;
 
-			/* 取出下一个buf */
-			if (!list_empty(&myuvc_queue.irqqueue))
-			{
-				buf = list_first_entry(&myuvc_queue.irqqueue, struct myuvc_buffer, irq);
-			}
-			else
+	return nextbuf;
+}
+
+/* 解析payload头部
+ * 返回值: >= 0    : 头部长度
+ *         -EAGAIN : 当前缓冲区已经结束(新的一帧开始), 要用下一个缓冲区再次解析
+ *         其他    : 丢弃这个payload
+ *
+ * 以下几个函数的quirk参数都是常量, 展开到myuvc_video_decode_*里以后,
+ * 普通摄像头的解析代码里不会有任何quirk相关的判断
+ */
+static __always_inline int myuvc_video_decode_start(struct myuvc_device *dev,
+		struct myuvc_buffer *buf, const __u8 *data, int len, const int quirk)
+{
+	int fid;
+
+	/* 判断数据是否有效 */
+	/* URB数据含义:
+	 * data[0] : 头部长度
+	 * data[1] : 错误状态
+	 */
+	if (len < 2 || data[0] < 2 || data[0] > len) {
+		MYUVC_STATS_INC(dev, packets_error);
+		return -EINVAL;
+	}
+
+	/* Skip payloads marked with the error bit ("error frames"). */
+	if (data[1] & UVC_STREAM_ERR) {
+		MYUVC_STATS_INC(dev, packets_error);
+		if (buf != NULL)
+			buf->error |= MYUVC_BUF_STREAM_ERR;
+		return -ENODATA;
+	}
+
+	/* 没有缓冲区时也记录SCR, 时钟的对应关系与缓冲区无关 */
+	if (data[1] & UVC_STREAM_SCR)
+		myuvc_clock_add_sample(dev, data);
+
+	/* ip2970/ip2977 */
+	if (quirk && (dev->quirks & UVC_QUIRK_STREAM_NO_FID))
+	{
+		/* 这类摄像头的FID位不可靠, 收到JPEG文件头时才认为是新的一帧 */
+		fid = dev->last_fid;
+		if ( len >= 16 ) // have data in buffer
+		{
+			// 資料必須從data[12]開始判斷，是因為前面的資料是封包專用
+			if ( (data[12]==0xFF && data[13]==0xD8 && data[14]==0xFF) ||
+				(data[12]==0xD8 && data[13]==0xFF && data[14]==0xC4))
 			{
-				buf = NULL;
+				fid = dev->last_fid ? 0 : UVC_STREAM_FID;
 			}
+		}
+	}
+	else
+	{
+		fid = data[1] & UVC_STREAM_FID;
+	}
+
+	/* Store the payload FID bit and return immediately when the buffer is
+	 * NULL.
+	 */
+	if (fid != dev->last_fid)
+		trace_myuvc_fid(dev->vdev->num, buf ? (int)buf->buf.index : -1, fid);
+
+	if (buf == NULL) {
+		/* 没有缓冲区, 这一帧被丢掉, 序号也要增加, APP才能发现丢帧 */
+		if (fid != dev->last_fid) {
+			dev->sequence++;
+			MYUVC_STATS_INC(dev, frames_dropped);
+		}
+		dev->last_fid = fid;
+		return -ENODATA;
+	}
+
+	/* 根据FID判断当前帧的数据是否结束 */
+	if (buf->state != VIDEOBUF_ACTIVE) {   /* != VIDEOBUF_ACTIVE, 表示"之前还未接收数据" */
+		if (fid == dev->last_fid) {
+			/* 既然你刚开始接收数据, 那么FID应该是一个新的值,不应该等于原来的last_fid */
+			return -ENODATA;
+		}
+
+		/* 表示开始接收第1个数据, 先用URB完成的时间作为这一帧的时间戳 */
+		buf->state = VIDEOBUF_ACTIVE;
+		buf->first_time = dev->decode_time;
+		buf->buf.timestamp = ktime_to_timeval(dev->decode_time);
+	}
+
+	/* fid != last_fid 表示开始新一帧了,
+	 * 当前缓冲区结束, 这个payload属于下一个缓冲区
+	 */
+	if (fid != dev->last_fid && buf->buf.bytesused != 0) {
+		buf->complete = 1;
+		return -EAGAIN;
+	}
+
+	dev->last_fid = fid;
+
+	/* 一帧中所有payload的PTS都相同, 记录第1个 */
+	if (!buf->pts_valid && (data[1] & UVC_STREAM_PTS) && data[0] >= 6) {
+		buf->pts = get_unaligned_le32(&data[2]);
+		buf->pts_valid = 1;
+	}
+
+	return data[0];
+}
+
+/* 把payload中的视频数据复制到缓冲区 */
+static __always_inline void myuvc_video_decode_data(struct myuvc_device *dev,
+		struct myuvc_buffer *buf, const __u8 *data, int len, const int quirk)
+{
+	u8 *dest;
+	int maxlen;
+	int nbytes;
+
+	if (len <= 0)
+		return;
+
+	dest = buf->mem + buf->buf.bytesused;
+
+	/* 缓冲区最多还能存多少数据 */
+	maxlen = buf->buf.length - buf->buf.bytesused;
+
+	/* ip2970/ip2977: 每帧第1个payload的JPEG数据以 D8 FF C4 开头,
+	 * 丢失了SOI标记(FF D8)的第1个字节0xFF, 复制时直接在缓冲区中补上,
+	 * 不需要额外分配内存, 也不需要多复制一次
+	 */
+	if (quirk && (dev->quirks & MYUVC_QUIRK_FIX_SOI) && buf->buf.bytesused == 0 &&
+	    len >= 3 && data[0] == 0xD8 && data[1] == 0xFF && data[2] == 0xC4) {
+		*dest++ = 0xFF;
+		buf->buf.bytesused++;
+		maxlen--;
+	}
+
+	nbytes = min(len, maxlen);
+
+	/* 复制数据 */
+	memcpy(dest, data, nbytes);
+	buf->buf.bytesused += nbytes;
+	MYUVC_STATS_ADD(dev, bytes, nbytes);
+
+	/* 缓冲区满了, 这一帧剩下的数据被丢掉 */
+	if (len > maxlen) {
+		buf->error |= MYUVC_BUF_TRUNCATED;
+		MYUVC_STATS_INC(dev, frames_truncated);
+		buf->complete = 1;
+	}
+}
+
+/* 根据payload头部的EOF位判断一帧是否结束 */
+static void myuvc_video_decode_end(struct myuvc_device *dev, struct myuvc_buffer *buf,
+		const __u8 *data, int len)
+{
+	/* Mark the buffer as done if the EOF marker is set. */
+	if (data[1] & UVC_STREAM_EOF && buf->buf.bytesused != 0) {
+		trace_myuvc_eof(dev->vdev->num, buf->buf.index, buf->buf.bytesused);
+		// printk("Frame complete (EOF found).\n");
+		//if (len == 0)
+		//     printk("EOF in empty payload.\n");
+		buf->complete = 1;
+	}
+}
+
+/* 同步传输: 一个URB里有多个packet, 每个packet都是一个完整的payload */
+static __always_inline void __myuvc_video_decode_isoc(struct myuvc_device *dev,
+		struct urb *urb, struct myuvc_buffer *buf, const int quirk)
+{
+	u8 *mem;
+	int ret, i;
+
+	MYUVC_STATS_ADD(dev, packets, urb->number_of_packets);
+
+	for (i = 0; i < urb->number_of_packets; ++i) {
+		if (urb->iso_frame_desc[i].status < 0) {
+			//printk("USB isochronous frame "
+			//	"lost (%d).\n", urb->iso_frame_desc[i].status);
+			MYUVC_STATS_INC(dev, packets_lost);
+			if (buf != NULL)
+				buf->error |= MYUVC_BUF_PACKET_LOST;
 			continue;
 		}
-		last_fid = fid;
-
-        dest = myuvc_queue.mem + buf->buf.m.offset + buf->buf.bytesused;
-
-        /* 除去头部后的数据长度 */
-        len -= src[0];
-
-        /* 缓冲区最多还能存多少数据 */
-        maxlen = buf->buf.length - buf->buf.bytesused;
-        nbytes = min(len, maxlen);
-
-        /* 复制数据 */
-        memcpy(dest, src + src[0], nbytes);
-        buf->buf.bytesused += nbytes;
-
-	    /* ip2970/ip2977 */
-	    if (mydev->descriptor.idVendor == 0x1B3B)
-	    {
-	        if(mem_temp == NULL) {
-	            mem_temp = kmalloc(nArrayTemp_Size, GFP_KERNEL);
-	        }
-	        else if(nArrayTemp_Size <= nbytes){ // 當收到的資料長度大於上一次的資料長度，則重新分配所需的空間+
-	            kfree(mem_temp);
-	            nArrayTemp_Size += 500;
-	            mem_temp = kmalloc(nArrayTemp_Size, GFP_KERNEL);
-	        }
-	        memset(mem_temp, 0x00, nArrayTemp_Size);
-	        
-	        // 指向資料儲存的記憶體位置
-	        point_mem = (unsigned char *)dest;
-	        if( *(point_mem) == 0xD8 && *(point_mem + 1) == 0xFF && *(point_mem + 2) == 0xC4){
-	            memcpy( mem_temp + 1, point_mem, nbytes);
-	            mem_temp[0] = 0xFF;
-	            memcpy(point_mem, mem_temp, nbytes + 1);
-	        }
-	    }
-
-
-
-        /* 判断一帧数据是否已经全部接收到 */
-        if (len > maxlen) {
-            buf->state = VIDEOBUF_DONE;
-        }
-        
-        /* Mark the buffer as done if the EOF marker is set. */
-        if (src[1] & UVC_STREAM_EOF && buf->buf.bytesused != 0) {
-           // printk("Frame complete (EOF found).\n");
-            //if (len == 0)
-           //     printk("EOF in empty payload.\n");
-            buf->state = VIDEOBUF_DONE;
-        }
 
-	    /* 当接收完一帧数据, 
-	     * 从irqqueue中删除这个缓冲区
-	     * 唤醒等待数据的进程 
-	     */
-	    if (buf->state == VIDEOBUF_DONE ||
-	        buf->state == VIDEOBUF_ERROR)
-	    {
-	        list_del(&buf->irq);
-	        wake_up(&buf->wait);
-
-			mem = myuvc_queue.mem + buf->buf.m.offset;
-			data_len = buf->buf.bytesused;
-			//printk("wake_up %d : %s %d, start data: %02x %02x, end data: %02x %02x", wake_cnt++, __FUNCTION__, __LINE__, mem[0], mem[1], mem[data_len - 2], mem[data_len - 1]);
-			
-			/* 取出下一个buf */
-			if (!list_empty(&myuvc_queue.irqqueue))
-			{
-				buf = list_first_entry(&myuvc_queue.irqqueue, struct myuvc_buffer, irq);
-			}
-			else
-			{
-				buf = NULL;
-			}
-	    }
+		/* Decode the payload header. */
+		mem = urb->transfer_buffer + urb->iso_frame_desc[i].offset;
+		do {
+			ret = myuvc_video_decode_start(dev, buf, mem,
+				urb->iso_frame_desc[i].actual_length, quirk);
+			if (ret == -EAGAIN)
+				buf = myuvc_queue_next_buffer(dev, buf);
+		} while (ret == -EAGAIN);
 
+		if (ret < 0)
+			continue;
+
+		/* Decode the payload data. */
+		myuvc_video_decode_data(dev, buf, mem + ret,
+			urb->iso_frame_desc[i].actual_length - ret, quirk);
+
+		/* Process the header again. */
+		myuvc_video_decode_end(dev, buf, mem,
+			urb->iso_frame_desc[i].actual_length);
+
+		/* 当接收完一帧数据,
+		 * 从irqqueue中删除这个缓冲区
+		 * 唤醒等待数据的进程
+		 */
+		if (buf->complete)
+			buf = myuvc_queue_next_buffer(dev, buf);
+	}
+}
+
+/* 批量传输: 一个payload可能跨越多个URB, 只有第1个URB带有头部,
+ * 收到比URB长度短的数据或者payload达到dwMaxPayloadTransferSize时payload结束
+ */
+static __always_inline void __myuvc_video_decode_bulk(struct myuvc_device *dev,
+		struct urb *urb, struct myuvc_buffer *buf, const int quirk)
+{
+	u8 *mem;
+	int len, ret;
+
+	if (urb->actual_length == 0)
+		return;
+
+	mem = urb->transfer_buffer;
+	len = urb->actual_length;
+	dev->bulk.payload_size += len;
+
+	/* If the URB is the first of its payload, decode and save the
+	 * header.
+	 */
+	if (dev->bulk.header_size == 0 && !dev->bulk.skip_payload) {
+		MYUVC_STATS_INC(dev, packets);
+		do {
+			ret = myuvc_video_decode_start(dev, buf, mem, len, quirk);
+			if (ret == -EAGAIN)
+				buf = myuvc_queue_next_buffer(dev, buf);
+		} while (ret == -EAGAIN);
+
+		/* If an error occured skip the rest of the payload. */
+		if (ret < 0 || buf == NULL) {
+			dev->bulk.skip_payload = 1;
+		} else {
+			memcpy(dev->bulk.header, mem, ret);
+			dev->bulk.header_size = ret;
+
+			mem += ret;
+			len -= ret;
+		}
 	}
 
+	/* Process video data. */
+	if (!dev->bulk.skip_payload && buf != NULL)
+		myuvc_video_decode_data(dev, buf, mem, len, quirk);
 
-    /* 再次提交URB */
-	if ((ret = usb_submit_urb(urb, GFP_ATOMIC)) < 0) {
-		printk("Failed to resubmit video URB (%d).\n", ret);
+	/* Detect the payload end by a URB smaller than the maximum size (or
+	 * a payload size equal to the maximum) and process the header again.
+	 */
+	if (urb->actual_length < urb->transfer_buffer_length ||
+	    dev->bulk.payload_size >= dev->bulk.max_payload_size) {
+		if (!dev->bulk.skip_payload && buf != NULL) {
+			myuvc_video_decode_end(dev, buf, dev->bulk.header,
+				dev->bulk.payload_size);
+			if (buf->complete)
+				buf = myuvc_queue_next_buffer(dev, buf);
+		}
+
+		dev->bulk.header_size = 0;
+		dev->bulk.skip_payload = 0;
+		dev->bulk.payload_size = 0;
 	}
 }
 
+static void myuvc_video_decode_isoc(struct myuvc_device *dev, struct urb *urb,
+		struct myuvc_buffer *buf)
+{
+	__myuvc_video_decode_isoc(dev, urb, buf, 0);
+}
 
-static int myuvc_init_urb(void)
+static void myuvc_video_decode_isoc_quirk(struct myuvc_device *dev, struct urb *urb,
+		struct myuvc_buffer *buf)
 {
-	struct urb *urb;
-	unsigned int npackets, i, j;
-	u16 psize;
-	u32 size;
+	__myuvc_video_decode_isoc(dev, urb, buf, 1);
+}
 
-	psize    = wMaxPacketSize;
-	size     = myuvc_streaming_ctl.dwMaxVideoFrameSize;
-	npackets = DIV_ROUND_UP(size, psize);
-	if(npackets >= 32)
-		npackets = 32;
+static void myuvc_video_decode_bulk(struct myuvc_device *dev, struct urb *urb,
+		struct myuvc_buffer *buf)
+{
+	__myuvc_video_decode_bulk(dev, urb, buf, 0);
+}
 
-	myuvc_queue.urb_size = psize * npackets;
+static void myuvc_video_decode_bulk_quirk(struct myuvc_device *dev, struct urb *urb,
+		struct myuvc_buffer *buf)
+{
+	__myuvc_video_decode_bulk(dev, urb, buf, 1);
+}
 
-	for(i = 0; i < UVC_URBS; ++i)
+typedef void (*myuvc_decode_t)(struct myuvc_device *dev, struct urb *urb,
+		struct myuvc_buffer *buf);
+
+static myuvc_decode_t myuvc_decode_func(int bulk, unsigned long quirks)
+{
+	if (bulk)
+		return quirks ? myuvc_video_decode_bulk_quirk : myuvc_video_decode_bulk;
+
+	return quirks ? myuvc_video_decode_isoc_quirk : myuvc_video_decode_isoc;
+}
+
+/* 解析一个URB中的数据, stamp和sof是这个URB完成的时间和主机的USB帧号 */
+static void myuvc_video_decode(struct myuvc_device *dev, struct urb *urb,
+		ktime_t stamp, __u16 sof)
+{
+	struct myuvc_buffer *buf;
+	unsigned long flags;
+
+	dev->decode_time = stamp;
+	dev->decode_sof  = sof;
+
+	/* 从irqqueue队列中取出第1个缓冲区 */
+	spin_lock_irqsave(&dev->queue.irqlock, flags);
+	if (!list_empty(&dev->queue.irqqueue))
+	{
+		buf = list_first_entry(&dev->queue.irqqueue, struct myuvc_buffer, irq);
+	}
+	else
 	{
-		/* 分配urb_buffer */
-		myuvc_queue.urb_buffer[i] = usb_buffer_alloc(
-				mydev, myuvc_queue.urb_size,
-				GFP_KERNEL | __GFP_NOWARN, &myuvc_queue.urb_dma[i]);;
+		buf = NULL;
+	}
+	spin_unlock_irqrestore(&dev->queue.irqlock, flags);
 
-		/* 分配urb */
-		myuvc_queue.urb[i] = usb_alloc_urb(npackets, GFP_KERNEL);
-		if (!myuvc_queue.urb[i] && !myuvc_queue.urb_buffer[i]) {
-			myuvc_uninit_video();
-			return -ENOMEM;
+	/* 传输出错的URB中的数据不可信: 当前帧标记为出错,
+	 * 批量传输还要丢掉当前payload剩下的部分
+	 */
+	if (urb->status != 0) {
+		if (buf != NULL)
+			buf->error |= MYUVC_BUF_URB_ERR;
+		if (dev->streaming_bulk)
+			dev->bulk.skip_payload = 1;
+		return;
+	}
+
+	dev->decode(dev, urb, buf);
+}
+
+static int myuvc_urb_index(struct myuvc_device *dev, struct urb *urb)
+{
+	int i;
+
+	for (i = 0; i < UVC_URBS; ++i)
+		if (dev->queue.urb[i] == urb)
+			return i;
+
+	return 0;
+}
+
+/* 工作队列: 在进程上下文中解析URB并重新提交 */
+static void myuvc_video_work(struct work_struct *work)
+{
+	struct myuvc_device *dev = container_of(work, struct myuvc_device, work);
+	struct urb *urb;
+	ktime_t start;
+	unsigned long flags;
+	int ret, i;
+
+	for (;;) {
+		spin_lock_irqsave(&dev->urb_lock, flags);
+		if (list_empty(&dev->urb_done)) {
+			spin_unlock_irqrestore(&dev->urb_lock, flags);
+			break;
 		}
+		urb = list_first_entry(&dev->urb_done, struct urb, urb_list);
+		list_del(&urb->urb_list);
+		spin_unlock_irqrestore(&dev->urb_lock, flags);
 
-		/* 设置urb */
-		urb = myuvc_queue.urb[i];
-		
-		urb->dev     = mydev;
-		urb->context = NULL;
-		urb->pipe    = usb_rcvisocpipe(mydev, myuvc_bEndpointAddress);
-		urb->transfer_flags = URB_ISO_ASAP | URB_NO_TRANSFER_DMA_MAP;
-		urb->transfer_dma   = myuvc_queue.urb_dma[i];
-		urb->interval = myuvc_bInterval;
-		urb->transfer_buffer = myuvc_queue.urb_buffer[i];
-		urb->complete = myuvc_video_complete;
-		urb->number_of_packets = npackets;
-		urb->transfer_buffer_length = size;
-				
-		for (j = 0; j < npackets; ++j) {
-			urb->iso_frame_desc[j].offset = j * psize;
-			urb->iso_frame_desc[j].length = psize;
+		i = myuvc_urb_index(dev, urb);
+		start = ktime_get();
+		myuvc_video_decode(dev, urb, dev->queue.urb_time[i], dev->queue.urb_sof[i]);
+		MYUVC_STATS_ADD(dev, work_ns, ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+		/* STREAMOFF正在停止传输, 不再提交 */
+		if (!dev->streaming)
+			continue;
+
+		if ((ret = usb_submit_urb(urb, GFP_KERNEL)) < 0) {
+			printk("Failed to resubmit video URB (%d).\n", ret);
+			MYUVC_STATS_INC(dev, resubmit_failed);
 		}
 	}
-	
-	return 0;
 }
 
-/* 启动传输 
- * 参考 uvc_init_video
+/* 抓取原始URB数据的文件格式, 所有字段都是小端字节序.
+ * 文件是一串记录, 每个URB一条:
+ *   struct myuvc_capture_hdr                  头部
+ *   struct myuvc_capture_pkt [npackets]       每个packet的状态和长度
+ *   数据                                      每个packet记录的caplen字节, 按packet的顺序排列
+ * 同步传输的URB每个packet一项, 批量传输的URB作为1个packet记录.
+ * caplen < length 表示抓取时设置了snaplen, 后面的数据没有记录, 回放时补0.
+ * 环形缓冲区满时整条记录被丢掉, 下一条记录的dropped是丢掉的条数.
  */
-static int myuvc_vidioc_streamon(struct file *file, void *priv, enum v4l2_buf_type i)
+#define MYUVC_CAPTURE_MAGIC		0x4356554d	/* "MUVC" */
+#define MYUVC_CAPTURE_VERSION		1
+#define MYUVC_CAPTURE_BULK		(1 << 0)	/* 批量传输的URB */
+
+struct myuvc_capture_hdr {
+	__le32 magic;                /* MYUVC_CAPTURE_MAGIC */
+	__le16 version;              /* MYUVC_CAPTURE_VERSION */
+	__le16 hdr_size;             /* sizeof(struct myuvc_capture_hdr) */
+	__le32 size;                 /* 整条记录的长度, 包括头部 */
+	__le32 dropped;              /* 这条记录之前丢掉了几条记录 */
+	__le64 time_ns;              /* URB完成的时间, 单调时间 */
+	__le32 flags;                /* MYUVC_CAPTURE_* */
+	__le32 quirks;               /* 摄像头的quirk, 回放时选择解析函数 */
+	__le32 status;               /* urb->status */
+	__le32 transfer_length;      /* urb->transfer_buffer_length */
+	__le32 actual_length;        /* urb->actual_length */
+	__le32 max_payload;          /* 批量传输: dwMaxPayloadTransferSize */
+	__le16 sof;                  /* URB完成时主机的USB帧号 */
+	__le16 npackets;
+} __attribute__((packed));
+
+struct myuvc_capture_pkt {
+	__le32 status;               /* iso_frame_desc[].status */
+	__le32 length;               /* iso_frame_desc[].actual_length */
+	__le32 caplen;               /* 记录了多少字节, <= length */
+} __attribute__((packed));
+
+/* 第i个packet的数据, 批量传输的URB只有1个packet */
+static const u8 *myuvc_capture_packet(struct urb *urb, int bulk, unsigned int i,
+		unsigned int *len, int *status)
 {
-	int ret;
-	/* 1. 向USB摄像头设置参数 比如使用哪个format, 使用这个format下的哪个frame(分辨率)*/
-	/* 参考：uvc_set_video_ctrl	
-     * 1.1 取出参数
-     * 1.2 设置参数
-	 */
-	ret = myuvc_try_streaming_params(&myuvc_streaming_ctl);
-    printk("myuvc_try_streaming_params ret = %d\n", ret);
-	
-	ret = myuvc_get_streaming_params(&myuvc_streaming_ctl);
-    printk("myuvc_get_streaming_params ret = %d\n", ret);
+	if (bulk) {
+		*len    = urb->actual_length;
+		*status = urb->status;
+		return urb->transfer_buffer;
+	}
+
+	*len    = urb->iso_frame_desc[i].actual_length;
+	*status = urb->iso_frame_desc[i].status;
+	return urb->transfer_buffer + urb->iso_frame_desc[i].offset;
+}
+
+static unsigned int myuvc_capture_caplen(struct myuvc_device *dev, unsigned int len)
+{
+	if (dev->capture.snaplen && len > dev->capture.snaplen)
+		return dev->capture.snaplen;
+	return len;
+}
+
+/* 把len字节复制到环形缓冲区的pos处, 到达末尾时从头开始 */
+static void myuvc_capture_copy(struct myuvc_device *dev, unsigned int pos,
+		const void *data, unsigned int len)
+{
+	unsigned int off = pos & (dev->capture.size - 1);
+	unsigned int n = min(len, dev->capture.size - off);
+
+	memcpy(dev->capture.ring + off, data, n);
+	memcpy(dev->capture.ring, (const u8 *)data + n, len - n);
+}
+
+/* 在完成函数里记录一个URB, 环形缓冲区的空间不够时丢掉这条记录 */
+static void myuvc_capture_urb(struct myuvc_device *dev, struct urb *urb,
+		ktime_t stamp, __u16 sof)
+{
+	struct myuvc_capture_hdr hdr;
+	struct myuvc_capture_pkt pkt;
+	int bulk = dev->streaming_bulk;
+	unsigned int npackets, size, pos, i, len;
+	unsigned long flags;
+	const u8 *data;
+	int status;
+
+	npackets = bulk ? 1 : urb->number_of_packets;
+
+	spin_lock_irqsave(&dev->capture.lock, flags);
+	if (!dev->capture.enabled) {
+		spin_unlock_irqrestore(&dev->capture.lock, flags);
+		return;
+	}
+
+	/* 重新开始抓取时会改变snaplen, 记录的长度要在锁里计算 */
+	size = sizeof hdr + npackets * sizeof pkt;
+	for (i = 0; i < npackets; ++i) {
+		myuvc_capture_packet(urb, bulk, i, &len, &status);
+		size += myuvc_capture_caplen(dev, len);
+	}
+
+	if (size > dev->capture.size - (dev->capture.head - dev->capture.tail)) {
+		dev->capture.dropped++;
+		dev->capture.lost++;
+		spin_unlock_irqrestore(&dev->capture.lock, flags);
+		return;
+	}
+
+	hdr.magic           = cpu_to_le32(MYUVC_CAPTURE_MAGIC);
+	hdr.version         = cpu_to_le16(MYUVC_CAPTURE_VERSION);
+	hdr.hdr_size        = cpu_to_le16(sizeof hdr);
+	hdr.size            = cpu_to_le32(size);
+	hdr.dropped         = cpu_to_le32(dev->capture.dropped);
+	hdr.time_ns         = cpu_to_le64(ktime_to_ns(stamp));
+	hdr.flags           = cpu_to_le32(bulk ? MYUVC_CAPTURE_BULK : 0);
+	hdr.quirks          = cpu_to_le32(dev->quirks);
+	hdr.status          = cpu_to_le32(urb->status);
+	hdr.transfer_length = cpu_to_le32(urb->transfer_buffer_length);
+	hdr.actual_length   = cpu_to_le32(urb->actual_length);
+	hdr.max_payload     = cpu_to_le32(dev->bulk.max_payload_size);
+	hdr.sof             = cpu_to_le16(sof);
+	hdr.npackets        = cpu_to_le16(npackets);
+
+	pos = dev->capture.head;
+	myuvc_capture_copy(dev, pos, &hdr, sizeof hdr);
+	pos += sizeof hdr;
+
+	for (i = 0; i < npackets; ++i) {
+		myuvc_capture_packet(urb, bulk, i, &len, &status);
+		pkt.status = cpu_to_le32(status);
+		pkt.length = cpu_to_le32(len);
+		pkt.caplen = cpu_to_le32(myuvc_capture_caplen(dev, len));
+		myuvc_capture_copy(dev, pos, &pkt, sizeof pkt);
+		pos += sizeof pkt;
+	}
+
+	for (i = 0; i < npackets; ++i) {
+		data = myuvc_capture_packet(urb, bulk, i, &len, &status);
+		len = myuvc_capture_caplen(dev, len);
+		myuvc_capture_copy(dev, pos, data, len);
+		pos += len;
+	}
+
+	dev->capture.head = pos;
+	dev->capture.dropped = 0;
+	dev->capture.records++;
+	spin_unlock_irqrestore(&dev->capture.lock, flags);
+
+	wake_up_interruptible(&dev->capture.wait);
+}
+
+/* 时间ns落在直方图的哪一项: [2^(i-1), 2^i)微秒, 最后一项包括更长的 */
+static unsigned int myuvc_hist_bucket(s64 ns, unsigned int nbuckets)
+{
+	unsigned int bucket = fls((u32)min_t(s64, div_s64(ns, NSEC_PER_USEC), 0xffffffff));
+
+	return bucket < nbuckets ? bucket : nbuckets - 1;
+}
+
+static void myuvc_video_complete(struct urb *urb)
+{
+	struct myuvc_device *dev = urb->context;
+	int ret, i;
+	ktime_t start = ktime_get();
+	__u16 sof = usb_get_current_frame_number(dev->udev);
+	s64 delta;
+	unsigned int bucket;
+
+	trace_myuvc_urb_complete(dev->vdev->num, urb->status,
+				 urb->number_of_packets, urb->actual_length);
+
+	/* 出错的URB也记录 */
+	if (unlikely(dev->capture.enabled))
+		myuvc_capture_urb(dev, urb, start, sof);
+
+	switch (urb->status) {
+	case 0:
+		break;
+
+	case -ENOENT:		/* usb_kill_urb, STREAMOFF */
+	case -ECONNRESET:	/* usb_unlink_urb */
+	case -ESHUTDOWN:	/* 设备已经断开 */
+		return;
+
+	default:
+		/* -EPROTO, -EILSEQ, -EOVERFLOW等传输错误只影响这个URB,
+		 * 解析时把当前帧标记为出错, URB照常重新提交
+		 */
+		MYUVC_STATS_INC(dev, urbs_error);
+		break;
+	}
+
+	if (dev->deferred) {
+		/* 只记录时间并放入链表, 解析和提交在myuvc_video_work里完成 */
+		i = myuvc_urb_index(dev, urb);
+		dev->queue.urb_time[i] = start;
+		dev->queue.urb_sof[i]  = sof;
+
+		spin_lock(&dev->urb_lock);
+		list_add_tail(&urb->urb_list, &dev->urb_done);
+		spin_unlock(&dev->urb_lock);
+
+		queue_work(dev->workqueue, &dev->work);
+	} else {
+		myuvc_video_decode(dev, urb, start, sof);
+
+		/* 再次提交URB */
+		if ((ret = usb_submit_urb(urb, GFP_ATOMIC)) < 0) {
+			printk("Failed to resubmit video URB (%d).\n", ret);
+			MYUVC_STATS_INC(dev, resubmit_failed);
+		}
+	}
+
+	delta = ktime_to_ns(ktime_sub(ktime_get(), start));
+	dev->timing.urbs++;
+	dev->timing.irq_ns_total += delta;
+	if (delta > dev->timing.irq_ns_max)
+		dev->timing.irq_ns_max = delta;
+
+	bucket = myuvc_hist_bucket(delta, MYUVC_HIST_BUCKETS);
+	MYUVC_STATS_INC(dev, urbs);
+	MYUVC_STATS_ADD(dev, irq_ns, delta);
+	MYUVC_STATS_INC(dev, irq_hist[bucket]);
+
+	trace_myuvc_urb_complete_exit(dev->vdev->num, delta);
+}
+
+static void myuvc_print_timing(struct myuvc_device *dev)
+{
+	printk("myuvc: video%d %s decode: %u URBs, completion handler avg %lld ns max %lld ns\n",
+	       dev->vdev->num, dev->deferred ? "deferred" : "irq", dev->timing.urbs,
+	       dev->timing.urbs ? div_s64(dev->timing.irq_ns_total, dev->timing.urbs) : 0,
+	       dev->timing.irq_ns_max);
+	printk("myuvc: %u frames, latency from URB completion to wake-up avg %lld ns max %lld ns\n",
+	       dev->timing.frames,
+	       dev->timing.frames ? div_s64(dev->timing.latency_ns_total, dev->timing.frames) : 0,
+	       dev->timing.latency_ns_max);
+}
+
+/* 分配URB的缓冲区, npackets个packet, 每个packet最大psize字节 */
+static int myuvc_alloc_urb_buffers(struct myuvc_device *dev,
+		unsigned int npackets, u16 psize)
+{
+	unsigned int i;
+
+	dev->queue.urb_size = psize * npackets;
+
+	for (i = 0; i < UVC_URBS; ++i) {
+		dev->queue.urb_buffer[i] = usb_buffer_alloc(
+				dev->udev, dev->queue.urb_size,
+				GFP_KERNEL | __GFP_NOWARN, &dev->queue.urb_dma[i]);
+		if (dev->queue.urb_buffer[i] == NULL)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int myuvc_init_urb_isoc(struct myuvc_device *dev)
+{
+	struct urb *urb;
+	unsigned int npackets, i, j;
+	u16 psize;
+	u32 size;
+
+	psize    = dev->wMaxPacketSize;
+	size     = dev->streaming_ctl.dwMaxVideoFrameSize;
+	npackets = DIV_ROUND_UP(size, psize);
+	if (npackets > UVC_MAX_PACKETS)
+		npackets = UVC_MAX_PACKETS;
+
+	/* 分配urb_buffer */
+	if (myuvc_alloc_urb_buffers(dev, npackets, psize) < 0) {
+		myuvc_uninit_video(dev);
+		return -ENOMEM;
+	}
+
+	for(i = 0; i < UVC_URBS; ++i)
+	{
+		/* 分配urb */
+		dev->queue.urb[i] = usb_alloc_urb(npackets, GFP_KERNEL);
+		if (!dev->queue.urb[i]) {
+			myuvc_uninit_video(dev);
+			return -ENOMEM;
+		}
+
+		/* 设置urb */
+		urb = dev->queue.urb[i];
+
+		urb->dev     = dev->udev;
+		urb->context = dev;
+		urb->pipe    = usb_rcvisocpipe(dev->udev, dev->bEndpointAddress);
+		urb->transfer_flags = URB_ISO_ASAP | URB_NO_TRANSFER_DMA_MAP;
+		urb->transfer_dma   = dev->queue.urb_dma[i];
+		urb->interval = dev->bInterval;
+		urb->transfer_buffer = dev->queue.urb_buffer[i];
+		urb->complete = myuvc_video_complete;
+		urb->number_of_packets = npackets;
+		urb->transfer_buffer_length = dev->queue.urb_size;
+
+		for (j = 0; j < npackets; ++j) {
+			urb->iso_frame_desc[j].offset = j * psize;
+			urb->iso_frame_desc[j].length = psize;
+		}
+	}
+
+	return 0;
+}
+
+/* 批量端点: 用尽量大的URB(最多UVC_MAX_PACKETS个packet)接收数据,
+ * 减少URB完成中断的次数
+ */
+static int myuvc_init_urb_bulk(struct myuvc_device *dev)
+{
+	struct urb *urb;
+	unsigned int npackets, i;
+	unsigned int pipe;
+	u16 psize;
+	u32 size;
+
+	psize = dev->wMaxPacketSize;
+	size  = dev->streaming_ctl.dwMaxPayloadTransferSize;
+	dev->bulk.max_payload_size = size;
+	dev->bulk.header_size  = 0;
+	dev->bulk.skip_payload = 0;
+	dev->bulk.payload_size = 0;
+
+	npackets = DIV_ROUND_UP(size, psize);
+	if (npackets > UVC_MAX_PACKETS)
+		npackets = UVC_MAX_PACKETS;
+
+	if (myuvc_alloc_urb_buffers(dev, npackets, psize) < 0) {
+		myuvc_uninit_video(dev);
+		return -ENOMEM;
+	}
+
+	pipe = usb_rcvbulkpipe(dev->udev, dev->bEndpointAddress);
+
+	for (i = 0; i < UVC_URBS; ++i) {
+		dev->queue.urb[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!dev->queue.urb[i]) {
+			myuvc_uninit_video(dev);
+			return -ENOMEM;
+		}
+
+		urb = dev->queue.urb[i];
+		usb_fill_bulk_urb(urb, dev->udev, pipe, dev->queue.urb_buffer[i],
+			dev->queue.urb_size, myuvc_video_complete, dev);
+		urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
+		urb->transfer_dma = dev->queue.urb_dma[i];
+	}
+
+	return 0;
+}
+
+static int myuvc_init_urb(struct myuvc_device *dev)
+{
+	if (dev->streaming_bulk)
+		return myuvc_init_urb_bulk(dev);
+
+	return myuvc_init_urb_isoc(dev);
+}
+
+static struct usb_host_endpoint *myuvc_find_endpoint(struct usb_host_interface *alts, __u8 epaddr)
+{
+	struct usb_host_endpoint *ep;
+	unsigned int i;
+
+	for (i = 0; i < alts->desc.bNumEndpoints; ++i) {
+		ep = &alts->endpoint[i];
+		if (ep->desc.bEndpointAddress == epaddr)
+			return ep;
+	}
+
+	return NULL;
+}
+
+/* 根据协商得到的dwMaxPayloadTransferSize, 在VideoStreaming Interface的
+ * 所有setting中找出能满足带宽要求的最小的那个, 不多占用总线带宽
+ */
+static int myuvc_select_alt_setting(struct myuvc_device *dev)
+{
+	struct usb_interface *intf = dev->vs_intf;
+	struct usb_host_interface *alts;
+	struct usb_host_endpoint *ep;
+	unsigned int bandwidth, psize, best_psize = 0;
+	int i, best = -1;
+
+	bandwidth = dev->streaming_ctl.dwMaxPayloadTransferSize;
+	if (bandwidth == 0) {
+		printk("myuvc: device requested null bandwidth, defaulting to lowest.\n");
+		bandwidth = 1;
+	}
+
+	for (i = 0; i < intf->num_altsetting; ++i) {
+		alts = &intf->altsetting[i];
+		ep = myuvc_find_endpoint(alts, dev->bEndpointAddress);
+		if (ep == NULL)
+			continue;
+
+		/* bit 10..0: 包大小, bit 12..11: 高速端点每个微帧额外传输的次数 */
+		psize = le16_to_cpu(ep->desc.wMaxPacketSize);
+		psize = (psize & 0x07ff) * (1 + ((psize >> 11) & 3));
+		if (psize < bandwidth)
+			continue;
+
+		if (best < 0 || psize < best_psize) {
+			best = i;
+			best_psize = psize;
+			dev->bInterval = ep->desc.bInterval;
+		}
+	}
+
+	if (best < 0) {
+		printk("myuvc: no alternate setting for bandwidth %u.\n", bandwidth);
+		return -EIO;
+	}
+
+	dev->bAlternateSetting = intf->altsetting[best].desc.bAlternateSetting;
+	dev->wMaxPacketSize = best_psize;
+	printk("myuvc: bandwidth %u, using alternate setting %d (%u bytes/packet)\n",
+	       bandwidth, dev->bAlternateSetting, dev->wMaxPacketSize);
+
+	return 0;
+}
+
+/* 停止传输: kill URB, 等待工作队列处理完, 释放URB */
+static void myuvc_stop_video(struct myuvc_device *dev)
+{
+	struct urb *urb;
+	unsigned int i;
+
+	/* 工作队列不再重新提交URB */
+	dev->streaming = 0;
+	if (myuvc_vsource_active(dev)) {
+		myuvc_vsource_stop(dev);
+		return;
+	}
+	if (dev->workqueue)
+		flush_workqueue(dev->workqueue);
+
+	for (i = 0; i < UVC_URBS; ++i) {
+		if ((urb = dev->queue.urb[i]) == NULL)
+			continue;
+		usb_kill_urb(urb);
+	}
+
+	/* kill之前完成的URB可能还在链表里 */
+	if (dev->workqueue) {
+		flush_workqueue(dev->workqueue);
+		destroy_workqueue(dev->workqueue);
+		dev->workqueue = NULL;
+	}
+	INIT_LIST_HEAD(&dev->urb_done);
+
+	myuvc_uninit_video(dev);
+}
+
+/* STREAMOFF以后所有缓冲区都退出队列, 唤醒在DQBUF里等待的进程 */
+static void myuvc_queue_cancel(struct myuvc_device *dev)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&dev->queue.irqlock, flags);
+	INIT_LIST_HEAD(&dev->queue.irqqueue);
+	spin_unlock_irqrestore(&dev->queue.irqlock, flags);
+
+	INIT_LIST_HEAD(&dev->queue.mainqueue);
+	for (i = 0; i < dev->queue.count; ++i) {
+		dev->queue.buffer[i].state = VIDEOBUF_IDLE;
+		/* 停止传输以后不再占用APP的内存 */
+		myuvc_buffer_unpin(&dev->queue.buffer[i]);
+	}
+
+	wake_up_all(&dev->queue.wait);
+}
+
+/* 启动传输 
+ * 参考 uvc_init_video
+ */
+static int myuvc_start_video(struct myuvc_device *dev)
+{
+	unsigned int i;
+	int ret;
+
+	/* 正在回放抓取的数据时, 缓冲区被replay文件使用 */
+	if (dev->streaming || myuvc_replay_active(dev))
+		return -EBUSY;
+
+	/* 虚拟数据源不需要和摄像头协商参数, 也不使用URB */
+	if (myuvc_vsource_enabled(dev)) {
+		memset(&dev->timing, 0, sizeof(dev->timing));
+		memset(&dev->clock, 0, sizeof(dev->clock));
+		dev->deferred = 0;
+		dev->latest = latest_frame;
+		dev->sequence = 0;
+		dev->streaming = 1;
+		if ((ret = myuvc_vsource_start(dev)) < 0)
+			dev->streaming = 0;
+		return ret;
+	}
+
+	/* 1. 向USB摄像头设置参数 比如使用哪个format, 使用这个format下的哪个frame(分辨率)*/
+	/* 参考：uvc_set_video_ctrl	
+     * 1.1 取出参数
+     * 1.2 设置参数
+	 */
+	ret = myuvc_try_streaming_params(dev, &dev->streaming_ctl);
+    if (debug)
+        printk("myuvc_try_streaming_params ret = %d\n", ret);
+    if (ret < 0)
+        return ret;
+	
+	ret = myuvc_get_streaming_params(dev, &dev->streaming_ctl);
+    if (debug)
+        printk("myuvc_get_streaming_params ret = %d\n", ret);
+    if (ret < 0)
+        return ret;
+
+    ret = myuvc_set_streaming_params(dev, &dev->streaming_ctl);
+    if (debug)
+        printk("myuvc_set_streaming_params ret = %d\n", ret);
+    if (ret < 0)
+        return ret;
+
+	if (debug)
+		myuvc_print_streaming_params(&dev->streaming_ctl);
+
+	/* d. 设置VideoStreaming Interface所使用的setting
+     * d.1 从myuvc_params确定带宽
+     * d.2 根据setting的endpoint能传输的wMaxPacketSize
+     *     找到能满足该带宽的setting
+     */
+    /* 批量端点只有setting 0, 不需要切换 */
+    if (!dev->streaming_bulk) {
+        if ((ret = myuvc_select_alt_setting(dev)) < 0)
+            return ret;
+        usb_set_interface(dev->udev, dev->streaming_intf, dev->bAlternateSetting);
+    }
+	
+    /* 2. 分配设置URB */
+	if ((ret = myuvc_init_urb(dev)) < 0)
+		return ret;
+	
+    /* 2.1 在工作队列里解析数据时, 创建工作队列 */
+	memset(&dev->timing, 0, sizeof(dev->timing));
+	dev->deferred = deferred_decode;
+	dev->latest = latest_frame;
+	if (dev->deferred) {
+		dev->workqueue = create_singlethread_workqueue("myuvc");
+		if (dev->workqueue == NULL) {
+			myuvc_uninit_video(dev);
+			return -ENOMEM;
+		}
+	}
+
+	dev->sequence = 0;
+
+    /* 2.2 PTS/SCR时钟恢复: 重新收集SCR样本 */
+	memset(&dev->clock, 0, sizeof(dev->clock));
+	dev->clock.frequency = dev->streaming_ctl.dwClockFrequency ?
+			       dev->streaming_ctl.dwClockFrequency : dev->clock_frequency;
+	dev->streaming = 1;
+	
+    /* 3. 提交URB以接收数据 */
+	for (i = 0; i < UVC_URBS; ++i) {
+		if ((ret = usb_submit_urb(dev->queue.urb[i], GFP_KERNEL)) < 0) {
+			printk("Failed to submit URB %u (%d).\n", i, ret);
+			myuvc_stop_video(dev);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int myuvc_vidioc_streamon(struct file *file, void *priv, enum v4l2_buf_type i)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	int ret;
+
+	mutex_lock(&dev->queue.mutex);
+	ret = myuvc_start_video(dev);
+	mutex_unlock(&dev->queue.mutex);
+	trace_myuvc_stream(dev->vdev->num, 1, ret);
+
+	return ret;
+}
+
+/* 缓冲区已经有数据, latest_frame时是任意一个缓冲区有数据(buf没有使用).
+ * 缓冲区在irqlock中变成VIDEOBUF_DONE, 这里也在irqlock中检查, 看到DONE时序号等都已经写好
+ */
+static int myuvc_queue_ready(struct myuvc_device *dev, struct myuvc_buffer *buf)
+{
+	unsigned long flags;
+	int ready;
+
+	spin_lock_irqsave(&dev->queue.irqlock, flags);
+	if (dev->latest)
+		ready = myuvc_queue_done(dev, NULL, 1) != NULL;
+	else
+		ready = buf->state == VIDEOBUF_DONE || buf->state == VIDEOBUF_ERROR;
+	spin_unlock_irqrestore(&dev->queue.irqlock, flags);
+
+	return ready;
+}
+
+/* S11 调用poll监听io */
+static unsigned int myuvc_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	struct myuvc_buffer *buf;
+	unsigned int mask = 0;
+    
+    /* 从mainqueuq中取出第1个缓冲区 */
+
+    /*判断它的状态, 如果未就绪, 休眠 */
+
+    mutex_lock(&dev->queue.mutex);
+    if (list_empty(&dev->queue.mainqueue)) {
+        mask |= POLLERR;
+        goto done;
+    }
+    
+    buf = list_first_entry(&dev->queue.mainqueue, struct myuvc_buffer, stream);
+
+    poll_wait(file, &dev->queue.wait, wait);
+    if (myuvc_queue_ready(dev, buf))
+        mask |= POLLIN | POLLRDNORM;
+    
+done:
+    mutex_unlock(&dev->queue.mutex);
+    return mask;
+
+}
+
+/* 缓冲区已经有数据, 或者传输已经停止, 不会再有数据
+ * latest_frame时等待任意一个缓冲区有数据, buf没有使用
+ */
+static int myuvc_buffer_ready(struct myuvc_device *dev, struct myuvc_buffer *buf)
+{
+	return myuvc_queue_ready(dev, buf) || !dev->streaming;
+}
+
+/* S12 如果有数据, 从队列中取出数据 
+ *     把缓冲区放入队列, 调用poll...
+ *     没有数据时休眠, 直到有一帧数据(以O_NONBLOCK打开时返回-EAGAIN)
+ */
+static int myuvc_vidioc_dqbuf(struct file *file, void *priv, struct v4l2_buffer *v4l2_buf)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	/* APP发现数据就绪后, 从mainqueue里取出这个buffer */
+    struct myuvc_buffer *buf, *old;
+    unsigned long flags;
+    int ret = 0;
+
+	mutex_lock(&dev->queue.mutex);
+	for (;;) {
+		if (list_empty(&dev->queue.mainqueue)) {
+			ret = -EINVAL;
+			goto done;
+		}
+
+		if (dev->latest) {
+			/* 取走最新的一帧, 更旧的帧重新用来接收数据.
+			 * 完成函数也会回收填满的缓冲区, 用irqlock互斥
+			 */
+			spin_lock_irqsave(&dev->queue.irqlock, flags);
+			buf = myuvc_queue_done(dev, NULL, 1);
+			if (buf != NULL) {
+				buf->state = VIDEOBUF_IDLE;
+				while ((old = myuvc_queue_done(dev, buf, 0)) != NULL)
+					myuvc_queue_recycle(dev, old);
+			}
+			spin_unlock_irqrestore(&dev->queue.irqlock, flags);
+			if (buf != NULL)
+				break;
+		} else {
+			/* 缓冲区按放入队列的顺序填充, 第1个缓冲区最先有数据 */
+			buf = list_first_entry(&dev->queue.mainqueue, struct myuvc_buffer, stream);
+			if (myuvc_queue_ready(dev, buf))
+				break;
+		}
+
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto done;
+		}
+
+		if (!dev->streaming) {
+			ret = -EINVAL;
+			goto done;
+		}
+
+		/* 休眠时不持有mutex, 醒来后重新检查队列 */
+		mutex_unlock(&dev->queue.mutex);
+		ret = wait_event_interruptible(dev->queue.wait,
+					       myuvc_buffer_ready(dev, buf));
+		mutex_lock(&dev->queue.mutex);
+		if (ret < 0)
+			goto done;
+	}
+
+	/* latest_frame时上面已经取走了缓冲区 */
+	switch (dev->latest ? VIDEOBUF_DONE : buf->state) {
+	case VIDEOBUF_ERROR:
+		ret = -EIO;
+	case VIDEOBUF_DONE:
+		buf->state = VIDEOBUF_IDLE;
+		break;
+
+	case VIDEOBUF_IDLE:
+	case VIDEOBUF_QUEUED:
+	case VIDEOBUF_ACTIVE:
+	default:
+		ret = -EINVAL;
+		goto done;
+	}
+
+	list_del(&buf->stream);
+	memcpy(v4l2_buf, &buf->buf, sizeof *v4l2_buf);
+	MYUVC_STATS_INC(dev, latency_hist[myuvc_hist_bucket(
+		ktime_to_ns(ktime_sub(ktime_get(), buf->first_time)),
+		MYUVC_LATENCY_BUCKETS)]);
+	trace_myuvc_dqbuf(dev->vdev->num, buf->buf.index, buf->buf.sequence,
+			  buf->buf.bytesused);
+
+done:
+	mutex_unlock(&dev->queue.mutex);
+	return ret;
+
+}
+
+/* S13 关闭io, 关闭文件    */
+static int myuvc_vidioc_streamoff(struct file *file, void *priv, enum v4l2_buf_type p)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	int virtual, streaming;
+    /* 1. kill URB
+     * 2. free URB
+     */
+    mutex_lock(&dev->queue.mutex);
+    virtual = myuvc_vsource_active(dev);
+    streaming = dev->streaming;
+    myuvc_stop_video(dev);
+    myuvc_queue_cancel(dev);
+    mutex_unlock(&dev->queue.mutex);
+    trace_myuvc_stream(dev->vdev->num, 0, 0);
+    if (debug && streaming)
+        myuvc_print_timing(dev);
+
+    /* 虚拟数据源没有使用摄像头 */
+    if (virtual)
+        return 0;
+
+    /* 3. 设置VideoStreaming Interface为setting 0
+     *    批量端点本来就在setting 0, 清除端点的halt状态即可
+     */
+    if (dev->streaming_bulk)
+        usb_clear_halt(dev->udev, usb_rcvbulkpipe(dev->udev, dev->bEndpointAddress));
+    else
+        usb_set_interface(dev->udev, dev->streaming_intf, 0);
+    
+    return 0;
+}
+
+static int myuvc_close(struct file *file)
+{
+	//myuvc_vidioc_streamoff(NULL, NULL, 0);
+	
+	return 0;
+}
+
+
+/* ------------------------------------------------------------------------
+ * 控制
+ * myuvc_ctrl_infos    : UVC规范定义的控制, 属于哪种实体(GUID), 在实体描述符
+ *                       bmControls中是第几位(index), selector, 数据长度, 支持的请求
+ * myuvc_ctrl_mappings : V4L2控制对应UVC控制数据中的哪些位(offset, size), 数据类型
+ * probe时根据VideoControl Interface的Camera Terminal和Processing Unit描述符
+ * 找出摄像头支持的控制, 放入myuvc_device.controls
+ */
+static struct uvc_control_info myuvc_ctrl_infos[] = {
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_BRIGHTNESS_CONTROL,
+	  .index = 0, .size = 2,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_CONTRAST_CONTROL,
+	  .index = 1, .size = 2,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_HUE_CONTROL,
+	  .index = 2, .size = 2,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE
+		 | UVC_CONTROL_AUTO_UPDATE },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_SATURATION_CONTROL,
+	  .index = 3, .size = 2,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_SHARPNESS_CONTROL,
+	  .index = 4, .size = 2,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_GAMMA_CONTROL,
+	  .index = 5, .size = 2,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_WHITE_BALANCE_TEMPERATURE_CONTROL,
+	  .index = 6, .size = 2,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE
+		 | UVC_CONTROL_AUTO_UPDATE },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_WHITE_BALANCE_COMPONENT_CONTROL,
+	  .index = 7, .size = 4,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE
+		 | UVC_CONTROL_AUTO_UPDATE },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_BACKLIGHT_COMPENSATION_CONTROL,
+	  .index = 8, .size = 2,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_GAIN_CONTROL,
+	  .index = 9, .size = 2,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_POWER_LINE_FREQUENCY_CONTROL,
+	  .index = 10, .size = 1,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_CUR | UVC_CONTROL_GET_DEF },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_HUE_AUTO_CONTROL,
+	  .index = 11, .size = 1,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_CUR | UVC_CONTROL_GET_DEF },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_WHITE_BALANCE_TEMPERATURE_AUTO_CONTROL,
+	  .index = 12, .size = 1,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_CUR | UVC_CONTROL_GET_DEF },
+	{ .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_WHITE_BALANCE_COMPONENT_AUTO_CONTROL,
+	  .index = 13, .size = 1,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_CUR | UVC_CONTROL_GET_DEF },
+	{ .entity = UVC_GUID_UVC_CAMERA, .selector = CT_AE_MODE_CONTROL,
+	  .index = 1, .size = 1,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_CUR | UVC_CONTROL_GET_DEF
+		 | UVC_CONTROL_GET_RES },
+	{ .entity = UVC_GUID_UVC_CAMERA, .selector = CT_AE_PRIORITY_CONTROL,
+	  .index = 2, .size = 1,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_CUR },
+	{ .entity = UVC_GUID_UVC_CAMERA, .selector = CT_EXPOSURE_TIME_ABSOLUTE_CONTROL,
+	  .index = 3, .size = 4,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE
+		 | UVC_CONTROL_AUTO_UPDATE },
+	{ .entity = UVC_GUID_UVC_CAMERA, .selector = CT_FOCUS_ABSOLUTE_CONTROL,
+	  .index = 5, .size = 2,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE
+		 | UVC_CONTROL_AUTO_UPDATE },
+	{ .entity = UVC_GUID_UVC_CAMERA, .selector = CT_IRIS_ABSOLUTE_CONTROL,
+	  .index = 7, .size = 2,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE
+		 | UVC_CONTROL_AUTO_UPDATE },
+	{ .entity = UVC_GUID_UVC_CAMERA, .selector = CT_ZOOM_ABSOLUTE_CONTROL,
+	  .index = 9, .size = 2,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE
+		 | UVC_CONTROL_AUTO_UPDATE },
+	{ .entity = UVC_GUID_UVC_CAMERA, .selector = CT_PANTILT_ABSOLUTE_CONTROL,
+	  .index = 11, .size = 8,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_RANGE
+		 | UVC_CONTROL_AUTO_UPDATE },
+	{ .entity = UVC_GUID_UVC_CAMERA, .selector = CT_FOCUS_AUTO_CONTROL,
+	  .index = 17, .size = 1,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_CUR | UVC_CONTROL_GET_DEF },
+	{ .entity = UVC_GUID_UVC_CAMERA, .selector = CT_PRIVACY_CONTROL,
+	  .index = 18, .size = 1,
+	  .flags = UVC_CONTROL_SET_CUR | UVC_CONTROL_GET_CUR
+		 | UVC_CONTROL_AUTO_UPDATE },
+};
+
+static struct uvc_menu_info myuvc_power_line_frequency_menu[] = {
+	{ 0, "Disabled" },
+	{ 1, "50 Hz" },
+	{ 2, "60 Hz" },
+};
+
+/* bmAutoExposureMode的每一位是一种模式 */
+static struct uvc_menu_info myuvc_exposure_auto_menu[] = {
+	{ 2, "Auto Mode" },
+	{ 1, "Manual Mode" },
+	{ 4, "Shutter Priority Mode" },
+	{ 8, "Aperture Priority Mode" },
+};
+
+static struct uvc_control_mapping myuvc_ctrl_mappings[] = {
+	{ .id = V4L2_CID_BRIGHTNESS, .name = "Brightness",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_BRIGHTNESS_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_SIGNED },
+	{ .id = V4L2_CID_CONTRAST, .name = "Contrast",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_CONTRAST_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_UNSIGNED },
+	{ .id = V4L2_CID_HUE, .name = "Hue",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_HUE_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_SIGNED },
+	{ .id = V4L2_CID_SATURATION, .name = "Saturation",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_SATURATION_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_UNSIGNED },
+	{ .id = V4L2_CID_SHARPNESS, .name = "Sharpness",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_SHARPNESS_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_UNSIGNED },
+	{ .id = V4L2_CID_GAMMA, .name = "Gamma",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_GAMMA_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_UNSIGNED },
+	{ .id = V4L2_CID_BACKLIGHT_COMPENSATION, .name = "Backlight Compensation",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_BACKLIGHT_COMPENSATION_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_UNSIGNED },
+	{ .id = V4L2_CID_GAIN, .name = "Gain",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_GAIN_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_UNSIGNED },
+	{ .id = V4L2_CID_POWER_LINE_FREQUENCY, .name = "Power Line Frequency",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_POWER_LINE_FREQUENCY_CONTROL,
+	  .size = 2, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_MENU,
+	  .data_type = UVC_CTRL_DATA_TYPE_ENUM,
+	  .menu_info = myuvc_power_line_frequency_menu,
+	  .menu_count = ARRAY_SIZE(myuvc_power_line_frequency_menu) },
+	{ .id = V4L2_CID_HUE_AUTO, .name = "Hue, Auto",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_HUE_AUTO_CONTROL,
+	  .size = 1, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_BOOLEAN,
+	  .data_type = UVC_CTRL_DATA_TYPE_BOOLEAN },
+	{ .id = V4L2_CID_WHITE_BALANCE_TEMPERATURE, .name = "White Balance Temperature",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_WHITE_BALANCE_TEMPERATURE_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_UNSIGNED },
+	{ .id = V4L2_CID_AUTO_WHITE_BALANCE, .name = "White Balance Temperature, Auto",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_WHITE_BALANCE_TEMPERATURE_AUTO_CONTROL,
+	  .size = 1, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_BOOLEAN,
+	  .data_type = UVC_CTRL_DATA_TYPE_BOOLEAN },
+	{ .id = V4L2_CID_BLUE_BALANCE, .name = "White Balance Blue Component",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_WHITE_BALANCE_COMPONENT_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_SIGNED },
+	{ .id = V4L2_CID_RED_BALANCE, .name = "White Balance Red Component",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_WHITE_BALANCE_COMPONENT_CONTROL,
+	  .size = 16, .offset = 16, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_SIGNED },
+	{ .id = V4L2_CID_AUTO_WHITE_BALANCE, .name = "White Balance Component, Auto",
+	  .entity = UVC_GUID_UVC_PROCESSING, .selector = PU_WHITE_BALANCE_COMPONENT_AUTO_CONTROL,
+	  .size = 1, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_BOOLEAN,
+	  .data_type = UVC_CTRL_DATA_TYPE_BOOLEAN },
+	{ .id = V4L2_CID_EXPOSURE_AUTO, .name = "Exposure, Auto",
+	  .entity = UVC_GUID_UVC_CAMERA, .selector = CT_AE_MODE_CONTROL,
+	  .size = 4, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_MENU,
+	  .data_type = UVC_CTRL_DATA_TYPE_BITMASK,
+	  .menu_info = myuvc_exposure_auto_menu,
+	  .menu_count = ARRAY_SIZE(myuvc_exposure_auto_menu) },
+	{ .id = V4L2_CID_EXPOSURE_AUTO_PRIORITY, .name = "Exposure, Auto Priority",
+	  .entity = UVC_GUID_UVC_CAMERA, .selector = CT_AE_PRIORITY_CONTROL,
+	  .size = 1, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_BOOLEAN,
+	  .data_type = UVC_CTRL_DATA_TYPE_BOOLEAN },
+	{ .id = V4L2_CID_EXPOSURE_ABSOLUTE, .name = "Exposure (Absolute)",
+	  .entity = UVC_GUID_UVC_CAMERA, .selector = CT_EXPOSURE_TIME_ABSOLUTE_CONTROL,
+	  .size = 32, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_UNSIGNED },
+	{ .id = V4L2_CID_FOCUS_ABSOLUTE, .name = "Focus (absolute)",
+	  .entity = UVC_GUID_UVC_CAMERA, .selector = CT_FOCUS_ABSOLUTE_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_UNSIGNED },
+	{ .id = V4L2_CID_FOCUS_AUTO, .name = "Focus, Auto",
+	  .entity = UVC_GUID_UVC_CAMERA, .selector = CT_FOCUS_AUTO_CONTROL,
+	  .size = 1, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_BOOLEAN,
+	  .data_type = UVC_CTRL_DATA_TYPE_BOOLEAN },
+	{ .id = V4L2_CID_IRIS_ABSOLUTE, .name = "Iris, Absolute",
+	  .entity = UVC_GUID_UVC_CAMERA, .selector = CT_IRIS_ABSOLUTE_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_UNSIGNED },
+	{ .id = V4L2_CID_ZOOM_ABSOLUTE, .name = "Zoom, Absolute",
+	  .entity = UVC_GUID_UVC_CAMERA, .selector = CT_ZOOM_ABSOLUTE_CONTROL,
+	  .size = 16, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_UNSIGNED },
+	{ .id = V4L2_CID_PAN_ABSOLUTE, .name = "Pan (Absolute)",
+	  .entity = UVC_GUID_UVC_CAMERA, .selector = CT_PANTILT_ABSOLUTE_CONTROL,
+	  .size = 32, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_SIGNED },
+	{ .id = V4L2_CID_TILT_ABSOLUTE, .name = "Tilt (Absolute)",
+	  .entity = UVC_GUID_UVC_CAMERA, .selector = CT_PANTILT_ABSOLUTE_CONTROL,
+	  .size = 32, .offset = 32, .v4l2_type = V4L2_CTRL_TYPE_INTEGER,
+	  .data_type = UVC_CTRL_DATA_TYPE_SIGNED },
+	{ .id = V4L2_CID_PRIVACY, .name = "Privacy",
+	  .entity = UVC_GUID_UVC_CAMERA, .selector = CT_PRIVACY_CONTROL,
+	  .size = 1, .offset = 0, .v4l2_type = V4L2_CTRL_TYPE_BOOLEAN,
+	  .data_type = UVC_CTRL_DATA_TYPE_BOOLEAN },
+};
+
+static const __u8 myuvc_camera_guid[16] = UVC_GUID_UVC_CAMERA;
+static const __u8 myuvc_processing_guid[16] = UVC_GUID_UVC_PROCESSING;
+
+/* 控制的数据在缓存中的位置: 每种请求一份, 每份info->size字节 */
+static __u8 *myuvc_ctrl_data(struct myuvc_control *ctrl, int id)
+{
+	return ctrl->data + id * ctrl->info->size;
+}
+
+/* Extract the bit string specified by mapping->offset and mapping->size
+ * from the little-endian data stored at 'data' and return the result as
+ * a signed 32bit integer. Sign extension will be performed if the mapping
+ * references a signed data type.
+ */
+static __s32 myuvc_get_le_value(struct uvc_control_mapping *mapping,
+		const __u8 *data)
+{
+	int bits = mapping->size;
+	int offset = mapping->offset;
+	__s32 value = 0;
+	__u8 mask;
+
+	data += offset / 8;
+	offset &= 7;
+	mask = ((1LL << bits) - 1) << offset;
+
+	for (; bits > 0; data++) {
+		__u8 byte = *data & mask;
+		value |= offset > 0 ? (byte >> offset) : (byte << (-offset));
+		bits -= 8 - (offset > 0 ? offset : 0);
+		offset -= 8;
+		mask = (1 << bits) - 1;
+	}
+
+	/* Sign-extend the value if needed. */
+	if (mapping->data_type == UVC_CTRL_DATA_TYPE_SIGNED)
+		value |= -(value & (1 << (mapping->size - 1)));
+
+	return value;
+}
+
+/* Set the bit string specified by mapping->offset and mapping->size
+ * in the little-endian data stored at 'data' to the value 'value'.
+ */
+static void myuvc_set_le_value(struct uvc_control_mapping *mapping,
+		__s32 value, __u8 *data)
+{
+	int bits = mapping->size;
+	int offset = mapping->offset;
+	__u8 mask;
+
+	data += offset / 8;
+	offset &= 7;
+
+	for (; bits > 0; data++) {
+		mask = ((1LL << bits) - 1) << offset;
+		*data = (*data & ~mask) | ((value << offset) & mask);
+		value >>= 8 - offset;
+		bits -= 8 - offset;
+		offset = 0;
+	}
+}
+
+/* 发起一个控制请求, query是GET_*或SET_CUR, 返回值是传输的字节数或错误码 */
+static int myuvc_ctrl_query(struct myuvc_device *dev, __u8 query, __u8 unit,
+		__u8 selector, void *data, __u16 size)
+{
+	__u8 type = USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+	unsigned int pipe;
+
+	if (query & 0x80) {
+		pipe = usb_rcvctrlpipe(dev->udev, 0);
+		type |= USB_DIR_IN;
+	} else {
+		pipe = usb_sndctrlpipe(dev->udev, 0);
+		type |= USB_DIR_OUT;
+	}
+
+	return usb_control_msg(dev->udev, pipe, query, type, selector << 8,
+			unit << 8 | dev->control_intf, data, size, 5000);
+}
+
+/* 把unit的一个控制加入dev->controls */
+static int myuvc_ctrl_add(struct myuvc_device *dev, __u8 unit,
+		struct uvc_control_info *info)
+{
+	struct myuvc_control *ctrl;
+
+	if (dev->ncontrols >= MYUVC_MAX_CONTROLS)
+		return -ENOSPC;
+
+	ctrl = &dev->controls[dev->ncontrols];
+	ctrl->data = kzalloc(info->size * MYUVC_CTRL_DATA_LAST, GFP_KERNEL);
+	if (ctrl->data == NULL)
+		return -ENOMEM;
+	ctrl->info = info;
+	ctrl->unit = unit;
+	dev->ncontrols++;
+
+	return 0;
+}
+
+/* 把实体描述符的bmControls中标明的控制加入dev->controls */
+static int myuvc_ctrl_add_entity(struct myuvc_device *dev, __u8 unit,
+		const __u8 *guid, const __u8 *bmControls, unsigned int size)
+{
+	struct uvc_control_info *info;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < ARRAY_SIZE(myuvc_ctrl_infos); ++i) {
+		info = &myuvc_ctrl_infos[i];
+		if (memcmp(info->entity, guid, 16) != 0 ||
+		    info->index >= size * 8 ||
+		    !(bmControls[info->index / 8] & (1 << (info->index % 8))))
+			continue;
+
+		if ((ret = myuvc_ctrl_add(dev, unit, info)) < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* 扩展单元的控制由厂家定义, probe时只记下单元的ID, GUID和bmControls,
+ * 控制由APP用UVCIOC_CTRL_ADD加入
+ */
+static int myuvc_add_xu(struct myuvc_device *dev, __u8 id, const __u8 *guid,
+		const __u8 *bmControls, unsigned int size)
+{
+	struct myuvc_xu *xu;
+
+	if (dev->nxus >= MYUVC_MAX_XUS)
+		return 0;
+
+	xu = &dev->xus[dev->nxus];
+	xu->bmControls = kmemdup(bmControls, size, GFP_KERNEL);
+	if (size && xu->bmControls == NULL)
+		return -ENOMEM;
+	xu->id = id;
+	memcpy(xu->guid, guid, 16);
+	xu->control_size = size;
+	dev->nxus++;
+
+	printk("myuvc: extension unit %u, %u controls\n", id, size * 8);
+	return 0;
+}
+
+/* probe时扫描VideoControl Interface的描述符, 找出Camera Terminal和
+ * Processing Unit的ID及其支持的控制, 以及扩展单元
+ */
+static int myuvc_parse_controls(struct myuvc_device *dev)
+{
+	unsigned char *buf = dev->intf->altsetting[0].extra;
+	int buflen = dev->intf->altsetting[0].extralen;
+	unsigned int n, p;
+	int ret = 0;
+
+	for (; buflen > 2 && ret == 0; buflen -= buf[0], buf += buf[0]) {
+		if (buf[0] < 3 || buf[0] > buflen)
+			break;
+		if (buf[1] != USB_DT_CS_INTERFACE)
+			continue;
+
+		switch (buf[2]) {
+		case VC_INPUT_TERMINAL:
+			/* 只有摄像头类型的输入终端有控制 */
+			if (buf[0] < 15 || get_unaligned_le16(&buf[4]) != ITT_CAMERA)
+				break;
+			n = buf[14];
+			if (buf[0] < 15 + n)
+				break;
+			ret = myuvc_ctrl_add_entity(dev, buf[3], myuvc_camera_guid,
+						    &buf[15], n);
+			break;
+
+		case VC_PROCESSING_UNIT:
+			if (buf[0] < 8)
+				break;
+			n = buf[7];
+			if (buf[0] < 8 + n)
+				break;
+			ret = myuvc_ctrl_add_entity(dev, buf[3], myuvc_processing_guid,
+						    &buf[8], n);
+			break;
+
+		case VC_EXTENSION_UNIT:
+			/* bUnitID, guidExtensionCode[16], bNumControls, bNrInPins,
+			 * baSourceID[p], bControlSize, bmControls[n]
+			 */
+			if (buf[0] < 24)
+				break;
+			p = buf[21];
+			if (buf[0] < 24 + p)
+				break;
+			n = buf[22 + p];
+			if (buf[0] < 23 + p + n)
+				break;
+			ret = myuvc_add_xu(dev, buf[3], &buf[4], &buf[23 + p], n);
+			break;
+		}
+	}
+
+	printk("myuvc: %u controls\n", dev->ncontrols);
+	return ret;
+}
+
+static void myuvc_free_controls(struct myuvc_device *dev)
+{
+	struct uvc_control_mapping *mapping, *m;
+	struct uvc_control_info *info, *n;
+	unsigned int i;
+
+	for (i = 0; i < dev->ncontrols; ++i)
+		kfree(dev->controls[i].data);
+	dev->ncontrols = 0;
+
+	list_for_each_entry_safe(info, n, &dev->xu_infos, list)
+		kfree(info);
+	list_for_each_entry_safe(mapping, m, &dev->xu_mappings, list)
+		kfree(mapping);
+	INIT_LIST_HEAD(&dev->xu_infos);
+	INIT_LIST_HEAD(&dev->xu_mappings);
+
+	for (i = 0; i < dev->nxus; ++i)
+		kfree(dev->xus[i].bmControls);
+	dev->nxus = 0;
+}
+
+/* map是要找的控制(next时是比已经找到的更近的下一个控制),
+ * 并且摄像头有这个控制时, 记录到found和mapping中
+ */
+static void myuvc_match_mapping(struct myuvc_device *dev,
+		struct uvc_control_mapping *map, __u32 id, int next,
+		struct myuvc_control **found, struct uvc_control_mapping **mapping)
+{
+	struct myuvc_control *ctrl;
+	unsigned int i;
+
+	if (next ? (map->id <= id || (*mapping && map->id >= (*mapping)->id))
+		 : (map->id != id || *found))
+		return;
+
+	for (i = 0; i < dev->ncontrols; ++i) {
+		ctrl = &dev->controls[i];
+		if (ctrl->info->selector == map->selector &&
+		    memcmp(ctrl->info->entity, map->entity, 16) == 0 &&
+		    map->offset + map->size <= ctrl->info->size * 8) {
+			*found = ctrl;
+			*mapping = map;
+			return;
+		}
+	}
+}
+
+/* 根据V4L2控制的ID找到映射和摄像头的控制, id中有V4L2_CTRL_FLAG_NEXT_CTRL时
+ * 找ID比它大的下一个控制. 先找标准控制, 再找UVCIOC_CTRL_MAP加入的映射
+ */
+static struct myuvc_control *myuvc_find_control(struct myuvc_device *dev,
+		__u32 id, struct uvc_control_mapping **mapping)
+{
+	struct myuvc_control *found = NULL;
+	struct uvc_control_mapping *map;
+	int next = id & V4L2_CTRL_FLAG_NEXT_CTRL;
+	unsigned int i;
+
+	id &= V4L2_CTRL_ID_MASK;
+	*mapping = NULL;
+
+	for (i = 0; i < ARRAY_SIZE(myuvc_ctrl_mappings); ++i)
+		myuvc_match_mapping(dev, &myuvc_ctrl_mappings[i], id, next,
+				    &found, mapping);
+
+	list_for_each_entry(map, &dev->xu_mappings, list)
+		myuvc_match_mapping(dev, map, id, next, &found, mapping);
+
+	return found;
+}
+
+/* 第一次使用时读出控制的GET_INFO和范围, 以后QUERYCTRL直接使用缓存 */
+static int myuvc_ctrl_load(struct myuvc_device *dev, struct myuvc_control *ctrl)
+{
+	static const struct {
+		__u8 query;
+		__u32 flag;
+		int id;
+	} queries[] = {
+		{ GET_MIN, UVC_CONTROL_GET_MIN, MYUVC_CTRL_DATA_MIN },
+		{ GET_MAX, UVC_CONTROL_GET_MAX, MYUVC_CTRL_DATA_MAX },
+		{ GET_RES, UVC_CONTROL_GET_RES, MYUVC_CTRL_DATA_RES },
+		{ GET_DEF, UVC_CONTROL_GET_DEF, MYUVC_CTRL_DATA_DEF },
+	};
+	struct uvc_control_info *info = ctrl->info;
+	unsigned int i;
+	u8 *data;
+
+	if (test_and_clear_bit(MYUVC_CTRL_STALE_INFO, &ctrl->stale))
+		ctrl->loaded = 0;
+	if (ctrl->loaded)
+		return 0;
+
+	/* usb_control_msg的缓冲区要能做DMA, 不能在栈上 */
+	data = kmalloc(1, GFP_KERNEL);
+	if (data == NULL)
+		return -ENOMEM;
+
+	/* 不支持GET_INFO的摄像头, 按myuvc_ctrl_infos中的flags处理 */
+	if (myuvc_ctrl_query(dev, GET_INFO, ctrl->unit, info->selector, data, 1) == 1)
+		ctrl->caps = data[0];
+	else
+		ctrl->caps = MYUVC_CTRL_INFO_GET | MYUVC_CTRL_INFO_SET;
+	kfree(data);
+
+	for (i = 0; i < ARRAY_SIZE(queries); ++i) {
+		if (!(info->flags & queries[i].flag))
+			continue;
+		if (myuvc_ctrl_query(dev, queries[i].query, ctrl->unit, info->selector,
+				     myuvc_ctrl_data(ctrl, queries[i].id),
+				     info->size) != info->size)
+			return -EIO;
+	}
+
+	ctrl->loaded = 1;
+	return 0;
+}
+
+/* 摄像头自己会改变的控制, 当前值不能缓存 */
+static int myuvc_ctrl_cacheable(struct myuvc_control *ctrl)
+{
+	return ctrl->loaded &&
+	       !(ctrl->info->flags & UVC_CONTROL_AUTO_UPDATE) &&
+	       !(ctrl->caps & MYUVC_CTRL_INFO_AUTOUPDATE);
+}
+
+/* 读出控制的当前值(整个控制的数据), 可以缓存时使用缓存.
+ * 读的过程中状态中断作废了缓存时, STALE_CUR保留下来, 下次还会重新读
+ */
+static int myuvc_ctrl_get_cur(struct myuvc_device *dev, struct myuvc_control *ctrl)
+{
+	if (test_and_clear_bit(MYUVC_CTRL_STALE_CUR, &ctrl->stale))
+		ctrl->cur_valid = 0;
+	if (ctrl->cur_valid)
+		return 0;
+
+	if (myuvc_ctrl_query(dev, GET_CUR, ctrl->unit, ctrl->info->selector,
+			     myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_CUR),
+			     ctrl->info->size) != ctrl->info->size)
+		return -EIO;
+
+	ctrl->cur_valid = myuvc_ctrl_cacheable(ctrl);
+	return 0;
+}
+
+/* 摄像头通过状态中断报告控制发生了变化: 值变了只丢掉缓存的当前值,
+ * 范围或GET_INFO变了要全部重新读. 在完成函数中调用, 没有ctrl_mutex,
+ * 只设置stale, 由持有ctrl_mutex的myuvc_ctrl_load/myuvc_ctrl_get_cur处理
+ */
+static void myuvc_ctrl_invalidate(struct myuvc_device *dev, __u8 unit,
+		__u8 selector, __u8 attribute)
+{
+	struct myuvc_control *ctrl;
+	unsigned int i;
+
+	for (i = 0; i < dev->ncontrols; ++i) {
+		ctrl = &dev->controls[i];
+		if (ctrl->unit != unit || ctrl->info->selector != selector)
+			continue;
+
+		if (attribute != 0)
+			set_bit(MYUVC_CTRL_STALE_INFO, &ctrl->stale);
+		set_bit(MYUVC_CTRL_STALE_CUR, &ctrl->stale);
+	}
+}
+
+/* UVC控制的值 <-> V4L2控制的值, 菜单类型的V4L2值是菜单项的序号 */
+static __s32 myuvc_ctrl_to_v4l2(struct uvc_control_mapping *mapping, const __u8 *data)
+{
+	__s32 value = myuvc_get_le_value(mapping, data);
+	unsigned int i;
+
+	if (mapping->v4l2_type != V4L2_CTRL_TYPE_MENU)
+		return value;
+
+	for (i = 0; i < mapping->menu_count; ++i)
+		if (mapping->menu_info[i].value == value)
+			return i;
+
+	return value;
+}
+
+static int myuvc_query_v4l2_ctrl (struct file *file, void *fh,
+                struct v4l2_queryctrl *v4l2_ctrl)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	struct uvc_control_mapping *mapping;
+	struct myuvc_control *ctrl;
+    int ret;
+
+	mutex_lock(&dev->ctrl_mutex);
+	ctrl = myuvc_find_control(dev, v4l2_ctrl->id, &mapping);
+	if (ctrl == NULL) {
+		ret = -EINVAL;
+		goto done;
+	}
+
+	if ((ret = myuvc_ctrl_load(dev, ctrl)) < 0)
+		goto done;
+
+	memset(v4l2_ctrl, 0, sizeof *v4l2_ctrl);
+	v4l2_ctrl->id   = mapping->id;
+	v4l2_ctrl->type = mapping->v4l2_type;
+	strlcpy(v4l2_ctrl->name, mapping->name, sizeof v4l2_ctrl->name);
+
+	if (!(ctrl->info->flags & UVC_CONTROL_GET_CUR))
+		v4l2_ctrl->flags |= V4L2_CTRL_FLAG_WRITE_ONLY;
+	if (!(ctrl->info->flags & UVC_CONTROL_SET_CUR) ||
+	    !(ctrl->caps & MYUVC_CTRL_INFO_SET))
+		v4l2_ctrl->flags |= V4L2_CTRL_FLAG_READ_ONLY;
+	if (ctrl->caps & MYUVC_CTRL_INFO_DISABLED)
+		v4l2_ctrl->flags |= V4L2_CTRL_FLAG_INACTIVE;
+
+	if (ctrl->info->flags & UVC_CONTROL_GET_DEF)
+		v4l2_ctrl->default_value = myuvc_ctrl_to_v4l2(mapping,
+				myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_DEF));
+
+	switch (mapping->v4l2_type) {
+	case V4L2_CTRL_TYPE_MENU:
+		v4l2_ctrl->minimum = 0;
+		v4l2_ctrl->maximum = mapping->menu_count - 1;
+		v4l2_ctrl->step = 1;
+		break;
+
+	case V4L2_CTRL_TYPE_BOOLEAN:
+		v4l2_ctrl->minimum = 0;
+		v4l2_ctrl->maximum = 1;
+		v4l2_ctrl->step = 1;
+		break;
+
+	default:
+		if (ctrl->info->flags & UVC_CONTROL_GET_MIN)
+			v4l2_ctrl->minimum = myuvc_get_le_value(mapping,
+					myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_MIN));
+		if (ctrl->info->flags & UVC_CONTROL_GET_MAX)
+			v4l2_ctrl->maximum = myuvc_get_le_value(mapping,
+					myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_MAX));
+		if (ctrl->info->flags & UVC_CONTROL_GET_RES)
+			v4l2_ctrl->step = myuvc_get_le_value(mapping,
+					myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_RES));
+		break;
+	}
+
+done:
+	mutex_unlock(&dev->ctrl_mutex);
+    return ret;
+}
+
+static int myuvc_querymenu(struct file *file, void *fh,
+		struct v4l2_querymenu *query_menu)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	struct uvc_control_mapping *mapping;
+	struct myuvc_control *ctrl;
+	int ret = 0;
+
+	mutex_lock(&dev->ctrl_mutex);
+	ctrl = myuvc_find_control(dev, query_menu->id, &mapping);
+	if (ctrl == NULL || mapping->v4l2_type != V4L2_CTRL_TYPE_MENU ||
+	    query_menu->index >= mapping->menu_count)
+		ret = -EINVAL;
+	else
+		strlcpy(query_menu->name, mapping->menu_info[query_menu->index].name,
+			sizeof query_menu->name);
+	mutex_unlock(&dev->ctrl_mutex);
+
+	return ret;
+}
+
+/* 检查要设置的值: 控制要存在并且可写, 超出范围的值限制在范围内,
+ * 修改后的值写回xctrl->value
+ */
+static int myuvc_ctrl_check(struct myuvc_device *dev, struct v4l2_ext_control *xctrl,
+		struct myuvc_control **pctrl, struct uvc_control_mapping **pmapping)
+{
+	struct uvc_control_mapping *mapping;
+	struct myuvc_control *ctrl;
+	__s32 value = xctrl->value;
+	__s32 min, max;
+	int ret;
+
+	ctrl = myuvc_find_control(dev, xctrl->id, &mapping);
+	if (ctrl == NULL || !(ctrl->info->flags & UVC_CONTROL_SET_CUR))
+		return -EINVAL;
+
+	if ((ret = myuvc_ctrl_load(dev, ctrl)) < 0)
+		return ret;
+
+	/* 摄像头GET_INFO说不能设置(只读, 或者自动模式下被禁止)时, 不发SET_CUR */
+	if (!(ctrl->caps & MYUVC_CTRL_INFO_SET))
+		return -EACCES;
+	if (ctrl->caps & MYUVC_CTRL_INFO_DISABLED)
+		return -EBUSY;
+
+	switch (mapping->v4l2_type) {
+	case V4L2_CTRL_TYPE_MENU:
+		if (value < 0 || value >= mapping->menu_count)
+			return -ERANGE;
+		break;
+
+	case V4L2_CTRL_TYPE_BOOLEAN:
+		value = value ? 1 : 0;
+		break;
+
+	default:
+		/* 超出范围的值限制在范围内 */
+		if (ctrl->info->flags & UVC_CONTROL_GET_MIN) {
+			min = myuvc_get_le_value(mapping,
+					myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_MIN));
+			if (value < min)
+				value = min;
+		}
+		if (ctrl->info->flags & UVC_CONTROL_GET_MAX) {
+			max = myuvc_get_le_value(mapping,
+					myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_MAX));
+			if (value > max)
+				value = max;
+		}
+		break;
+	}
+
+	xctrl->value = value;
+	*pctrl = ctrl;
+	*pmapping = mapping;
+	return 0;
+}
+
+/* 把一个已经检查过的值写入控制的当前值缓存, 还不发给摄像头.
+ * 一个UVC控制包含几个V4L2控制时(比如白平衡的蓝/红分量), 同一批中
+ * 对它的修改合并成一个SET_CUR. backup不为0时先保存原来的值, 用于回滚
+ */
+static int myuvc_ctrl_stage(struct myuvc_device *dev, struct myuvc_control *ctrl,
+		struct uvc_control_mapping *mapping, __s32 value, int backup)
+{
+	unsigned int size = ctrl->info->size;
+	__u8 *data = myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_CUR);
+	int ret;
+
+	if (!ctrl->dirty) {
+		/* 只修改其中属于这个V4L2控制的位时, 要先读出当前值 */
+		if ((backup || mapping->size < size * 8) &&
+		    (ctrl->info->flags & UVC_CONTROL_GET_CUR)) {
+			if ((ret = myuvc_ctrl_get_cur(dev, ctrl)) < 0)
+				return ret;
+			memcpy(myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_BACKUP), data, size);
+			ctrl->backup = 1;
+		} else {
+			memset(data, 0, size);
+			ctrl->backup = 0;
+		}
+
+		ctrl->dirty = 1;
+		dev->ctrl_batch[dev->nbatch++] = ctrl;
+	}
+
+	if (mapping->v4l2_type == V4L2_CTRL_TYPE_MENU)
+		value = mapping->menu_info[value].value;
+
+	myuvc_set_le_value(mapping, value, data);
+	return 0;
+}
+
+/* 把这一批修改过的控制依次发给摄像头, 中间不释放ctrl_mutex.
+ * 有一个失败时, 已经发出去的控制按相反的顺序恢复原来的值
+ */
+static void myuvc_ctrl_finish(struct myuvc_device *dev, unsigned int sent, int ret)
+{
+	struct myuvc_control *ctrl;
+	unsigned int i;
+
+	/* 刚写入的值就是当前值 */
+	for (i = 0; i < sent; ++i) {
+		ctrl = dev->ctrl_batch[i];
+		ctrl->cur_valid = myuvc_ctrl_cacheable(ctrl);
+	}
+
+	if (ret < 0) {
+		for (i = dev->nbatch; i-- > 0; ) {
+			ctrl = dev->ctrl_batch[i];
+			ctrl->cur_valid = 0;
+			if (!ctrl->backup)
+				continue;
+
+			memcpy(myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_CUR),
+			       myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_BACKUP),
+			       ctrl->info->size);
+			if (i < sent)
+				myuvc_ctrl_query(dev, SET_CUR, ctrl->unit, ctrl->info->selector,
+						 myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_BACKUP),
+						 ctrl->info->size);
+		}
+	}
+
+	for (i = 0; i < dev->nbatch; ++i)
+		dev->ctrl_batch[i]->dirty = 0;
+	dev->nbatch = 0;
+}
+
+static int myuvc_ctrl_commit(struct myuvc_device *dev)
+{
+	struct myuvc_control *ctrl;
+	unsigned int sent;
+	int ret = 0;
+
+	for (sent = 0; sent < dev->nbatch; ++sent) {
+		ctrl = dev->ctrl_batch[sent];
+		if (myuvc_ctrl_query(dev, SET_CUR, ctrl->unit, ctrl->info->selector,
+				     myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_CUR),
+				     ctrl->info->size) != ctrl->info->size) {
+			ret = -EIO;
+			break;
+		}
+	}
+
+	myuvc_ctrl_finish(dev, sent, ret);
+	return ret;
+}
+
+/* 丢弃没有发出的修改 */
+static void myuvc_ctrl_rollback(struct myuvc_device *dev)
+{
+	struct myuvc_control *ctrl;
+	unsigned int i;
+
+	for (i = 0; i < dev->nbatch; ++i) {
+		ctrl = dev->ctrl_batch[i];
+		ctrl->cur_valid = 0;
+		ctrl->dirty = 0;
+	}
+	dev->nbatch = 0;
+}
+
+/* async_controls: 一批控制的SET_CUR用同一个控制URB依次发出, 完成函数提交下一个 */
+static void myuvc_ctrl_async_complete(struct urb *urb);
+
+static int myuvc_ctrl_async_submit(struct myuvc_device *dev, gfp_t mem_flags)
+{
+	struct myuvc_control *ctrl = dev->ctrl_batch[dev->async.sent];
+	struct usb_ctrlrequest *setup = &dev->async.setup;
+
+	setup->bRequestType = USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+	setup->bRequest = SET_CUR;
+	setup->wValue = cpu_to_le16(ctrl->info->selector << 8);
+	setup->wIndex = cpu_to_le16(ctrl->unit << 8 | dev->control_intf);
+	setup->wLength = cpu_to_le16(ctrl->info->size);
+
+	usb_fill_control_urb(dev->async.urb, dev->udev, usb_sndctrlpipe(dev->udev, 0),
+			     (unsigned char *)setup, dev->async.data + dev->async.offset,
+			     ctrl->info->size, myuvc_ctrl_async_complete, dev);
+
+	return usb_submit_urb(dev->async.urb, mem_flags);
+}
+
+static void myuvc_ctrl_async_complete(struct urb *urb)
+{
+	struct myuvc_device *dev = urb->context;
+	struct myuvc_control *ctrl = dev->ctrl_batch[dev->async.sent];
+	int ret;
+
+	if (urb->status == 0 && urb->actual_length == ctrl->info->size) {
+		dev->async.sent++;
+		dev->async.offset += ctrl->info->size;
+		if (dev->async.sent == dev->nbatch)
+			goto done;
+
+		ret = myuvc_ctrl_async_submit(dev, GFP_ATOMIC);
+		if (ret == 0)
+			return;
+		dev->async.status = ret;
+	} else {
+		dev->async.status = urb->status ? urb->status : -EIO;
+	}
+
+done:
+	/* 更新缓存和回滚要持有ctrl_mutex, 在工作队列里做 */
+	queue_work(dev->async.workqueue, &dev->async.work);
+}
+
+/* 记录一个控制事件, 唤醒读ctrl_events的进程. 满了时丢掉最旧的 */
+static void myuvc_ctrl_event(struct myuvc_device *dev,
+		const struct v4l2_ext_control *xctrl, int status)
+{
+	struct myuvc_ctrl_event *event;
+
+	spin_lock(&dev->async.lock);
+	if (dev->async.head - dev->async.tail == MYUVC_CTRL_EVENTS)
+		dev->async.tail++;
+	event = &dev->async.events[dev->async.head++ % MYUVC_CTRL_EVENTS];
+	event->sequence = dev->async.sequence++;
+	event->id = xctrl->id;
+	event->value = xctrl->value;
+	event->status = status;
+	spin_unlock(&dev->async.lock);
+}
+
+static void myuvc_ctrl_async_work(struct work_struct *work)
+{
+	struct myuvc_device *dev = container_of(work, struct myuvc_device, async.work);
+	struct myuvc_control *ctrl;
+	unsigned int i, offset = 0;
+
+	mutex_lock(&dev->ctrl_mutex);
+	/* 发送期间GET_CUR可能改写了DATA_CUR, 摄像头收下的是async.data中的值 */
+	for (i = 0; i < dev->async.sent; ++i) {
+		ctrl = dev->ctrl_batch[i];
+		memcpy(myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_CUR),
+		       dev->async.data + offset, ctrl->info->size);
+		offset += ctrl->info->size;
+	}
+	myuvc_ctrl_finish(dev, dev->async.sent, dev->async.status);
+
+	for (i = 0; i < dev->async.count; ++i)
+		myuvc_ctrl_event(dev, &dev->async.xctrls[i], dev->async.status);
+
+	kfree(dev->async.data);
+	kfree(dev->async.xctrls);
+	dev->async.data = NULL;
+	dev->async.xctrls = NULL;
+	dev->async.busy = 0;
+	mutex_unlock(&dev->ctrl_mutex);
+
+	wake_up_interruptible(&dev->async.wait);
+}
+
+/* 异步地发出这一批控制, 不等待摄像头响应. 调用者持有ctrl_mutex,
+ * 分配不到内存时退回同步方式
+ */
+static int myuvc_ctrl_commit_async(struct myuvc_device *dev,
+		const struct v4l2_ext_control *xctrls, unsigned int count)
+{
+	struct myuvc_control *ctrl;
+	unsigned int i, size = 0;
+	int ret;
+
+	if (dev->async.urb == NULL)
+		dev->async.urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (dev->async.workqueue == NULL)
+		dev->async.workqueue = create_singlethread_workqueue("myuvc_ctrl");
+
+	for (i = 0; i < dev->nbatch; ++i)
+		size += dev->ctrl_batch[i]->info->size;
+
+	dev->async.data = kmalloc(size, GFP_KERNEL);
+	dev->async.xctrls = kmemdup(xctrls, count * sizeof *xctrls, GFP_KERNEL);
+	if (dev->async.urb == NULL || dev->async.workqueue == NULL ||
+	    dev->async.data == NULL || dev->async.xctrls == NULL) {
+		kfree(dev->async.data);
+		kfree(dev->async.xctrls);
+		dev->async.data = NULL;
+		dev->async.xctrls = NULL;
+		return myuvc_ctrl_commit(dev);
+	}
+
+	/* URB使用数据的副本, 发送期间GET_CUR可以改写缓存 */
+	for (i = 0, size = 0; i < dev->nbatch; ++i) {
+		ctrl = dev->ctrl_batch[i];
+		memcpy(dev->async.data + size,
+		       myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_CUR), ctrl->info->size);
+		size += ctrl->info->size;
+	}
+
+	dev->async.count = count;
+	dev->async.sent = 0;
+	dev->async.offset = 0;
+	dev->async.status = 0;
+	dev->async.busy = 1;
+
+	ret = myuvc_ctrl_async_submit(dev, GFP_KERNEL);
+	if (ret < 0) {
+		myuvc_ctrl_finish(dev, 0, ret);
+		kfree(dev->async.data);
+		kfree(dev->async.xctrls);
+		dev->async.data = NULL;
+		dev->async.xctrls = NULL;
+		dev->async.busy = 0;
+	}
+
+	return ret;
+}
+
+/* 设置控制前等待上一批异步请求完成, 返回时持有ctrl_mutex */
+static int myuvc_ctrl_lock_idle(struct myuvc_device *dev, int nonblock)
+{
+	int ret;
+
+	for (;;) {
+		mutex_lock(&dev->ctrl_mutex);
+		if (!dev->async.busy)
+			return 0;
+		mutex_unlock(&dev->ctrl_mutex);
+
+		if (nonblock)
+			return -EBUSY;
+
+		ret = wait_event_interruptible(dev->async.wait, !dev->async.busy);
+		if (ret < 0)
+			return ret;
+	}
+}
+
+/* 发出这一批控制: async_controls时不等待完成 */
+static int myuvc_ctrl_apply(struct myuvc_device *dev,
+		const struct v4l2_ext_control *xctrls, unsigned int count)
+{
+	if (async_controls)
+		return myuvc_ctrl_commit_async(dev, xctrls, count);
+
+	return myuvc_ctrl_commit(dev);
+}
+
+static 	int myuvc_ctrl_set (struct file *file, void *fh,
+                struct v4l2_control *v4l2_ctrl)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	struct uvc_control_mapping *mapping;
+	struct myuvc_control *ctrl;
+	struct v4l2_ext_control xctrl;
+    int ret;
+
+	memset(&xctrl, 0, sizeof xctrl);
+	xctrl.id = v4l2_ctrl->id;
+	xctrl.value = v4l2_ctrl->value;
+
+	ret = myuvc_ctrl_lock_idle(dev, file->f_flags & O_NONBLOCK);
+	if (ret < 0)
+		return ret;
+
+	ret = myuvc_ctrl_check(dev, &xctrl, &ctrl, &mapping);
+	if (ret == 0)
+		ret = myuvc_ctrl_stage(dev, ctrl, mapping, xctrl.value, 0);
+	if (ret == 0)
+		ret = myuvc_ctrl_apply(dev, &xctrl, 1);
+	else
+		myuvc_ctrl_rollback(dev);
+	mutex_unlock(&dev->ctrl_mutex);
+
+	return ret;
+}
+
+/* 读一个控制的当前值, 调用者持有ctrl_mutex */
+static int myuvc_ctrl_read(struct myuvc_device *dev, __u32 id, __s32 *value)
+{
+	struct uvc_control_mapping *mapping;
+	struct myuvc_control *ctrl;
+	int ret;
+
+	ctrl = myuvc_find_control(dev, id, &mapping);
+	if (ctrl == NULL || !(ctrl->info->flags & UVC_CONTROL_GET_CUR))
+		return -EINVAL;
+
+	/* 先读GET_INFO, 才知道当前值能不能缓存 */
+	if ((ret = myuvc_ctrl_load(dev, ctrl)) < 0 ||
+	    (ret = myuvc_ctrl_get_cur(dev, ctrl)) < 0)
+		return ret;
+
+	*value = myuvc_ctrl_to_v4l2(mapping,
+			myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_CUR));
+	return 0;
+}
+
+static  int myuvc_ctrl_get (struct file *file, void *fh,
+                struct v4l2_control *v4l2_ctrl)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+    int ret;
+
+	mutex_lock(&dev->ctrl_mutex);
+	ret = myuvc_ctrl_read(dev, v4l2_ctrl->id, &v4l2_ctrl->value);
+	mutex_unlock(&dev->ctrl_mutex);
+
+    return ret;
+}
+
+/* 扩展控制: 一批控制要属于ctrl_class(为0时不限制) */
+static int myuvc_ext_ctrls_class(struct v4l2_ext_controls *ctrls)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctrls->count; ++i) {
+		if (ctrls->ctrl_class &&
+		    V4L2_CTRL_ID2CLASS(ctrls->controls[i].id) != ctrls->ctrl_class) {
+			ctrls->error_idx = i;
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int myuvc_g_ext_ctrls(struct file *file, void *fh,
+		struct v4l2_ext_controls *ctrls)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	unsigned int i;
+	int ret;
+
+	if ((ret = myuvc_ext_ctrls_class(ctrls)) < 0)
+		return ret;
+
+	mutex_lock(&dev->ctrl_mutex);
+	for (i = 0; i < ctrls->count; ++i) {
+		ret = myuvc_ctrl_read(dev, ctrls->controls[i].id,
+				      &ctrls->controls[i].value);
+		if (ret < 0) {
+			ctrls->error_idx = i;
+			break;
+		}
+	}
+	mutex_unlock(&dev->ctrl_mutex);
+
+	return ret;
+}
+
+/* 先检查整批控制, 都没问题时才修改缓存并依次发给摄像头 */
+static int myuvc_do_ext_ctrls(struct file *file,
+		struct v4l2_ext_controls *ctrls, int set)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	struct uvc_control_mapping **mappings;
+	struct myuvc_control **ctrl_list;
+	unsigned int i;
+	int ret;
+
+	if ((ret = myuvc_ext_ctrls_class(ctrls)) < 0)
+		return ret;
+
+	/* 第2遍直接使用第1遍检查时找到的控制, 不再检查(也不再读摄像头) */
+	ctrl_list = kcalloc(ctrls->count, sizeof *ctrl_list, GFP_KERNEL);
+	mappings = kcalloc(ctrls->count, sizeof *mappings, GFP_KERNEL);
+	if (ctrl_list == NULL || mappings == NULL) {
+		ret = -ENOMEM;
+		goto free_lists;
+	}
+
+	if (!set)
+		mutex_lock(&dev->ctrl_mutex);
+	else if ((ret = myuvc_ctrl_lock_idle(dev, file->f_flags & O_NONBLOCK)) < 0)
+		goto free_lists;
+
+	for (i = 0; i < ctrls->count; ++i) {
+		ret = myuvc_ctrl_check(dev, &ctrls->controls[i], &ctrl_list[i],
+				       &mappings[i]);
+		if (ret < 0) {
+			ctrls->error_idx = i;
+			goto done;
+		}
+	}
+
+	if (!set)
+		goto done;
+
+	for (i = 0; i < ctrls->count; ++i) {
+		ret = myuvc_ctrl_stage(dev, ctrl_list[i], mappings[i],
+				       ctrls->controls[i].value, ctrls->count > 1);
+		if (ret < 0) {
+			myuvc_ctrl_rollback(dev);
+			ctrls->error_idx = i;
+			goto done;
+		}
+	}
+
+	ret = myuvc_ctrl_apply(dev, ctrls->controls, ctrls->count);
+	if (ret < 0)
+		ctrls->error_idx = ctrls->count;
+
+done:
+	mutex_unlock(&dev->ctrl_mutex);
+free_lists:
+	kfree(ctrl_list);
+	kfree(mappings);
+	return ret;
+}
+
+static int myuvc_s_ext_ctrls(struct file *file, void *fh,
+		struct v4l2_ext_controls *ctrls)
+{
+	return myuvc_do_ext_ctrls(file, ctrls, 1);
+}
+
+static int myuvc_try_ext_ctrls(struct file *file, void *fh,
+		struct v4l2_ext_controls *ctrls)
+{
+	return myuvc_do_ext_ctrls(file, ctrls, 0);
+}
+
+
+/* UVCIOC_CTRL_ADD: 把扩展单元的一个控制加入dev->controls,
+ * info->entity是扩展单元的guidExtensionCode, info->index要在它的bmControls中
+ */
+static int myuvc_xu_ctrl_add(struct myuvc_device *dev,
+		struct uvc_xu_control_info *xinfo)
+{
+	struct uvc_control_info *info;
+	struct myuvc_xu *xu;
+	unsigned int i, j;
+	int ret = -ENOENT;
+
+	if (xinfo->size == 0 || xinfo->size > MYUVC_XU_MAX_SIZE ||
+	    (xinfo->flags & ~(UVC_CONTROL_GET_RANGE | UVC_CONTROL_SET_CUR |
+			      UVC_CONTROL_RESTORE | UVC_CONTROL_AUTO_UPDATE)))
+		return -EINVAL;
+
+	mutex_lock(&dev->ctrl_mutex);
+	for (i = 0; i < dev->nxus; ++i) {
+		xu = &dev->xus[i];
+		if (memcmp(xu->guid, xinfo->entity, 16) != 0)
+			continue;
+
+		if (xinfo->index >= xu->control_size * 8 ||
+		    !(xu->bmControls[xinfo->index / 8] & (1 << (xinfo->index % 8)))) {
+			ret = -EINVAL;
+			break;
+		}
+
+		for (j = 0; j < dev->ncontrols; ++j) {
+			if (dev->controls[j].unit == xu->id &&
+			    dev->controls[j].info->selector == xinfo->selector)
+				break;
+		}
+		if (j < dev->ncontrols) {
+			ret = -EEXIST;
+			break;
+		}
+
+		info = kzalloc(sizeof *info, GFP_KERNEL);
+		if (info == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+		memcpy(info->entity, xinfo->entity, 16);
+		info->index = xinfo->index;
+		info->selector = xinfo->selector;
+		info->size = xinfo->size;
+		info->flags = xinfo->flags;
+
+		ret = myuvc_ctrl_add(dev, xu->id, info);
+		if (ret < 0) {
+			kfree(info);
+			break;
+		}
+		list_add_tail(&info->list, &dev->xu_infos);
+		break;
+	}
+	mutex_unlock(&dev->ctrl_mutex);
+
+	return ret;
+}
+
+/* UVCIOC_CTRL_MAP: 把扩展单元控制数据中的一些位映射成一个V4L2控制 */
+static int myuvc_xu_ctrl_map(struct myuvc_device *dev,
+		struct uvc_xu_control_mapping *xmap)
+{
+	struct uvc_control_mapping *mapping;
+	struct myuvc_control *ctrl;
+	unsigned int i;
+	int ret = 0;
+
+	/* id中不能带V4L2_CTRL_FLAG_NEXT_CTRL这样的标志 */
+	if ((xmap->id & ~V4L2_CTRL_ID_MASK) ||
+	    xmap->size == 0 || xmap->size > 32 ||
+	    (xmap->v4l2_type != V4L2_CTRL_TYPE_INTEGER &&
+	     xmap->v4l2_type != V4L2_CTRL_TYPE_BOOLEAN &&
+	     xmap->v4l2_type != V4L2_CTRL_TYPE_BUTTON) ||
+	    xmap->data_type > UVC_CTRL_DATA_TYPE_BITMASK)
+		return -EINVAL;
+
+	mutex_lock(&dev->ctrl_mutex);
+	if (myuvc_find_control(dev, xmap->id, &mapping) != NULL) {
+		ret = -EEXIST;
+		goto done;
+	}
+
+	/* 只能映射摄像头的控制或者UVCIOC_CTRL_ADD加入的控制, 位不能超出控制的数据 */
+	for (i = 0; i < dev->ncontrols; ++i) {
+		ctrl = &dev->controls[i];
+		if (ctrl->info->selector == xmap->selector &&
+		    memcmp(ctrl->info->entity, xmap->entity, 16) == 0 &&
+		    xmap->offset + xmap->size <= ctrl->info->size * 8)
+			break;
+	}
+	if (i == dev->ncontrols) {
+		ret = -EINVAL;
+		goto done;
+	}
+
+	mapping = kzalloc(sizeof *mapping, GFP_KERNEL);
+	if (mapping == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	mapping->id = xmap->id;
+	memcpy(mapping->name, xmap->name, sizeof mapping->name);
+	mapping->name[sizeof mapping->name - 1] = '\0';
+	memcpy(mapping->entity, xmap->entity, 16);
+	mapping->selector = xmap->selector;
+	mapping->size = xmap->size;
+	mapping->offset = xmap->offset;
+	mapping->v4l2_type = xmap->v4l2_type;
+	mapping->data_type = xmap->data_type;
+	list_add_tail(&mapping->list, &dev->xu_mappings);
+
+done:
+	mutex_unlock(&dev->ctrl_mutex);
+	return ret;
+}
+
+/* UVCIOC_CTRL_GET/SET: 直接读写扩展单元控制的原始数据 */
+static int myuvc_xu_ctrl_query(struct file *file, struct uvc_xu_control *xctrl,
+		int set)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+	struct myuvc_control *ctrl = NULL;
+	unsigned int i, j;
+	__u8 *data = NULL;
+	int ret;
+
+	if (!set)
+		mutex_lock(&dev->ctrl_mutex);
+	else if ((ret = myuvc_ctrl_lock_idle(dev, file->f_flags & O_NONBLOCK)) < 0)
+		return ret;
+
+	/* 只能访问扩展单元中用UVCIOC_CTRL_ADD加入的控制 */
+	for (j = 0; j < dev->nxus; ++j) {
+		if (dev->xus[j].id != xctrl->unit)
+			continue;
+
+		for (i = 0; i < dev->ncontrols; ++i) {
+			if (dev->controls[i].unit == xctrl->unit &&
+			    dev->controls[i].info->selector == xctrl->selector) {
+				ctrl = &dev->controls[i];
+				break;
+			}
+		}
+		break;
+	}
+
+	if (ctrl == NULL || ctrl->info->size != xctrl->size ||
+	    !(ctrl->info->flags & (set ? UVC_CONTROL_SET_CUR : UVC_CONTROL_GET_CUR))) {
+		ret = -EINVAL;
+		goto done;
+	}
+
+	/* 长度已经和UVCIOC_CTRL_ADD时给出的一致, 才分配内存 */
+	data = kmalloc(xctrl->size, GFP_KERNEL);
+	if (data == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	if (set && copy_from_user(data, xctrl->data, xctrl->size)) {
+		ret = -EFAULT;
+		goto done;
+	}
+
+	ret = myuvc_ctrl_query(dev, set ? SET_CUR : GET_CUR, xctrl->unit,
+			       xctrl->selector, data, xctrl->size);
+	if (ret != xctrl->size) {
+		ret = ret < 0 ? ret : -EIO;
+		ctrl->cur_valid = 0;
+		goto done;
+	}
+	ret = 0;
+
+	/* 映射到V4L2控制的值也跟着变了 */
+	memcpy(myuvc_ctrl_data(ctrl, MYUVC_CTRL_DATA_CUR), data, xctrl->size);
+	ctrl->cur_valid = myuvc_ctrl_cacheable(ctrl);
+
+done:
+	mutex_unlock(&dev->ctrl_mutex);
+
+	if (ret == 0 && !set && copy_to_user(xctrl->data, data, xctrl->size))
+		ret = -EFAULT;
+	kfree(data);
+	return ret;
+}
+
+/* video_ioctl2不认识的ioctl: uvcvideo.h中的扩展单元ioctl */
+static long myuvc_vidioc_default(struct file *file, void *fh, int cmd, void *arg)
+{
+	struct myuvc_device *dev = video_drvdata(file);
+
+	switch (cmd) {
+	case UVCIOC_CTRL_ADD:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		return myuvc_xu_ctrl_add(dev, arg);
+
+	case UVCIOC_CTRL_MAP:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		return myuvc_xu_ctrl_map(dev, arg);
+
+	case UVCIOC_CTRL_GET:
+		return myuvc_xu_ctrl_query(file, arg, 0);
+
+	case UVCIOC_CTRL_SET:
+		return myuvc_xu_ctrl_query(file, arg, 1);
+
+	default:
+		return -EINVAL;
+	}
+}
+
+/* VideoControl Interface的中断端点: 摄像头用它报告控制的变化 */
+static void myuvc_status_complete(struct urb *urb)
+{
+	struct myuvc_device *dev = urb->context;
+	__u8 *data = urb->transfer_buffer;
+	int ret;
+
+	switch (urb->status) {
+	case 0:
+		break;
+
+	case -ENOENT:		/* usb_kill_urb() called. */
+	case -ECONNRESET:	/* usb_unlink_urb() called. */
+	case -ESHUTDOWN:	/* The endpoint is being disabled. */
+	case -EPROTO:		/* Device is disconnected (reported by some
+				 * host controller). */
+		return;
+
+	default:
+		printk("Non-zero status (%d) in status completion handler.\n",
+		       urb->status);
+		goto resubmit;
+	}
+
+	/* data[0] bStatusType, data[1] bOriginator, data[2] bEvent,
+	 * data[3] bSelector, data[4] bAttribute
+	 */
+	if (urb->actual_length >= 5 &&
+	    (data[0] & 0x0f) == UVC_STATUS_TYPE_CONTROL && data[2] == 0)
+		myuvc_ctrl_invalidate(dev, data[1], data[3], data[4]);
+
+resubmit:
+	if ((ret = usb_submit_urb(urb, GFP_ATOMIC)) < 0)
+		printk("Failed to resubmit status URB (%d).\n", ret);
+}
+
+/* 没有中断端点的摄像头, 控制的缓存只有驱动自己SET_CUR时才更新 */
+static int myuvc_status_init(struct myuvc_device *dev)
+{
+	struct usb_host_interface *alts = dev->intf->cur_altsetting;
+	struct usb_endpoint_descriptor *desc = NULL;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < alts->desc.bNumEndpoints; ++i) {
+		if (usb_endpoint_is_int_in(&alts->endpoint[i].desc)) {
+			desc = &alts->endpoint[i].desc;
+			break;
+		}
+	}
+
+	if (desc == NULL)
+		return 0;
+
+	dev->status = kzalloc(UVC_MAX_STATUS_SIZE, GFP_KERNEL);
+	dev->int_urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (dev->status == NULL || dev->int_urb == NULL)
+		return -ENOMEM;
+
+	usb_fill_int_urb(dev->int_urb, dev->udev,
+		usb_rcvintpipe(dev->udev, desc->bEndpointAddress),
+		dev->status, UVC_MAX_STATUS_SIZE, myuvc_status_complete,
+		dev, desc->bInterval);
+
+	if ((ret = usb_submit_urb(dev->int_urb, GFP_KERNEL)) < 0)
+		printk("myuvc: failed to submit status URB (%d).\n", ret);
+
+	return ret;
+}
+
+static const struct v4l2_ioctl_ops myuvc_ioctl_ops = {
+        // 表示它是一个摄像头设备
+        .vidioc_querycap      = myuvc_vidioc_querycap,
+
+        /* 用于列举、获得、测试、设置摄像头的数据的格式 */
+        .vidioc_enum_fmt_vid_cap  = myuvc_vidioc_enum_fmt_vid_cap,
+        .vidioc_g_fmt_vid_cap     = myuvc_vidioc_g_fmt_vid_cap,
+        .vidioc_try_fmt_vid_cap   = myuvc_vidioc_try_fmt_vid_cap,
+        .vidioc_s_fmt_vid_cap     = myuvc_vidioc_s_fmt_vid_cap,
+        .vidioc_enum_framesizes   = myuvc_vidioc_enum_framesizes,
+        .vidioc_enum_frameintervals = myuvc_vidioc_enum_frameintervals,
+
+        /* 帧率 */
+        .vidioc_g_parm        = myuvc_vidioc_g_parm,
+        .vidioc_s_parm        = myuvc_vidioc_s_parm,
+        
+        /* 缓冲区操作: 申请/查询/放入队列/取出队列 */
+        .vidioc_reqbufs       = myuvc_vidioc_reqbufs,
+        .vidioc_querybuf      = myuvc_vidioc_querybuf,
+        .vidioc_qbuf          = myuvc_vidioc_qbuf,
+        .vidioc_dqbuf         = myuvc_vidioc_dqbuf,
+
+        /* 属性设置 */
+		.vidioc_queryctrl	  = myuvc_query_v4l2_ctrl,
+		.vidioc_s_ctrl		  = myuvc_ctrl_set,
+		.vidioc_g_ctrl		  = myuvc_ctrl_get,
+		.vidioc_querymenu	  = myuvc_querymenu,
+		.vidioc_g_ext_ctrls	  = myuvc_g_ext_ctrls,
+		.vidioc_s_ext_ctrls	  = myuvc_s_ext_ctrls,
+		.vidioc_try_ext_ctrls	  = myuvc_try_ext_ctrls,
+		.vidioc_default		  = myuvc_vidioc_default,
+
+        // 启动/停止
+        .vidioc_streamon      = myuvc_vidioc_streamon,
+        .vidioc_streamoff     = myuvc_vidioc_streamoff,   
+};
+
+
+static const struct v4l2_file_operations myuvc_fops = {
+	.owner		= THIS_MODULE,
+    .open       = myuvc_open,
+    .release    = myuvc_close,
+    .mmap       = myuvc_mmap,
+    .ioctl      = video_ioctl2, /* V4L2 ioctl handler */
+    .poll       = myuvc_poll,
+};
+
+/* debugfs: /sys/kernel/debug/myuvc/videoN/stats
+ * 读: 所有CPU的统计之和; 写任意内容: 清零
+ */
+static struct dentry *myuvc_debugfs_root;
+
+static void myuvc_stats_sum(struct myuvc_device *dev, struct myuvc_stats *sum)
+{
+	unsigned long *src, *dst;
+	unsigned int i;
+	int cpu;
+
+	memset(sum, 0, sizeof *sum);
+	for_each_possible_cpu(cpu) {
+		src = (unsigned long *)per_cpu_ptr(dev->stats, cpu);
+		dst = (unsigned long *)sum;
+		for (i = 0; i < sizeof *sum / sizeof(unsigned long); i++)
+			dst[i] += src[i];
+	}
+}
+
+static void myuvc_stats_hist(struct seq_file *s, const unsigned long *hist,
+		unsigned int nbuckets)
+{
+	unsigned int i;
+
+	for (i = 0; i < nbuckets; i++) {
+		if (i == nbuckets - 1)
+			seq_printf(s, "  >= %-8u %lu\n", i ? 1U << (i - 1) : 0, hist[i]);
+		else
+			seq_printf(s, "  <  %-8u %lu\n", 1U << i, hist[i]);
+	}
+}
+
+static int myuvc_stats_show(struct seq_file *s, void *v)
+{
+	struct myuvc_device *dev = s->private;
+	struct myuvc_stats sum;
+
+	myuvc_stats_sum(dev, &sum);
+
+	seq_printf(s, "urbs:             %lu\n", sum.urbs);
+	seq_printf(s, "resubmit_failed:  %lu\n", sum.resubmit_failed);
+	seq_printf(s, "urbs_error:       %lu\n", sum.urbs_error);
+	seq_printf(s, "packets:          %lu\n", sum.packets);
+	seq_printf(s, "packets_good:     %lu\n",
+		   sum.packets - sum.packets_lost - sum.packets_error);
+	seq_printf(s, "packets_lost:     %lu\n", sum.packets_lost);
+	seq_printf(s, "packets_error:    %lu\n", sum.packets_error);
+	seq_printf(s, "bytes:            %lu\n", sum.bytes);
+	seq_printf(s, "frames:           %lu\n", sum.frames);
+	seq_printf(s, "frames_dropped:   %lu\n", sum.frames_dropped);
+	seq_printf(s, "frames_truncated: %lu\n", sum.frames_truncated);
+	seq_printf(s, "frames_error:     %lu\n", sum.frames_error);
+	seq_printf(s, "frames_packet_lost: %lu\n", sum.frames_packet_lost);
+	seq_printf(s, "frames_stream_err:  %lu\n", sum.frames_stream_err);
+	seq_printf(s, "frames_recycled:  %lu\n", sum.frames_recycled);
+	seq_printf(s, "capture_records:  %lu\n", dev->capture.records);
+	seq_printf(s, "capture_lost:     %lu\n", dev->capture.lost);
+
+	seq_printf(s, "irq_ns:           %lu\n", sum.irq_ns);
+	seq_printf(s, "work_ns:          %lu\n", sum.work_ns);
+
+	seq_puts(s, "completion handler (us):\n");
+	myuvc_stats_hist(s, sum.irq_hist, MYUVC_HIST_BUCKETS);
+	seq_puts(s, "first payload to DQBUF (us):\n");
+	myuvc_stats_hist(s, sum.latency_hist, MYUVC_LATENCY_BUCKETS);
+
+	return 0;
+}
+
+/* 2.6.31的debugfs_remove不会作废已经打开的文件, 摄像头断开以后它们还可以读写,
+ * 所以打开debugfs文件时取得dev的引用, 关闭时释放
+ */
+static int myuvc_debugfs_single_open(struct inode *inode, struct file *file,
+		int (*show)(struct seq_file *, void *))
+{
+	struct myuvc_device *dev = inode->i_private;
+	int ret;
+
+	ret = single_open(file, show, dev);
+	if (ret == 0)
+		kref_get(&dev->kref);
+	return ret;
+}
+
+static int myuvc_debugfs_single_release(struct inode *inode, struct file *file)
+{
+	struct myuvc_device *dev = inode->i_private;
+
+	single_release(inode, file);
+	kref_put(&dev->kref, myuvc_kref_release);
+	return 0;
+}
+
+/* 不使用seq_file的文件: private_data就是dev */
+static int myuvc_debugfs_open(struct inode *inode, struct file *file)
+{
+	struct myuvc_device *dev = inode->i_private;
+
+	file->private_data = dev;
+	kref_get(&dev->kref);
+	return nonseekable_open(inode, file);
+}
+
+static int myuvc_debugfs_release(struct inode *inode, struct file *file)
+{
+	struct myuvc_device *dev = file->private_data;
+
+	kref_put(&dev->kref, myuvc_kref_release);
+	return 0;
+}
+
+static int myuvc_stats_open(struct inode *inode, struct file *file)
+{
+	return myuvc_debugfs_single_open(inode, file, myuvc_stats_show);
+}
+
+static ssize_t myuvc_stats_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct myuvc_device *dev = ((struct seq_file *)file->private_data)->private;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dev->stats, cpu), 0, sizeof(struct myuvc_stats));
+
+	return count;
+}
+
+static const struct file_operations myuvc_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= myuvc_stats_open,
+	.read		= seq_read,
+	.write		= myuvc_stats_write,
+	.llseek		= seq_lseek,
+	.release	= myuvc_debugfs_single_release,
+};
+
+#ifdef CONFIG_MYUVC_TESTING
+/* debugfs: /sys/kernel/debug/myuvc/videoN/bench
+ * 不需要摄像头, 用合成的payload测量解析URB数据(头部, FID/EOF, quirk, 复制)的速度
+ * 写 "frames frame_size packet_size loss" 开始测试, loss是丢失packet的千分比,
+ * 批量传输的摄像头每个URB是一个packet_size字节的payload, 不模拟丢失
+ * 读: 最近一次的结果
+ * 测试使用REQBUFS分配的缓冲区, 要在REQBUFS之后, QBUF和STREAMON之前进行
+ */
+#define MYUVC_BENCH_PACKETS	32
+#define MYUVC_BENCH_HEADER	12
+
+/* 把已经填满的缓冲区重新放入irqqueue, 返回填满的帧数 */
+static unsigned int myuvc_bench_requeue(struct myuvc_device *dev)
+{
+	struct myuvc_buffer *buf;
+	unsigned int i, done = 0;
+	unsigned long flags;
+
+	for (i = 0; i < dev->queue.count; ++i) {
+		buf = &dev->queue.buffer[i];
+		if (buf->state == VIDEOBUF_QUEUED || buf->state == VIDEOBUF_ACTIVE)
+			continue;
+		if (buf->state != VIDEOBUF_IDLE)
+			done++;
+
+		/* 和myuvc_queue_recycle一样清除上一帧留下的状态 */
+		buf->state = VIDEOBUF_QUEUED;
+		buf->buf.bytesused = 0;
+		buf->buf.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+		buf->buf.reserved = 0;
+		buf->pts_valid = 0;
+		buf->error = 0;
+		buf->complete = 0;
+		spin_lock_irqsave(&dev->queue.irqlock, flags);
+		list_add_tail(&buf->irq, &dev->queue.irqqueue);
+		spin_unlock_irqrestore(&dev->queue.irqlock, flags);
+	}
+
+	return done;
+}
+
+/* 生成一个payload: 12字节头部, 每帧第1个payload的数据以JPEG的SOI开头,
+ * 最后一个payload设置EOF, 返回payload的长度
+ */
+static unsigned int myuvc_bench_payload(u8 *mem, unsigned int psize,
+		unsigned int frame_size, unsigned int *pos, unsigned int *frame)
+{
+	unsigned int len;
+
+	len = min(psize - MYUVC_BENCH_HEADER, frame_size - *pos);
+
+	mem[0] = MYUVC_BENCH_HEADER;
+	mem[1] = UVC_STREAM_EOH | (*frame & 1 ? UVC_STREAM_FID : 0);
+	if (*pos == 0) {
+		mem[MYUVC_BENCH_HEADER]     = 0xFF;
+		mem[MYUVC_BENCH_HEADER + 1] = 0xD8;
+		mem[MYUVC_BENCH_HEADER + 2] = 0xFF;
+	} else {
+		mem[MYUVC_BENCH_HEADER] = 0x55;
+	}
+
+	*pos += len;
+	if (*pos >= frame_size) {
+		mem[1] |= UVC_STREAM_EOF;
+		*pos = 0;
+		(*frame)++;
+	}
+
+	return MYUVC_BENCH_HEADER + len;
+}
+
+/* 用合成的payload填满一个URB, 返回packet数
+ * 批量传输: 一个payload; 同步传输: MYUVC_BENCH_PACKETS个packet, 按千分比loss丢失
+ */
+static unsigned int myuvc_bench_fill_urb(struct myuvc_device *dev, struct urb *urb,
+		u8 *mem, unsigned int psize, unsigned int frame_size,
+		unsigned int *pos, unsigned int *frame, unsigned int loss)
+{
+	unsigned int i, len;
+
+	if (dev->streaming_bulk) {
+		/* 比URB短的数据表示payload结束 */
+		urb->number_of_packets = 0;
+		urb->transfer_buffer_length = psize + 1;
+		urb->actual_length = myuvc_bench_payload(mem, psize,
+					frame_size, pos, frame);
+		return 1;
+	}
+
+	urb->number_of_packets = MYUVC_BENCH_PACKETS;
+	urb->actual_length = 0;
+	for (i = 0; i < MYUVC_BENCH_PACKETS; ++i) {
+		len = myuvc_bench_payload(mem + i * psize, psize,
+					  frame_size, pos, frame);
+		urb->iso_frame_desc[i].offset = i * psize;
+		urb->iso_frame_desc[i].length = psize;
+		urb->iso_frame_desc[i].actual_length = len;
+		urb->iso_frame_desc[i].status = 0;
+		if (loss && random32() % 1000 < loss) {
+			urb->iso_frame_desc[i].actual_length = 0;
+			urb->iso_frame_desc[i].status = -EXDEV;
+		}
+		urb->actual_length += urb->iso_frame_desc[i].actual_length;
+	}
+
+	return MYUVC_BENCH_PACKETS;
+}
+
+static int myuvc_bench_run(struct myuvc_device *dev, unsigned int frames,
+		unsigned int frame_size, unsigned int psize, unsigned int loss)
+{
+	struct urb *urb;
+	u8 *mem;
+	unsigned int i, pos = 0, frame = 0;
+	ktime_t start;
+	int ret = 0;
+
+	if (frames == 0 || frame_size == 0 || loss > 1000 ||
+	    psize <= MYUVC_BENCH_HEADER + 3 || psize > 32768)
+		return -EINVAL;
+
+	urb = usb_alloc_urb(MYUVC_BENCH_PACKETS, GFP_KERNEL);
+	mem = vmalloc(MYUVC_BENCH_PACKETS * psize);
+	if (urb == NULL || mem == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	memset(mem, 0x55, MYUVC_BENCH_PACKETS * psize);
+	urb->transfer_buffer = mem;
+
+	mutex_lock(&dev->queue.mutex);
+	if (dev->streaming || dev->replay.active || dev->queue.count == 0 ||
+	    dev->queue.memory != V4L2_MEMORY_MMAP ||
+	    !list_empty(&dev->queue.mainqueue)) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	memset(&dev->bench, 0, sizeof dev->bench);
+	dev->latest = 0;
+	dev->last_fid = -1;
+	dev->bulk.header_size = 0;
+	dev->bulk.skip_payload = 0;
+	dev->bulk.payload_size = 0;
+	dev->bulk.max_payload_size = psize;
+	myuvc_bench_requeue(dev);
+
+	while (frame < frames) {
+		dev->bench.packets += myuvc_bench_fill_urb(dev, urb, mem, psize,
+					frame_size, &pos, &frame, loss);
+		dev->bench.bytes += urb->actual_length;
+
+		start = ktime_get();
+		myuvc_video_decode(dev, urb, start, 0);
+		dev->bench.ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		dev->bench.frames += myuvc_bench_requeue(dev);
+	}
+
+	/* 恢复到REQBUFS之后的状态 */
+	myuvc_queue_cancel(dev);
+	for (i = 0; i < dev->queue.count; ++i)
+		dev->queue.buffer[i].buf.bytesused = 0;
+	dev->last_fid = -1;
+
+unlock:
+	mutex_unlock(&dev->queue.mutex);
+done:
+	vfree(mem);
+	usb_free_urb(urb);
+	return ret;
+}
+
+static int myuvc_bench_show(struct seq_file *s, void *v)
+{
+	struct myuvc_device *dev = s->private;
+	u64 ns = dev->bench.ns ? dev->bench.ns : 1;
+
+	seq_printf(s, "frames %u packets %u bytes %llu time %lld ns\n",
+		   dev->bench.frames, dev->bench.packets, dev->bench.bytes,
+		   dev->bench.ns);
+	seq_printf(s, "%llu MB/s, %llu ns/packet, %llu frames/s\n",
+		   div64_u64(dev->bench.bytes * 1000, ns),
+		   dev->bench.packets ? div_u64(ns, dev->bench.packets) : 0,
+		   div64_u64((u64)dev->bench.frames * NSEC_PER_SEC, ns));
+
+	return 0;
+}
+
+static int myuvc_bench_open(struct inode *inode, struct file *file)
+{
+	return myuvc_debugfs_single_open(inode, file, myuvc_bench_show);
+}
+
+static ssize_t myuvc_bench_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct myuvc_device *dev = ((struct seq_file *)file->private_data)->private;
+	unsigned int frames, frame_size, psize, loss = 0;
+	char cmd[64];
+	int ret;
+
+	if (count >= sizeof cmd)
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+
+	if (sscanf(cmd, "%u %u %u %u", &frames, &frame_size, &psize, &loss) < 3)
+		return -EINVAL;
+
+	ret = myuvc_bench_run(dev, frames, frame_size, psize, loss);
+	return ret < 0 ? ret : count;
+}
+
+static const struct file_operations myuvc_bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= myuvc_bench_open,
+	.read		= seq_read,
+	.write		= myuvc_bench_write,
+	.llseek		= seq_lseek,
+	.release	= myuvc_debugfs_single_release,
+};
+#endif /* CONFIG_MYUVC_TESTING */
+
+/* debugfs: /sys/kernel/debug/myuvc/videoN/capture
+ * 抓取URB的原始数据, 格式见struct myuvc_capture_hdr
+ * 写 "kbytes [snaplen]" 分配kbytes KB的环形缓冲区并开始抓取,
+ * snaplen限制每个packet记录的字节数(只关心payload头部时可以写12), 0或省略表示全部记录
+ * 写 "0" 停止抓取, 已经抓取的数据还可以读出
+ * 读: 没有数据时休眠, 停止抓取并且数据读完以后返回0(文件结束)
+ */
+#define MYUVC_CAPTURE_MAX_KB	(256 * 1024)
+
+static int myuvc_capture_start(struct myuvc_device *dev, unsigned int kbytes,
+		unsigned int snaplen)
+{
+	unsigned long flags;
+	unsigned int size = 0;
+	u8 *ring = NULL, *old;
+
+	if (kbytes > MYUVC_CAPTURE_MAX_KB)
+		return -EINVAL;
+
+	if (kbytes) {
+		size = roundup_pow_of_two(kbytes * 1024);
+		ring = vmalloc(size);
+		if (ring == NULL)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&dev->capture.mutex);
+	spin_lock_irqsave(&dev->capture.lock, flags);
+	if (ring == NULL) {
+		/* 停止: 保留环形缓冲区, 让APP读完剩下的数据 */
+		old = NULL;
+		dev->capture.enabled = 0;
+	} else {
+		old = dev->capture.ring;
+		dev->capture.ring     = ring;
+		dev->capture.size     = size;
+		dev->capture.snaplen  = snaplen;
+		dev->capture.head     = 0;
+		dev->capture.tail     = 0;
+		dev->capture.dropped  = 0;
+		dev->capture.records  = 0;
+		dev->capture.lost     = 0;
+		dev->capture.enabled  = 1;
+	}
+	spin_unlock_irqrestore(&dev->capture.lock, flags);
+	mutex_unlock(&dev->capture.mutex);
+
+	wake_up_interruptible(&dev->capture.wait);
+	vfree(old);
+	return 0;
+}
+
+static int myuvc_capture_ready(struct myuvc_device *dev)
+{
+	return dev->capture.head != dev->capture.tail || !dev->capture.enabled;
+}
+
+/* 完成函数只在空闲的空间里写, 读出时不需要持有自旋锁 */
+static ssize_t myuvc_capture_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct myuvc_device *dev = file->private_data;
+	unsigned int head, tail, off, len, n;
+	unsigned long flags;
+	int enabled;
+	ssize_t ret;
+
+	for (;;) {
+		mutex_lock(&dev->capture.mutex);
+		spin_lock_irqsave(&dev->capture.lock, flags);
+		head    = dev->capture.head;
+		tail    = dev->capture.tail;
+		enabled = dev->capture.enabled;
+		spin_unlock_irqrestore(&dev->capture.lock, flags);
+		if (head != tail)
+			break;
+		mutex_unlock(&dev->capture.mutex);
+
+		if (!enabled)
+			return 0;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(dev->capture.wait, myuvc_capture_ready(dev));
+		if (ret < 0)
+			return ret;
+	}
+
+	len = min_t(size_t, count, head - tail);
+	off = tail & (dev->capture.size - 1);
+	n   = min(len, dev->capture.size - off);
+
+	if (copy_to_user(buf, dev->capture.ring + off, n) ||
+	    copy_to_user(buf + n, dev->capture.ring, len - n)) {
+		ret = -EFAULT;
+		goto done;
+	}
+
+	spin_lock_irqsave(&dev->capture.lock, flags);
+	dev->capture.tail = tail + len;
+	spin_unlock_irqrestore(&dev->capture.lock, flags);
+
+	*ppos += len;
+	ret = len;
+
+done:
+	mutex_unlock(&dev->capture.mutex);
+	return ret;
+}
+
+static ssize_t myuvc_capture_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct myuvc_device *dev = file->private_data;
+	unsigned int kbytes, snaplen = 0;
+	char cmd[32];
+	int ret;
+
+	if (count >= sizeof cmd)
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+
+	if (sscanf(cmd, "%u %u", &kbytes, &snaplen) < 1)
+		return -EINVAL;
+
+	ret = myuvc_capture_start(dev, kbytes, snaplen);
+	return ret < 0 ? ret : count;
+}
+
+static const struct file_operations myuvc_capture_fops = {
+	.owner		= THIS_MODULE,
+	.open		= myuvc_debugfs_open,
+	.read		= myuvc_capture_read,
+	.write		= myuvc_capture_write,
+	.llseek		= no_llseek,
+	.release	= myuvc_debugfs_release,
+};
+
+#ifdef CONFIG_MYUVC_TESTING
+/* debugfs: /sys/kernel/debug/myuvc/videoN/replay
+ * 把capture文件抓取的数据写入这个文件(比如 cat trace.bin > replay),
+ * 每条记录按照抓取时的传输类型和quirk, 用同一套解析函数解析, 可以在没有
+ * 摄像头的情况下重现现场的问题, 也可以作为解析代码的性能测试的输入
+ * 读: 最近一次回放的结果
+ * 和bench一样使用REQBUFS分配的缓冲区, 打开文件写入期间不能STREAMON
+ */
+#define MYUVC_REPLAY_MAX	(1024 * 1024)
+
+static int myuvc_replay_check(const struct myuvc_capture_hdr *hdr)
+{
+	unsigned int npackets = le16_to_cpu(hdr->npackets);
+	unsigned int size = le32_to_cpu(hdr->size);
+
+	if (le32_to_cpu(hdr->magic) != MYUVC_CAPTURE_MAGIC ||
+	    le16_to_cpu(hdr->version) != MYUVC_CAPTURE_VERSION ||
+	    le16_to_cpu(hdr->hdr_size) != sizeof *hdr)
+		return -EINVAL;
+
+	if (npackets == 0 || npackets > UVC_MAX_PACKETS ||
+	    ((le32_to_cpu(hdr->flags) & MYUVC_CAPTURE_BULK) && npackets != 1))
+		return -EINVAL;
+
+	if (size < sizeof *hdr + npackets * sizeof(struct myuvc_capture_pkt) ||
+	    size > MYUVC_REPLAY_MAX)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* 把收齐的一条记录还原成URB并解析 */
+static int myuvc_replay_record(struct myuvc_device *dev)
+{
+	const struct myuvc_capture_hdr *hdr = (void *)dev->replay.rec;
+	const struct myuvc_capture_pkt *pkt = (void *)(hdr + 1);
+	unsigned int npackets = le16_to_cpu(hdr->npackets);
+	int bulk = le32_to_cpu(hdr->flags) & MYUVC_CAPTURE_BULK;
+	const u8 *src = (const u8 *)(pkt + npackets);
+	const u8 *end = dev->replay.rec + le32_to_cpu(hdr->size);
+	struct urb *urb = dev->replay.urb;
+	u8 *data = dev->replay.data;
+	unsigned int i, length, caplen, offset = 0;
+	unsigned long quirks;
+	myuvc_decode_t decode;
+	ktime_t start;
+
+	for (i = 0; i < npackets; ++i) {
+		length = le32_to_cpu(pkt[i].length);
+		caplen = le32_to_cpu(pkt[i].caplen);
+		if (caplen > length || caplen > (unsigned int)(end - src) ||
+		    length > MYUVC_REPLAY_MAX - offset)
+			return -EINVAL;
+
+		/* snaplen截掉的数据补0 */
+		memcpy(data + offset, src, caplen);
+		memset(data + offset + caplen, 0, length - caplen);
+
+		urb->iso_frame_desc[i].offset        = offset;
+		urb->iso_frame_desc[i].length        = length;
+		urb->iso_frame_desc[i].actual_length = length;
+		urb->iso_frame_desc[i].status        = (__s32)le32_to_cpu(pkt[i].status);
+
+		src    += caplen;
+		offset += length;
+	}
+
+	dev->replay.records++;
+
+	/* 和完成函数一样: 被kill的URB不解析, 传输出错的URB把当前帧标记为出错 */
+	urb->status = le32_to_cpu(hdr->status);
+	if (urb->status == -ENOENT || urb->status == -ECONNRESET ||
+	    urb->status == -ESHUTDOWN)
+		return 0;
+
+	urb->transfer_buffer        = data;
+	urb->transfer_buffer_length = le32_to_cpu(hdr->transfer_length);
+	urb->actual_length          = offset;
+	urb->number_of_packets      = bulk ? 0 : npackets;
+	if (bulk)
+		dev->bulk.max_payload_size = le32_to_cpu(hdr->max_payload);
+
+	/* 使用抓取时的摄像头的解析函数, 解析完恢复 */
+	quirks = dev->quirks;
+	decode = dev->decode;
+	dev->quirks = le32_to_cpu(hdr->quirks);
+	dev->decode = myuvc_decode_func(bulk, dev->quirks);
+
+	start = ktime_get();
+	myuvc_video_decode(dev, urb, ns_to_ktime(le64_to_cpu(hdr->time_ns)),
+			   le16_to_cpu(hdr->sof));
+	dev->replay.ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	dev->quirks = quirks;
+	dev->decode = decode;
+
+	dev->replay.packets += npackets;
+	dev->replay.bytes   += offset;
+	dev->replay.frames  += myuvc_bench_requeue(dev);
+	return 0;
+}
+
+static int myuvc_replay_show(struct seq_file *s, void *v)
+{
+	struct myuvc_device *dev = s->private;
+	u64 ns = dev->replay.ns ? dev->replay.ns : 1;
+
+	seq_printf(s, "records %u packets %u frames %u bytes %llu time %lld ns\n",
+		   dev->replay.records, dev->replay.packets, dev->replay.frames,
+		   dev->replay.bytes, dev->replay.ns);
+	seq_printf(s, "%llu MB/s, %llu ns/packet, %llu frames/s\n",
+		   div64_u64(dev->replay.bytes * 1000, ns),
+		   dev->replay.packets ? div_u64(ns, dev->replay.packets) : 0,
+		   div64_u64((u64)dev->replay.frames * NSEC_PER_SEC, ns));
+
+	return 0;
+}
+
+static void myuvc_replay_free(struct myuvc_device *dev)
+{
+	vfree(dev->replay.rec);
+	vfree(dev->replay.data);
+	usb_free_urb(dev->replay.urb);
+	dev->replay.rec  = NULL;
+	dev->replay.data = NULL;
+	dev->replay.urb  = NULL;
+}
+
+/* 以写方式打开时开始回放: 分配记录和URB的缓冲区, 把所有缓冲区放入irqqueue */
+static int myuvc_replay_open(struct inode *inode, struct file *file)
+{
+	struct myuvc_device *dev = inode->i_private;
+	int ret = 0;
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return myuvc_debugfs_single_open(inode, file, myuvc_replay_show);
+
+	mutex_lock(&dev->queue.mutex);
+	if (dev->streaming || dev->replay.active || dev->queue.count == 0 ||
+	    dev->queue.memory != V4L2_MEMORY_MMAP ||
+	    !list_empty(&dev->queue.mainqueue)) {
+		ret = -EBUSY;
+		goto done;
+	}
+
+	dev->replay.rec  = vmalloc(MYUVC_REPLAY_MAX);
+	dev->replay.data = vmalloc(MYUVC_REPLAY_MAX);
+	dev->replay.urb  = usb_alloc_urb(UVC_MAX_PACKETS, GFP_KERNEL);
+	if (dev->replay.rec == NULL || dev->replay.data == NULL ||
+	    dev->replay.urb == NULL) {
+		myuvc_replay_free(dev);
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	ret = myuvc_debugfs_single_open(inode, file, myuvc_replay_show);
+	if (ret < 0) {
+		myuvc_replay_free(dev);
+		goto done;
+	}
+
+	dev->replay.active  = 1;
+	dev->replay.len     = 0;
+	dev->replay.records = 0;
+	dev->replay.frames  = 0;
+	dev->replay.packets = 0;
+	dev->replay.bytes   = 0;
+	dev->replay.ns      = 0;
+
+	dev->latest = 0;
+	dev->last_fid = -1;
+	dev->sequence = 0;
+	dev->bulk.header_size  = 0;
+	dev->bulk.skip_payload = 0;
+	dev->bulk.payload_size = 0;
+	memset(&dev->clock, 0, sizeof(dev->clock));
+	dev->clock.frequency = dev->clock_frequency;
+	myuvc_bench_requeue(dev);
+
+done:
+	mutex_unlock(&dev->queue.mutex);
+	return ret;
+}
+
+/* 一条记录可能分几次写入: 先收齐头部, 由头部得到整条记录的长度 */
+static ssize_t myuvc_replay_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct myuvc_device *dev = ((struct seq_file *)file->private_data)->private;
+	const struct myuvc_capture_hdr *hdr;
+	size_t done = 0, need, n;
+	int ret = 0;
+
+	mutex_lock(&dev->queue.mutex);
+	hdr = (void *)dev->replay.rec;
 
-    ret = myuvc_set_streaming_params(&myuvc_streaming_ctl);
-    printk("myuvc_set_streaming_params ret = %d\n", ret);
+	while (done < count) {
+		if (dev->replay.len < sizeof *hdr)
+			need = sizeof *hdr;
+		else
+			need = le32_to_cpu(hdr->size);
 
-	myuvc_print_streaming_params(&myuvc_streaming_ctl);
+		n = min(need - dev->replay.len, count - done);
+		if (copy_from_user(dev->replay.rec + dev->replay.len, buf + done, n)) {
+			ret = -EFAULT;
+			break;
+		}
+		dev->replay.len += n;
+		done += n;
 
-	/* d. 设置VideoStreaming Interface所使用的setting
-     * d.1 从myuvc_params确定带宽
-     * d.2 根据setting的endpoint能传输的wMaxPacketSize
-     *     找到能满足该带宽的setting
-     */
-    /* 手工确定:
-     * bandwidth = myuvc_params.dwMaxPayloadTransferSize = 800
-     * 观察lsusb -v -d 0x1e4e:的结果:
-     *                wMaxPacketSize     0x0320  1x 800 bytes
-     * bAlternateSetting       5
-     */
-    usb_set_interface(mydev, myuvc_streaming_intf, myuvc_streaming_bAlternateSetting);
-	
-    /* 2. 分配设置URB */
-	if ((ret = myuvc_init_urb()) < 0)
-		return ret;
-	
-	
-    /* 3. 提交URB以接收数据 */
-	for (i = 0; i < UVC_URBS; ++i) {
-		if ((ret = usb_submit_urb(myuvc_queue.urb[i], GFP_KERNEL)) < 0) {
-			printk("Failed to submit URB %u (%d).\n", i, ret);
-			myuvc_uninit_video();
-			return ret;
+		if (dev->replay.len < need)
+			break;
+
+		if (need == sizeof *hdr) {
+			if ((ret = myuvc_replay_check(hdr)) < 0) {
+				dev->replay.len = 0;
+				break;
+			}
+			continue;
 		}
+
+		ret = myuvc_replay_record(dev);
+		dev->replay.len = 0;
+		if (ret < 0)
+			break;
 	}
 
-	return 0;
+	mutex_unlock(&dev->queue.mutex);
+	return ret < 0 ? ret : count;
 }
 
-/* S11 调用poll监听io */
-static unsigned int myuvc_poll(struct file *file, struct poll_table_struct *wait)
+/* 回放结束, 恢复到REQBUFS之后的状态 */
+static int myuvc_replay_release(struct inode *inode, struct file *file)
 {
-	struct myuvc_buffer *buf;
-	unsigned int mask = 0;
-    
-    /* 从mainqueuq中取出第1个缓冲区 */
+	struct myuvc_device *dev = ((struct seq_file *)file->private_data)->private;
+	unsigned int i;
 
-    /*判断它的状态, 如果未就绪, 休眠 */
+	if (file->f_mode & FMODE_WRITE) {
+		mutex_lock(&dev->queue.mutex);
+		myuvc_queue_cancel(dev);
+		for (i = 0; i < dev->queue.count; ++i)
+			dev->queue.buffer[i].buf.bytesused = 0;
+		dev->last_fid = -1;
+		myuvc_replay_free(dev);
+		dev->replay.active = 0;
+		mutex_unlock(&dev->queue.mutex);
+	}
 
-    if (list_empty(&myuvc_queue.mainqueue)) {
-        mask |= POLLERR;
-        goto done;
-    }
-    
-    buf = list_first_entry(&myuvc_queue.mainqueue, struct myuvc_buffer, stream);
+	return myuvc_debugfs_single_release(inode, file);
+}
 
-    poll_wait(file, &buf->wait, wait);
-    if (buf->state == VIDEOBUF_DONE ||
-        buf->state == VIDEOBUF_ERROR)
-        mask |= POLLIN | POLLRDNORM;
-    
-done:
-    return mask;
+static const struct file_operations myuvc_replay_fops = {
+	.owner		= THIS_MODULE,
+	.open		= myuvc_replay_open,
+	.read		= seq_read,
+	.write		= myuvc_replay_write,
+	.llseek		= seq_lseek,
+	.release	= myuvc_replay_release,
+};
 
-}
+/* debugfs: /sys/kernel/debug/myuvc/videoN/vsource
+ * 写 "fps frame_size packet_size" 以后, STREAMON不使用摄像头, 由hrtimer每次生成
+ * 一个URB的合成payload(格式同bench), 和真正的URB一样经过解析函数和缓冲区队列,
+ * 用来单独测量REQBUFS/mmap/QBUF/DQBUF/poll这一侧的开销, fps可以远高于真正的摄像头
+ * 写 "0" 恢复使用摄像头; 读: 当前的设置
+ */
+#define MYUVC_VSOURCE_MIN_PERIOD	10000	/* ns, 每秒最多10万个URB */
 
-/* S12 如果有数据, 从队列中取出数据 
- *     把缓冲区放入队列, 调用poll...
+/* 定时器的周期(ns): 每帧要fps * 每帧的URB数个周期.
+ * 一帧超过sizeimage或者周期太短时返回0. 调用者持有queue.mutex
  */
-static int myuvc_vidioc_dqbuf(struct file *file, void *priv, struct v4l2_buffer *v4l2_buf)
+static unsigned int myuvc_vsource_period(struct myuvc_device *dev, unsigned int fps,
+		unsigned int frame_size, unsigned int psize)
 {
-	/* APP发现数据就绪后, 从mainqueue里取出这个buffer */
-    struct myuvc_buffer *buf;
-    int ret = 0;
+	unsigned int per_urb = psize - MYUVC_BENCH_HEADER;
+	u64 urbs;
 
-	if (list_empty(&myuvc_queue.mainqueue)) {
-		ret = -EINVAL;
-		goto done;
-	}
-    
-	buf = list_first_entry(&myuvc_queue.mainqueue, struct myuvc_buffer, stream);
-
-	switch (buf->state) {
-	case VIDEOBUF_ERROR:
-		ret = -EIO;
-	case VIDEOBUF_DONE:
-		buf->state = VIDEOBUF_IDLE;
-		break;
-
-	case VIDEOBUF_IDLE:
-	case VIDEOBUF_QUEUED:
-	case VIDEOBUF_ACTIVE:
-	default:
-		ret = -EINVAL;
-		goto done;
-	}
+	if (frame_size > dev->format.fmt.pix.sizeimage)
+		return 0;
 
-	list_del(&buf->stream);
-	memcpy(v4l2_buf, &buf->buf, sizeof *v4l2_buf);
+	if (!dev->streaming_bulk)
+		per_urb *= MYUVC_BENCH_PACKETS;
+	urbs = (u64)fps * DIV_ROUND_UP(frame_size, per_urb);
+	if (urbs > NSEC_PER_SEC / MYUVC_VSOURCE_MIN_PERIOD)
+		return 0;
 
-done:
-	return ret;
+	return NSEC_PER_SEC / (unsigned long)urbs;
+}
 
+static enum hrtimer_restart myuvc_vsource_timer(struct hrtimer *timer)
+{
+	struct myuvc_device *dev = container_of(timer, struct myuvc_device, vsource.timer);
+	ktime_t start = ktime_get();
+	s64 delta;
+
+	/* 每次只生成一个URB的数据, 开销和一次真正的URB完成函数相同 */
+	myuvc_bench_fill_urb(dev, dev->vsource.urb, dev->vsource.mem,
+			     dev->vsource.psize, dev->vsource.frame_size,
+			     &dev->vsource.pos, &dev->vsource.frame, 0);
+	myuvc_video_decode(dev, dev->vsource.urb, start, 0);
+	MYUVC_STATS_INC(dev, urbs);
+
+	delta = ktime_to_ns(ktime_sub(ktime_get(), start));
+	MYUVC_STATS_ADD(dev, irq_ns, delta);
+	MYUVC_STATS_INC(dev, irq_hist[myuvc_hist_bucket(delta, MYUVC_HIST_BUCKETS)]);
+
+	hrtimer_forward_now(timer, dev->vsource.period);
+	return HRTIMER_RESTART;
 }
 
-/* S13 关闭io, 关闭文件    */
-static int myuvc_vidioc_streamoff(struct file *file, void *priv, enum v4l2_buf_type p)
+static int myuvc_vsource_start(struct myuvc_device *dev)
 {
-	struct urb *urb;
-	unsigned int i;
+	unsigned int size = MYUVC_BENCH_PACKETS * dev->vsource.psize;
+	unsigned int period;
 
-    /* 1. kill URB */
-	for (i = 0; i < UVC_URBS; ++i) {
-		if ((urb = myuvc_queue.urb[i]) == NULL)
-			continue;
-		usb_kill_urb(urb);
+	/* 设置vsource以后可能又改了格式 */
+	period = myuvc_vsource_period(dev, dev->vsource.fps, dev->vsource.frame_size,
+				      dev->vsource.psize);
+	if (period == 0)
+		return -EINVAL;
+
+	dev->vsource.urb = usb_alloc_urb(MYUVC_BENCH_PACKETS, GFP_KERNEL);
+	dev->vsource.mem = vmalloc(size);
+	if (dev->vsource.urb == NULL || dev->vsource.mem == NULL) {
+		usb_free_urb(dev->vsource.urb);
+		vfree(dev->vsource.mem);
+		dev->vsource.urb = NULL;
+		dev->vsource.mem = NULL;
+		return -ENOMEM;
 	}
+	memset(dev->vsource.mem, 0x55, size);
+	dev->vsource.urb->transfer_buffer = dev->vsource.mem;
+	dev->vsource.pos   = 0;
+	dev->vsource.frame = 0;
+
+	dev->last_fid = -1;
+	dev->bulk.header_size = 0;
+	dev->bulk.skip_payload = 0;
+	dev->bulk.payload_size = 0;
+	dev->bulk.max_payload_size = dev->vsource.psize;
+
+	dev->vsource.period = ktime_set(0, period);
+	hrtimer_init(&dev->vsource.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->vsource.timer.function = myuvc_vsource_timer;
+	dev->vsource.active = 1;
+	hrtimer_start(&dev->vsource.timer, dev->vsource.period, HRTIMER_MODE_REL);
 
-    /* 2. free URB */
-    myuvc_uninit_video();
+	return 0;
+}
 
-    /* 3. 设置VideoStreaming Interface为setting 0 */
-    usb_set_interface(mydev, myuvc_streaming_intf, 0);
-    
-    return 0;
+static void myuvc_vsource_stop(struct myuvc_device *dev)
+{
+	hrtimer_cancel(&dev->vsource.timer);
+	usb_free_urb(dev->vsource.urb);
+	vfree(dev->vsource.mem);
+	dev->vsource.urb = NULL;
+	dev->vsource.mem = NULL;
+	dev->vsource.active = 0;
 }
 
-static int myuvc_close(struct file *file)
+static int myuvc_vsource_show(struct seq_file *s, void *v)
 {
-	//myuvc_vidioc_streamoff(NULL, NULL, 0);
-	
+	struct myuvc_device *dev = s->private;
+
+	if (dev->vsource.fps)
+		seq_printf(s, "fps %u frame_size %u packet_size %u\n", dev->vsource.fps,
+			   dev->vsource.frame_size, dev->vsource.psize);
+	else
+		seq_puts(s, "off\n");
+
 	return 0;
 }
 
+static int myuvc_vsource_open(struct inode *inode, struct file *file)
+{
+	return myuvc_debugfs_single_open(inode, file, myuvc_vsource_show);
+}
 
-/* Extract the bit string specified by mapping->offset and mapping->size
- * from the little-endian data stored at 'data' and return the result as
- * a signed 32bit integer. Sign extension will be performed if the mapping
- * references a signed data type.
- */
-static __s32 myuvc_get_le_value(const __u8 *data)
-{
-    int bits = 16;
-    int offset = 0;
-    __s32 value = 0;
-    __u8 mask;
-
-    data += offset / 8;
-    offset &= 7;
-    mask = ((1LL << bits) - 1) << offset;
-
-    for (; bits > 0; data++) {
-        __u8 byte = *data & mask;
-        value |= offset > 0 ? (byte >> offset) : (byte << (-offset));
-        bits -= 8 - (offset > 0 ? offset : 0);
-        offset -= 8;
-        mask = (1 << bits) - 1;
-    }
+static ssize_t myuvc_vsource_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct myuvc_device *dev = ((struct seq_file *)file->private_data)->private;
+	unsigned int fps, frame_size = 0, psize = 0;
+	char cmd[64];
+	int ret = 0;
+
+	if (count >= sizeof cmd)
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
 
-    /* Sign-extend the value if needed. */
-    value |= -(value & (1 << (16 - 1)));
+	if (sscanf(cmd, "%u %u %u", &fps, &frame_size, &psize) < 1)
+		return -EINVAL;
+
+	if (fps && (fps > 100000 || frame_size == 0 ||
+		    psize <= MYUVC_BENCH_HEADER + 3 || psize > 32768))
+		return -EINVAL;
+
+	/* 传输过程中不能切换数据源 */
+	mutex_lock(&dev->queue.mutex);
+	if (dev->streaming) {
+		ret = -EBUSY;
+	} else if (fps && myuvc_vsource_period(dev, fps, frame_size, psize) == 0) {
+		ret = -EINVAL;
+	} else {
+		dev->vsource.fps        = fps;
+		dev->vsource.frame_size = frame_size;
+		dev->vsource.psize      = psize;
+	}
+	mutex_unlock(&dev->queue.mutex);
 
-    return value;
+	return ret < 0 ? ret : count;
 }
 
-/* Set the bit string specified by mapping->offset and mapping->size
- * in the little-endian data stored at 'data' to the value 'value'.
+static const struct file_operations myuvc_vsource_fops = {
+	.owner		= THIS_MODULE,
+	.open		= myuvc_vsource_open,
+	.read		= seq_read,
+	.write		= myuvc_vsource_write,
+	.llseek		= seq_lseek,
+	.release	= myuvc_debugfs_single_release,
+};
+#endif /* CONFIG_MYUVC_TESTING */
+
+/* debugfs: /sys/kernel/debug/myuvc/videoN/ctrl_events
+ * async_controls时每个V4L2控制的SET_CUR完成或失败后产生一行:
+ * "序号 控制ID 值 状态", 状态为0表示成功, 否则是错误码. 可以poll
  */
-static void myuvc_set_le_value(__s32 value, __u8 *data)
+static int myuvc_ctrl_events_ready(struct myuvc_device *dev)
 {
-	int bits = 16;
-	int offset = 0;
-	__u8 mask;
+	int ready;
 
-	data += offset / 8;
-	offset &= 7;
+	spin_lock(&dev->async.lock);
+	ready = dev->async.head != dev->async.tail || dev->disconnected;
+	spin_unlock(&dev->async.lock);
 
-	for (; bits > 0; data++) {
-		mask = ((1LL << bits) - 1) << offset;
-		*data = (*data & ~mask) | ((value << offset) & mask);
-		value >>= offset ? offset : 8;
-		bits -= 8 - offset;
-		offset = 0;
-	}
+	return ready;
 }
-    
 
+static ssize_t myuvc_ctrl_events_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct myuvc_device *dev = file->private_data;
+	struct myuvc_ctrl_event event;
+	char line[64];
+	size_t done = 0;
+	int len, ret;
+
+	while (!myuvc_ctrl_events_ready(dev)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(dev->async.wait,
+					       myuvc_ctrl_events_ready(dev));
+		if (ret < 0)
+			return ret;
+	}
+
+	/* 只返回完整的行 */
+	for (;;) {
+		spin_lock(&dev->async.lock);
+		if (dev->async.head == dev->async.tail) {
+			spin_unlock(&dev->async.lock);
+			break;
+		}
+		event = dev->async.events[dev->async.tail % MYUVC_CTRL_EVENTS];
+		len = snprintf(line, sizeof line, "%u 0x%08x %d %d\n", event.sequence,
+			       event.id, event.value, event.status);
+		if (done + len > count) {
+			spin_unlock(&dev->async.lock);
+			break;
+		}
+		dev->async.tail++;
+		spin_unlock(&dev->async.lock);
 
-static int myuvc_query_v4l2_ctrl (struct file *file, void *fh,
-                struct v4l2_queryctrl *ctrl)
+		if (copy_to_user(buf + done, line, len))
+			return done ? done : -EFAULT;
+		done += len;
+	}
+
+	/* 摄像头已经断开, 不会再有事件 */
+	if (done == 0 && dev->disconnected)
+		return 0;
+	if (done == 0)
+		return -EINVAL;
+
+	*ppos += done;
+	return done;
+}
+
+static unsigned int myuvc_ctrl_events_poll(struct file *file, poll_table *wait)
 {
-	__u8 type = USB_TYPE_CLASS | USB_RECIP_INTERFACE;
-	unsigned int pipe;
-    int ret;
-    u8 data[2];
+	struct myuvc_device *dev = file->private_data;
 
-    if (ctrl->id != V4L2_CID_BRIGHTNESS)
-        return -EINVAL;
-    
-	memset(ctrl, 0, sizeof *ctrl);
-	ctrl->id   = V4L2_CID_BRIGHTNESS;
-	ctrl->type = V4L2_CTRL_TYPE_INTEGER;
-	strcpy(ctrl->name, "MyUVC_BRIGHTNESS");
-	ctrl->flags = 0;
-
-	//printk("%s %d \n", __FUNCTION__, __LINE__);
-	pipe = usb_rcvctrlpipe(mydev, 0);
-	type |= USB_DIR_IN;
-
-	//printk("%s %d \n", __FUNCTION__, __LINE__);
-    /* 发起USB传输确定这些值 */
-	ret = usb_control_msg(mydev, pipe, GET_MIN, type, PU_BRIGHTNESS_CONTROL << 8,
-			ProcessingUnitID << 8 | myuvc_control_intf, data, 2, 5000);
-    if (ret != 2)
-        return -EIO;
-	ctrl->minimum = myuvc_get_le_value(data);	/* Note signedness */
-	//printk("%s %d \n", __FUNCTION__, __LINE__);
-
-	ret = usb_control_msg(mydev, pipe, GET_MAX, type,  PU_BRIGHTNESS_CONTROL << 8,
-			ProcessingUnitID << 8 | myuvc_control_intf, data, 2, 5000);
-    if (ret != 2)
-        return -EIO;
-	ctrl->maximum = myuvc_get_le_value(data);	/* Note signedness */
-	//printk("%s %d \n", __FUNCTION__, __LINE__);
-
-	ret = usb_control_msg(mydev, pipe, GET_RES, type, PU_BRIGHTNESS_CONTROL << 8,
-			 ProcessingUnitID << 8 | myuvc_control_intf, data, 2, 5000);
-    if (ret != 2)
-        return -EIO;
-	ctrl->step = myuvc_get_le_value(data);	/* Note signedness */
-
-	ret = usb_control_msg(mydev, pipe, GET_DEF, type, PU_BRIGHTNESS_CONTROL << 8,
-			ProcessingUnitID << 8 | myuvc_control_intf, data, 2, 5000);
-    if (ret != 2)
-        return -EIO;
-	ctrl->default_value = myuvc_get_le_value(data);	/* Note signedness */
-//	printk("%s %d \n", __FUNCTION__, __LINE__);
-
-    printk("Brightness: min =%d, max = %d, step = %d, default = %d\n", ctrl->minimum, ctrl->maximum, ctrl->step, ctrl->default_value);
-    
-    return 0;
+	poll_wait(file, &dev->async.wait, wait);
+	return myuvc_ctrl_events_ready(dev) ? POLLIN | POLLRDNORM : 0;
 }
 
+static const struct file_operations myuvc_ctrl_events_fops = {
+	.owner		= THIS_MODULE,
+	.open		= myuvc_debugfs_open,
+	.read		= myuvc_ctrl_events_read,
+	.poll		= myuvc_ctrl_events_poll,
+	.llseek		= no_llseek,
+	.release	= myuvc_debugfs_release,
+};
 
-static 	int myuvc_ctrl_set (struct file *file, void *fh,
-                struct v4l2_control *ctrl)
+static void myuvc_debugfs_init(struct myuvc_device *dev)
 {
-	__u8 type = USB_TYPE_CLASS | USB_RECIP_INTERFACE;
-    unsigned int pipe;
-    int ret;
-    u8 data[2];
-    
-    if (ctrl->id != V4L2_CID_BRIGHTNESS)
-        return -EINVAL;
+	char name[16];
 
-    myuvc_set_le_value(ctrl->value, data);
+	if (myuvc_debugfs_root == NULL)
+		return;
 
-    pipe = usb_sndctrlpipe(mydev, 0);
-    type |= USB_DIR_OUT;
+	snprintf(name, sizeof name, "video%d", dev->vdev->num);
+	dev->debugfs = debugfs_create_dir(name, myuvc_debugfs_root);
+	if (dev->debugfs == NULL || IS_ERR(dev->debugfs)) {
+		dev->debugfs = NULL;
+		return;
+	}
 
-    ret = usb_control_msg(mydev, pipe, SET_CUR, type, PU_BRIGHTNESS_CONTROL << 8,
-            ProcessingUnitID  << 8 | myuvc_control_intf, data, 2, 5000);
-    if (ret != 2)
-        return -EIO;
-	return 0;
+	debugfs_create_file("stats", S_IRUGO | S_IWUSR, dev->debugfs, dev,
+			    &myuvc_stats_fops);
+	debugfs_create_file("capture", S_IRUSR | S_IWUSR, dev->debugfs, dev,
+			    &myuvc_capture_fops);
+#ifdef CONFIG_MYUVC_TESTING
+	debugfs_create_file("bench", S_IRUGO | S_IWUSR, dev->debugfs, dev,
+			    &myuvc_bench_fops);
+	debugfs_create_file("replay", S_IRUSR | S_IWUSR, dev->debugfs, dev,
+			    &myuvc_replay_fops);
+	debugfs_create_file("vsource", S_IRUGO | S_IWUSR, dev->debugfs, dev,
+			    &myuvc_vsource_fops);
+#endif
+	debugfs_create_file("ctrl_events", S_IRUSR, dev->debugfs, dev,
+			    &myuvc_ctrl_events_fops);
 }
 
-static  int myuvc_ctrl_get (struct file *file, void *fh,
-                struct v4l2_control *ctrl)
+static void myuvc_debugfs_cleanup(struct myuvc_device *dev)
 {
-	__u8 type = USB_TYPE_CLASS | USB_RECIP_INTERFACE;
-	unsigned int pipe;
-    int ret;
-    u8 data[2];
-    
-    if (ctrl->id != V4L2_CID_BRIGHTNESS)
-        return -EINVAL;
+	debugfs_remove_recursive(dev->debugfs);
+	dev->debugfs = NULL;
+}
 
-	pipe = usb_rcvctrlpipe(mydev, 0);
-	type |= USB_DIR_IN;
 
-	ret = usb_control_msg(mydev, pipe, GET_CUR, type, PU_BRIGHTNESS_CONTROL << 8,
-			ProcessingUnitID << 8 | myuvc_control_intf, data, 2, 5000);
-    if (ret != 2)
-        return -EIO;
-	ctrl->value = myuvc_get_le_value(data);	/* Note signedness */
-    
-    return 0;
+/* 扫描VideoStreaming Interface的所有setting, 找到视频数据端点,
+ * 根据端点的传输类型选择同步或批量传输
+ */
+static void myuvc_parse_streaming_endpoint(struct myuvc_device *dev, struct usb_interface *intf)
+{
+	struct usb_endpoint_descriptor *desc;
+	struct usb_host_interface *alts;
+	unsigned int i, j;
+
+	for (i = 0; i < intf->num_altsetting; ++i) {
+		alts = &intf->altsetting[i];
+		for (j = 0; j < alts->desc.bNumEndpoints; ++j) {
+			desc = &alts->endpoint[j].desc;
+			if (!usb_endpoint_dir_in(desc))
+				continue;
+
+			if (usb_endpoint_xfer_bulk(desc)) {
+				dev->streaming_bulk = 1;
+				dev->wMaxPacketSize = le16_to_cpu(desc->wMaxPacketSize);
+			} else if (usb_endpoint_xfer_isoc(desc)) {
+				dev->streaming_bulk = 0;
+			} else {
+				continue;
+			}
 
+			dev->bEndpointAddress = desc->bEndpointAddress;
+			printk("myuvc: streaming endpoint 0x%02x (%s)\n",
+			       dev->bEndpointAddress,
+			       dev->streaming_bulk ? "bulk" : "isochronous");
+			return;
+		}
+	}
 }
 
+/* 需要特殊处理的摄像头, 以后有新的摄像头只要在这里添加一项
+ * driver_info : quirk
+ */
+static struct usb_device_id myuvc_quirks_table[] = {
+	/* ip2970/ip2977 */
+	{ .match_flags		= USB_DEVICE_ID_MATCH_VENDOR,
+	  .idVendor		= 0x1B3B,
+	  .driver_info		= UVC_QUIRK_STREAM_NO_FID
+				| MYUVC_QUIRK_FIX_SOI },
+	{}
+};
 
-static const struct v4l2_ioctl_ops myuvc_ioctl_ops = {
-        // 表示它是一个摄像头设备
-        .vidioc_querycap      = myuvc_vidioc_querycap,
+/* 根据quirk和端点类型选择解析URB数据的函数, 只在probe时做一次 */
+static void myuvc_select_decode(struct myuvc_device *dev, struct usb_interface *intf)
+{
+	const struct usb_device_id *quirk;
 
-        /* 用于列举、获得、测试、设置摄像头的数据的格式 */
-        .vidioc_enum_fmt_vid_cap  = myuvc_vidioc_enum_fmt_vid_cap,
-        .vidioc_g_fmt_vid_cap     = myuvc_vidioc_g_fmt_vid_cap,
-        .vidioc_try_fmt_vid_cap   = myuvc_vidioc_try_fmt_vid_cap,
-        .vidioc_s_fmt_vid_cap     = myuvc_vidioc_s_fmt_vid_cap,
-        
-        /* 缓冲区操作: 申请/查询/放入队列/取出队列 */
-        .vidioc_reqbufs       = myuvc_vidioc_reqbufs,
-        .vidioc_querybuf      = myuvc_vidioc_querybuf,
-        .vidioc_qbuf          = myuvc_vidioc_qbuf,
-        .vidioc_dqbuf         = myuvc_vidioc_dqbuf,
+	quirk = usb_match_id(intf, myuvc_quirks_table);
+	dev->quirks = quirk ? quirk->driver_info : 0;
+	dev->decode = myuvc_decode_func(dev->streaming_bulk, dev->quirks);
 
-        /* 属性设置 */
-		.vidioc_queryctrl	  = myuvc_query_v4l2_ctrl,
-		.vidioc_s_ctrl		  = myuvc_ctrl_set,
-		.vidioc_g_ctrl		  = myuvc_ctrl_get,
+	if (dev->quirks)
+		printk("myuvc: quirks 0x%08lx\n", dev->quirks);
+}
 
-        // 启动/停止
-        .vidioc_streamon      = myuvc_vidioc_streamon,
-        .vidioc_streamoff     = myuvc_vidioc_streamoff,   
-};
+static int myuvc_is_streaming_intf(struct usb_interface *intf)
+{
+	struct usb_interface_descriptor *desc;
 
+	if (intf == NULL)
+		return 0;
 
-static const struct v4l2_file_operations myuvc_fops = {
-	.owner		= THIS_MODULE,
-    .open       = myuvc_open,
-    .release    = myuvc_close,
-    .mmap       = myuvc_mmap,
-    .ioctl      = video_ioctl2, /* V4L2 ioctl handler */
-    .poll       = myuvc_poll,
-};
+	desc = &intf->altsetting[0].desc;
+	return desc->bInterfaceClass == USB_CLASS_VIDEO &&
+	       desc->bInterfaceSubClass == SC_VIDEOSTREAMING;
+}
+
+/* 找出属于这个VideoControl Interface的VideoStreaming Interface:
+ * 先在Interface Association描述符包含的接口里找, 没有IAD的话
+ * 使用VC头部描述符中的baInterfaceNr. 顺便从VC头部描述符中取出UVC版本.
+ * 一个摄像头只使用第1个VideoStreaming Interface
+ */
+static struct usb_interface *myuvc_find_streaming_intf(struct myuvc_device *dev,
+		struct usb_interface *intf)
+{
+	struct usb_interface_assoc_descriptor *iad = intf->intf_assoc;
+	unsigned char *buf = intf->altsetting[0].extra;
+	int buflen = intf->altsetting[0].extralen;
+	struct usb_interface *sintf;
+	unsigned int i, n = 0;
+
+	for (; buflen > 2; buflen -= buf[0], buf += buf[0]) {
+		if (buf[0] < 3 || buf[0] > buflen)
+			break;
+		if (buf[1] == USB_DT_CS_INTERFACE && buf[2] == VC_HEADER) {
+			if (buf[0] >= 12) {
+				dev->uvc_version = get_unaligned_le16(&buf[3]);
+				dev->clock_frequency = get_unaligned_le32(&buf[7]);
+				n = min_t(unsigned int, buf[11], buf[0] - 12);
+			}
+			break;
+		}
+	}
+
+	if (iad != NULL) {
+		for (i = iad->bFirstInterface;
+		     i < iad->bFirstInterface + iad->bInterfaceCount; ++i) {
+			sintf = usb_ifnum_to_if(dev->udev, i);
+			if (myuvc_is_streaming_intf(sintf))
+				return sintf;
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		sintf = usb_ifnum_to_if(dev->udev, buf[12 + i]);
+		if (myuvc_is_streaming_intf(sintf))
+			return sintf;
+	}
+
+	return NULL;
+}
 
+static struct usb_driver myuvc_driver;
 
-static struct video_device *myuvc_device;
+/* 只有VideoControl Interface会调用probe, 每个摄像头分配一个myuvc_device,
+ * 注册一个video设备
+ */
 static int myuvc_probe(struct usb_interface *intf, const struct usb_device_id *id)
 {
 	struct usb_device *udev = interface_to_usbdev(intf);
 	struct usb_interface_descriptor	*interface;
-	
-	static int cnt = 0;
-	
-	mydev = udev;
-	printk("myuvc_probe : cnt = %d \n", cnt++);
+	struct usb_interface *sintf;
+	struct myuvc_device *dev;
+	int ret;
+
+	printk("myuvc_probe : %s interface %d\n", udev->devpath,
+	       intf->cur_altsetting->desc.bInterfaceNumber);
 
 #if 0
 	/* print device descriptor */
@@ -1802,56 +6273,153 @@ static int myuvc_probe(struct usb_interface *intf, const struct usb_device_id *i
     }
 #endif
 
-	if (cnt == 1)
-    {
-        myuvc_control_intf = intf->cur_altsetting->desc.bInterfaceNumber;
-    }
-    else if (cnt == 2)
-    {
-        myuvc_streaming_intf = intf->cur_altsetting->desc.bInterfaceNumber;
-    }
-
-	if(cnt == 2)
-	{
-		 /* 1. 分配一个video_device结构体 */
-		 myuvc_device =  video_device_alloc();
-		 if(myuvc_device == NULL)
-		 	return -1;
-
-		/* 2. 设置 */
-		/* 2.1 */
-		myuvc_device->release   = myuvc_release;
+	/* 0. 分配设备结构体 */
+	dev = kzalloc(sizeof *dev, GFP_KERNEL);
+	if (dev == NULL)
+		return -ENOMEM;
+	kref_init(&dev->kref);
+
+	dev->udev = usb_get_dev(udev);
+	dev->intf = intf;
+	dev->control_intf = intf->cur_altsetting->desc.bInterfaceNumber;
+	dev->uvc_version = 0x0100;
+	dev->bEndpointAddress = 0x82;
+	dev->bInterval = 1;
+	dev->last_fid = -1;
+	INIT_LIST_HEAD(&dev->urb_done);
+	spin_lock_init(&dev->urb_lock);
+	INIT_LIST_HEAD(&dev->queue.mainqueue);
+	INIT_LIST_HEAD(&dev->queue.irqqueue);
+	mutex_init(&dev->queue.mutex);
+	spin_lock_init(&dev->queue.irqlock);
+	init_waitqueue_head(&dev->queue.wait);
+	INIT_WORK(&dev->work, myuvc_video_work);
+	mutex_init(&dev->ctrl_mutex);
+	INIT_LIST_HEAD(&dev->xu_infos);
+	INIT_LIST_HEAD(&dev->xu_mappings);
+	INIT_WORK(&dev->async.work, myuvc_ctrl_async_work);
+	init_waitqueue_head(&dev->async.wait);
+	spin_lock_init(&dev->async.lock);
+	spin_lock_init(&dev->capture.lock);
+	mutex_init(&dev->capture.mutex);
+	init_waitqueue_head(&dev->capture.wait);
+
+	dev->stats = alloc_percpu(struct myuvc_stats);
+	if (dev->stats == NULL) {
+		ret = -ENOMEM;
+		goto error;
+	}
 
-		/* 2.2 */
-		myuvc_device->fops      = &myuvc_fops;
+	/* 1. 找到VideoStreaming Interface并占用它 */
+	sintf = myuvc_find_streaming_intf(dev, intf);
+	if (sintf == NULL) {
+		printk("myuvc: no VideoStreaming interface found.\n");
+		ret = -ENODEV;
+		goto error;
+	}
 
-		/* 2.3 */
-		myuvc_device->ioctl_ops = &myuvc_ioctl_ops;
+	ret = usb_driver_claim_interface(&myuvc_driver, sintf, dev);
+	if (ret < 0) {
+		printk("myuvc: VideoStreaming interface already claimed.\n");
+		goto error;
+	}
+	dev->vs_intf = usb_get_intf(sintf);
+	dev->streaming_intf = sintf->cur_altsetting->desc.bInterfaceNumber;
+
+	myuvc_parse_streaming_endpoint(dev, sintf);
+	myuvc_select_decode(dev, sintf);
+
+	/* 2. 解析格式和分辨率 */
+	ret = myuvc_parse_formats(dev, sintf);
+	if (ret < 0)
+		goto error_release;
+	myuvc_set_default_format(dev);
+
+	ret = myuvc_parse_controls(dev);
+	if (ret < 0)
+		goto error_release;
+
+	/* 3. 分配一个video_device结构体 */
+	dev->vdev = video_device_alloc();
+	if (dev->vdev == NULL) {
+		ret = -ENOMEM;
+		goto error_release;
+	}
 
-		/* 3. 注册 */
-		video_register_device(myuvc_device, VFL_TYPE_GRABBER, -1);
+	/* 4. 设置 */
+	strlcpy(dev->vdev->name, "myuvcvideo", sizeof dev->vdev->name);
+	dev->vdev->parent    = &intf->dev;
+	dev->vdev->release   = myuvc_release;
+	dev->vdev->fops      = &myuvc_fops;
+	dev->vdev->ioctl_ops = &myuvc_ioctl_ops;
+	video_set_drvdata(dev->vdev, dev);
+	usb_set_intfdata(intf, dev);
+
+	/* 5. 注册 */
+	ret = video_register_device(dev->vdev, VFL_TYPE_GRABBER, -1);
+	if (ret < 0) {
+		video_device_release(dev->vdev);
+		goto error_release;
 	}
 
+	printk("myuvc: %s registered as video%d\n", udev->devpath, dev->vdev->num);
+	myuvc_debugfs_init(dev);
+	myuvc_status_init(dev);
 	return 0;
+
+error_release:
+	usb_set_intfdata(intf, NULL);
+	usb_driver_release_interface(&myuvc_driver, sintf);
+error:
+	myuvc_delete(dev);
+	return ret;
 }
 
 static void myuvc_disconnect(struct usb_interface *intf)
 {
-	static int cnt = 0;
+	struct myuvc_device *dev = usb_get_intfdata(intf);
 
-	printk("myuvc_disconnect : %d\n", cnt++);
+	usb_set_intfdata(intf, NULL);
 
-	if(cnt == 2)
-	{
-		video_unregister_device(myuvc_device);
-        video_device_release(myuvc_device);
-	}
+	/* VideoStreaming Interface是probe时占用的, 设备在VideoControl
+	 * Interface断开时处理
+	 */
+	if (dev == NULL || intf != dev->intf)
+		return;
+
+	printk("myuvc_disconnect : video%d\n", dev->vdev->num);
+
+	if (dev->int_urb)
+		usb_kill_urb(dev->int_urb);
+
+	/* 正在发送的异步控制请求以错误结束, 等待work回滚并释放数据 */
+	if (dev->async.urb)
+		usb_kill_urb(dev->async.urb);
+	flush_work(&dev->async.work);
+
+	mutex_lock(&dev->queue.mutex);
+	if (dev->streaming)
+		myuvc_stop_video(dev);
+	myuvc_queue_cancel(dev);
+	mutex_unlock(&dev->queue.mutex);
+
+	/* 停止抓取, 唤醒在capture和ctrl_events文件上等待的进程.
+	 * 还打开着的debugfs文件持有dev的引用, 关闭后才释放
+	 */
+	myuvc_capture_start(dev, 0, 0);
+	spin_lock(&dev->async.lock);
+	dev->disconnected = 1;
+	spin_unlock(&dev->async.lock);
+	wake_up_interruptible(&dev->async.wait);
+	myuvc_debugfs_cleanup(dev);
+
+	/* 最后一个APP关闭设备后, myuvc_release会释放dev */
+	video_unregister_device(dev->vdev);
 }
 
 static struct usb_device_id myuvc_ids[] = {
 	/* Generic USB Video Class */
 	{ USB_INTERFACE_INFO(USB_CLASS_VIDEO, 1, 0) },  /* VideoControl Interface */
-    { USB_INTERFACE_INFO(USB_CLASS_VIDEO, 2, 0) },  /* VideoStreaming Interface */
 	{}
 };
 
@@ -1866,8 +6434,14 @@ static int __init myuvc_init(void)
 {
 	int ret;
 
+	/* 没有debugfs时不创建统计文件, 驱动照常工作 */
+	myuvc_debugfs_root = debugfs_create_dir("myuvc", NULL);
+	if (IS_ERR(myuvc_debugfs_root))
+		myuvc_debugfs_root = NULL;
+
 	ret = usb_register(&myuvc_driver);
 	if (ret < 0) {
+		debugfs_remove_recursive(myuvc_debugfs_root);
 		return ret;
 	}
 
@@ -1877,6 +6451,7 @@ static int __init myuvc_init(void)
 static void __exit myuvc_exit(void)
 {
 	usb_deregister(&myuvc_driver);
+	debugfs_remove_recursive(myuvc_debugfs_root);
 }
 
 module_init(myuvc_init);
@@ -0,0 +1,235 @@
+/*
+ * myuvc tracepoints
+ *
+ * 用ftrace/perf测量一帧数据从第1个packet到DQBUF的延迟:
+ *   echo 1 > /sys/kernel/debug/tracing/events/myuvc/enable
+ *   cat /sys/kernel/debug/tracing/trace_pipe
+ * 或者 perf record -e 'myuvc:*' -a
+ *
+ * 所有事件的第1个参数都是video设备号, 没有打开时只有一个不会跳转的分支
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM myuvc
+
+#if !defined(_MYUVC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MYUVC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* 进入URB完成函数, bytes是URB中所有packet的数据长度之和 */
+TRACE_EVENT(myuvc_urb_complete,
+
+	TP_PROTO(int num, int status, int packets, int bytes),
+
+	TP_ARGS(num, status, packets, bytes),
+
+	TP_STRUCT__entry(
+		__field(	int,	num		)
+		__field(	int,	status		)
+		__field(	int,	packets		)
+		__field(	int,	bytes		)
+	),
+
+	TP_fast_assign(
+		__entry->num		= num;
+		__entry->status		= status;
+		__entry->packets	= packets;
+		__entry->bytes		= bytes;
+	),
+
+	TP_printk("video%d status=%d packets=%d bytes=%d",
+		  __entry->num, __entry->status, __entry->packets, __entry->bytes)
+);
+
+/* 离开URB完成函数, ns是完成函数运行的时间 */
+TRACE_EVENT(myuvc_urb_complete_exit,
+
+	TP_PROTO(int num, s64 ns),
+
+	TP_ARGS(num, ns),
+
+	TP_STRUCT__entry(
+		__field(	int,	num		)
+		__field(	s64,	ns		)
+	),
+
+	TP_fast_assign(
+		__entry->num		= num;
+		__entry->ns		= ns;
+	),
+
+	TP_printk("video%d ns=%lld", __entry->num, (long long)__entry->ns)
+);
+
+/* payload头部的FID位翻转, 新的一帧开始; index为-1表示没有缓冲区 */
+TRACE_EVENT(myuvc_fid,
+
+	TP_PROTO(int num, int index, int fid),
+
+	TP_ARGS(num, index, fid),
+
+	TP_STRUCT__entry(
+		__field(	int,	num		)
+		__field(	int,	index		)
+		__field(	int,	fid		)
+	),
+
+	TP_fast_assign(
+		__entry->num		= num;
+		__entry->index		= index;
+		__entry->fid		= fid;
+	),
+
+	TP_printk("video%d index=%d fid=%d",
+		  __entry->num, __entry->index, __entry->fid)
+);
+
+/* payload头部设置了EOF位 */
+TRACE_EVENT(myuvc_eof,
+
+	TP_PROTO(int num, int index, unsigned int bytesused),
+
+	TP_ARGS(num, index, bytesused),
+
+	TP_STRUCT__entry(
+		__field(	int,		num		)
+		__field(	int,		index		)
+		__field(	unsigned int,	bytesused	)
+	),
+
+	TP_fast_assign(
+		__entry->num		= num;
+		__entry->index		= index;
+		__entry->bytesused	= bytesused;
+	),
+
+	TP_printk("video%d index=%d bytesused=%u",
+		  __entry->num, __entry->index, __entry->bytesused)
+);
+
+/* 缓冲区变成VIDEOBUF_DONE, 从irqqueue中删除 */
+TRACE_EVENT(myuvc_buffer_done,
+
+	TP_PROTO(int num, int index, __u32 sequence, unsigned int bytesused,
+		 unsigned int error),
+
+	TP_ARGS(num, index, sequence, bytesused, error),
+
+	TP_STRUCT__entry(
+		__field(	int,		num		)
+		__field(	int,		index		)
+		__field(	__u32,		sequence	)
+		__field(	unsigned int,	bytesused	)
+		__field(	unsigned int,	error		)
+	),
+
+	TP_fast_assign(
+		__entry->num		= num;
+		__entry->index		= index;
+		__entry->sequence	= sequence;
+		__entry->bytesused	= bytesused;
+		__entry->error		= error;
+	),
+
+	TP_printk("video%d index=%d sequence=%u bytesused=%u error=0x%x",
+		  __entry->num, __entry->index, __entry->sequence,
+		  __entry->bytesused, __entry->error)
+);
+
+/* 唤醒等待数据的进程 */
+TRACE_EVENT(myuvc_wakeup,
+
+	TP_PROTO(int num, int index),
+
+	TP_ARGS(num, index),
+
+	TP_STRUCT__entry(
+		__field(	int,	num		)
+		__field(	int,	index		)
+	),
+
+	TP_fast_assign(
+		__entry->num		= num;
+		__entry->index		= index;
+	),
+
+	TP_printk("video%d index=%d", __entry->num, __entry->index)
+);
+
+/* VIDIOC_QBUF成功 */
+TRACE_EVENT(myuvc_qbuf,
+
+	TP_PROTO(int num, int index),
+
+	TP_ARGS(num, index),
+
+	TP_STRUCT__entry(
+		__field(	int,	num		)
+		__field(	int,	index		)
+	),
+
+	TP_fast_assign(
+		__entry->num		= num;
+		__entry->index		= index;
+	),
+
+	TP_printk("video%d index=%d", __entry->num, __entry->index)
+);
+
+/* VIDIOC_DQBUF返回一个缓冲区 */
+TRACE_EVENT(myuvc_dqbuf,
+
+	TP_PROTO(int num, int index, __u32 sequence, unsigned int bytesused),
+
+	TP_ARGS(num, index, sequence, bytesused),
+
+	TP_STRUCT__entry(
+		__field(	int,		num		)
+		__field(	int,		index		)
+		__field(	__u32,		sequence	)
+		__field(	unsigned int,	bytesused	)
+	),
+
+	TP_fast_assign(
+		__entry->num		= num;
+		__entry->index		= index;
+		__entry->sequence	= sequence;
+		__entry->bytesused	= bytesused;
+	),
+
+	TP_printk("video%d index=%d sequence=%u bytesused=%u",
+		  __entry->num, __entry->index, __entry->sequence,
+		  __entry->bytesused)
+);
+
+/* VIDIOC_STREAMON/VIDIOC_STREAMOFF, on: 1 - 开始, 0 - 停止 */
+TRACE_EVENT(myuvc_stream,
+
+	TP_PROTO(int num, int on, int ret),
+
+	TP_ARGS(num, on, ret),
+
+	TP_STRUCT__entry(
+		__field(	int,	num		)
+		__field(	int,	on		)
+		__field(	int,	ret		)
+	),
+
+	TP_fast_assign(
+		__entry->num		= num;
+		__entry->on		= on;
+		__entry->ret		= ret;
+	),
+
+	TP_printk("video%d %s ret=%d", __entry->num,
+		  __entry->on ? "streamon" : "streamoff", __entry->ret)
+);
+
+#endif /* _MYUVC_TRACE_H */
+
+/* 这个头文件不在include/trace/events/里, Makefile中要加上 -I$(src) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE myuvc_trace
+#include <trace/define_trace.h>
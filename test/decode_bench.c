@@ -0,0 +1,575 @@
+/*
+ * decode_bench: 在用户空间测量myuvc解析payload(头部, FID/EOF, ip2970的JPEG标记,
+ * 复制到缓冲区)的速度, 不需要摄像头, 也不需要加载模块.
+ *
+ *   ./decode_bench [-n frames] [-f frame_size] [-p packet_size] [-l loss] [-b] [-q]
+ *   ./decode_bench -r capture.bin [-n times]
+ *
+ * 解析函数不是复制过来的: make从../myuvc/myuvc.c中取出myuvc_video_decode_start
+ * 到__myuvc_video_decode_bulk, 以及模块中bench用的payload生成函数, 生成decode.inc,
+ * 这里提供它们用到的struct urb, 设备, 缓冲区和队列的最小替身.
+ *
+ * 合成数据(和debugfs中的bench相同): 12字节头部, 每帧第1个payload以JPEG的SOI开头,
+ * 最后一个payload设置EOF
+ *   -n  帧数, 默认1000
+ *   -f  每帧的字节数           -p  每个payload(packet)的字节数
+ *   -l  丢失packet的千分比     -b  批量传输(每个URB一个payload), 默认同步传输
+ *   -q  打开ip2970的quirk(UVC_QUIRK_STREAM_NO_FID | MYUVC_QUIRK_FIX_SOI)
+ * 没有给出-f, -p和-l时, 依次运行几种packet大小, 帧大小和丢失率的组合.
+ *
+ * -r: 解析debugfs中capture读出的数据, 传输类型和quirk取自文件中的记录,
+ *     -n是把整个文件解析几遍, 默认1遍.
+ *
+ * 每种组合打印一行: MB/s, ns/packet, frames/s(只计算解析函数的时间).
+ *
+ * gcc -O2 -Wall -o decode_bench decode_bench.c   (先make decode.inc)
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+#define NBUFFERS	4
+
+/* ---- 内核的替身 ---- */
+
+typedef uint8_t u8;
+typedef int64_t s64;
+typedef s64 ktime_t;
+
+#ifndef __always_inline
+#define __always_inline		inline __attribute__((always_inline))
+#endif
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define random32()		((unsigned int)random())
+
+#define trace_myuvc_fid(...)	do { } while (0)
+#define trace_myuvc_eof(...)	do { } while (0)
+
+static inline struct timeval ktime_to_timeval(ktime_t t)
+{
+	struct timeval tv = { t / 1000000000, t % 1000000000 / 1000 };
+
+	return tv;
+}
+
+static inline __u32 get_unaligned_le32(const void *p)
+{
+	const __u8 *b = p;
+
+	return b[0] | b[1] << 8 | b[2] << 16 | (__u32)b[3] << 24;
+}
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+static void list_init(struct list_head *head)
+{
+	head->next = head->prev = head;
+}
+
+static void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+	entry->prev = head->prev;
+	entry->next = head;
+	head->prev->next = entry;
+	head->prev = entry;
+}
+
+static void list_del(struct list_head *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+}
+
+#define list_empty(head)	((head)->next == (head))
+#define list_first_entry(head, type, member)				\
+	((type *)((char *)(head)->next - offsetof(type, member)))
+
+struct usb_iso_packet_descriptor {
+	unsigned int offset;
+	unsigned int length;
+	unsigned int actual_length;
+	int status;
+};
+
+struct urb {
+	int status;
+	void *transfer_buffer;
+	__u32 transfer_buffer_length;
+	__u32 actual_length;
+	int number_of_packets;
+	struct usb_iso_packet_descriptor iso_frame_desc[0];
+};
+
+/* 和myuvc.c中的定义相同 */
+#define UVC_STREAM_EOH			(1 << 7)
+#define UVC_STREAM_ERR			(1 << 6)
+#define UVC_STREAM_SCR			(1 << 3)
+#define UVC_STREAM_PTS			(1 << 2)
+#define UVC_STREAM_EOF			(1 << 1)
+#define UVC_STREAM_FID			(1 << 0)
+
+#define UVC_QUIRK_STREAM_NO_FID		0x00000010
+#define MYUVC_QUIRK_FIX_SOI		0x00000100
+
+#define MYUVC_BUF_PACKET_LOST		(1 << 0)
+#define MYUVC_BUF_STREAM_ERR		(1 << 1)
+#define MYUVC_BUF_TRUNCATED		(1 << 2)
+#define MYUVC_BUF_URB_ERR		(1 << 3)
+
+#define MYUVC_BENCH_PACKETS		32
+#define MYUVC_BENCH_HEADER		12
+
+/* enum videobuf_state */
+#define VIDEOBUF_QUEUED			2
+#define VIDEOBUF_ACTIVE			3
+#define VIDEOBUF_DONE			4
+
+/* capture文件的格式, 字段是小端字节序, 这里直接读, 只能在小端的主机上运行 */
+#define MYUVC_CAPTURE_MAGIC		0x4356554d
+#define MYUVC_CAPTURE_BULK		(1 << 0)
+
+struct myuvc_capture_hdr {
+	__le32 magic;
+	__le16 version;
+	__le16 hdr_size;
+	__le32 size;
+	__le32 dropped;
+	__le64 time_ns;
+	__le32 flags;
+	__le32 quirks;
+	__le32 status;
+	__le32 transfer_length;
+	__le32 actual_length;
+	__le32 max_payload;
+	__le16 sof;
+	__le16 npackets;
+} __attribute__((packed));
+
+struct myuvc_capture_pkt {
+	__le32 status;
+	__le32 length;
+	__le32 caplen;
+} __attribute__((packed));
+
+/* 解析函数用到的缓冲区和设备字段 */
+struct myuvc_buffer {
+	struct v4l2_buffer buf;
+	int state;
+	void *mem;
+	struct list_head irq;
+	__u32 pts;
+	ktime_t first_time;
+	int pts_valid;
+	unsigned int error;
+	int complete;
+};
+
+struct myuvc_stats {
+	unsigned long packets;
+	unsigned long packets_error;
+	unsigned long packets_lost;
+	unsigned long frames_dropped;
+	unsigned long frames_truncated;
+	unsigned long bytes;
+};
+
+struct myuvc_device {
+	int streaming_bulk;
+	unsigned long quirks;
+	struct {
+		struct myuvc_buffer buffer[NBUFFERS];
+		struct list_head irqqueue;
+	} queue;
+	int last_fid;
+	__u32 sequence;
+	struct {
+		__u8 header[256];
+		unsigned int header_size;
+		int skip_payload;
+		__u32 payload_size;
+		__u32 max_payload_size;
+	} bulk;
+	ktime_t decode_time;
+	struct myuvc_stats stats;
+	unsigned int frames;
+};
+
+#define MYUVC_STATS_ADD(dev, field, n)	((dev)->stats.field += (n))
+#define MYUVC_STATS_INC(dev, field)	MYUVC_STATS_ADD(dev, field, 1)
+
+/* 测试数据里没有SCR */
+#define myuvc_clock_add_sample(dev, data)	do { } while (0)
+
+/* 一帧解析完: 计数, 马上把缓冲区放回irqqueue的末尾, 返回下一个缓冲区 */
+static struct myuvc_buffer *myuvc_queue_next_buffer(struct myuvc_device *dev,
+		struct myuvc_buffer *buf)
+{
+	dev->frames++;
+	dev->sequence++;
+	buf->state = VIDEOBUF_DONE;
+	list_del(&buf->irq);
+
+	buf->state = VIDEOBUF_QUEUED;
+	buf->buf.bytesused = 0;
+	buf->pts_valid = 0;
+	buf->error = 0;
+	buf->complete = 0;
+	list_add_tail(&buf->irq, &dev->queue.irqqueue);
+
+	return list_first_entry(&dev->queue.irqqueue, struct myuvc_buffer, irq);
+}
+
+#include "decode.inc"
+
+/* ---- 测试 ---- */
+
+static struct myuvc_device dev;
+
+static s64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (s64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = calloc(1, size);
+
+	if (p == NULL)
+		die("malloc");
+	return p;
+}
+
+static void dev_init(int bulk, unsigned long quirks, unsigned int buf_size,
+		     unsigned int max_payload)
+{
+	unsigned int i;
+
+	for (i = 0; i < NBUFFERS; ++i)
+		free(dev.queue.buffer[i].mem);
+	memset(&dev, 0, sizeof dev);
+
+	dev.streaming_bulk = bulk;
+	dev.quirks = quirks;
+	dev.last_fid = -1;
+	dev.bulk.max_payload_size = max_payload;
+	list_init(&dev.queue.irqqueue);
+	for (i = 0; i < NBUFFERS; ++i) {
+		dev.queue.buffer[i].mem = xmalloc(buf_size);
+		dev.queue.buffer[i].buf.index = i;
+		dev.queue.buffer[i].buf.length = buf_size;
+		dev.queue.buffer[i].state = VIDEOBUF_QUEUED;
+		list_add_tail(&dev.queue.buffer[i].irq, &dev.queue.irqqueue);
+	}
+}
+
+/* 和myuvc_video_decode相同, 只是没有锁 */
+static void decode(struct urb *urb)
+{
+	struct myuvc_buffer *buf;
+
+	buf = list_first_entry(&dev.queue.irqqueue, struct myuvc_buffer, irq);
+	if (urb->status != 0) {
+		buf->error |= MYUVC_BUF_URB_ERR;
+		if (dev.streaming_bulk)
+			dev.bulk.skip_payload = 1;
+		return;
+	}
+
+	/* 和myuvc_decode_func一样, quirk是常量, 普通摄像头的路径里没有quirk的判断 */
+	if (dev.streaming_bulk && dev.quirks)
+		__myuvc_video_decode_bulk(&dev, urb, buf, 1);
+	else if (dev.streaming_bulk)
+		__myuvc_video_decode_bulk(&dev, urb, buf, 0);
+	else if (dev.quirks)
+		__myuvc_video_decode_isoc(&dev, urb, buf, 1);
+	else
+		__myuvc_video_decode_isoc(&dev, urb, buf, 0);
+}
+
+struct result {
+	unsigned long long bytes;
+	unsigned long packets;
+	s64 ns;
+};
+
+static void report(const char *name, const struct result *r)
+{
+	s64 ns = r->ns ? r->ns : 1;
+
+	printf("%-28s frames %6u packets %8lu %8.1f MB/s %7.1f ns/packet %9.1f frames/s\n",
+	       name, dev.frames, r->packets, r->bytes * 1000.0 / ns,
+	       r->packets ? (double)ns / r->packets : 0.0,
+	       dev.frames * 1e9 / ns);
+}
+
+static void synthetic(unsigned int frames, unsigned int frame_size,
+		      unsigned int psize, unsigned int loss, int bulk, int quirk)
+{
+	struct urb *urb;
+	struct result r = { 0 };
+	unsigned int pos = 0, frame = 0;
+	char name[64];
+	u8 *mem;
+	s64 start;
+
+	urb = xmalloc(sizeof *urb + MYUVC_BENCH_PACKETS *
+		      sizeof(struct usb_iso_packet_descriptor));
+	mem = xmalloc(MYUVC_BENCH_PACKETS * psize);
+	memset(mem, 0x55, MYUVC_BENCH_PACKETS * psize);
+	urb->transfer_buffer = mem;
+
+	/* 和模块中的bench一样, 缓冲区正好放下一帧, ip2970补上的0xFF多留1字节 */
+	dev_init(bulk, quirk ? UVC_QUIRK_STREAM_NO_FID | MYUVC_QUIRK_FIX_SOI : 0,
+		 frame_size + 1, psize);
+	srandom(1);
+
+	while (frame < frames) {
+		r.packets += myuvc_bench_fill_urb(&dev, urb, mem, psize,
+					frame_size, &pos, &frame, loss);
+		r.bytes += urb->actual_length;
+
+		start = now_ns();
+		dev.decode_time = start;
+		decode(urb);
+		r.ns += now_ns() - start;
+	}
+
+	snprintf(name, sizeof name, "%s%s p%u f%u l%u", bulk ? "bulk" : "isoc",
+		 quirk ? "-quirk" : "", psize, frame_size, loss);
+	report(name, &r);
+
+	free(mem);
+	free(urb);
+}
+
+/* 读出整个capture文件, 检查每条记录的长度 */
+static u8 *load(const char *file, size_t *size)
+{
+	u8 *data = NULL;
+	size_t len = 0, alloc = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0)
+		die(file);
+	for (;;) {
+		if (len == alloc) {
+			alloc = alloc ? alloc * 2 : 1 << 20;
+			if ((data = realloc(data, alloc)) == NULL)
+				die("realloc");
+		}
+		if ((n = read(fd, data + len, alloc - len)) < 0)
+			die(file);
+		if (n == 0)
+			break;
+		len += n;
+	}
+	close(fd);
+
+	*size = len;
+	return data;
+}
+
+static const struct myuvc_capture_hdr *record(const u8 *data, size_t size, size_t pos)
+{
+	const struct myuvc_capture_hdr *hdr = (const void *)(data + pos);
+
+	if (size - pos < sizeof *hdr || hdr->magic != MYUVC_CAPTURE_MAGIC ||
+	    hdr->hdr_size != sizeof *hdr || hdr->size < sizeof *hdr ||
+	    hdr->size > size - pos ||
+	    hdr->npackets > (hdr->size - sizeof *hdr) / sizeof(struct myuvc_capture_pkt)) {
+		fprintf(stderr, "bad capture record at offset %zu\n", pos);
+		exit(1);
+	}
+	return hdr;
+}
+
+/* 把一条记录还原成URB, caplen之后没有记录的数据补0 */
+static void fill_record(struct urb *urb, u8 *mem, const struct myuvc_capture_hdr *hdr)
+{
+	const struct myuvc_capture_pkt *pkt = (const void *)(hdr + 1);
+	const u8 *src = (const u8 *)(pkt + hdr->npackets);
+	unsigned int i, offset = 0;
+
+	urb->status = hdr->status;
+	urb->transfer_buffer_length = hdr->transfer_length;
+	urb->actual_length = hdr->actual_length;
+
+	if (hdr->flags & MYUVC_CAPTURE_BULK) {
+		urb->number_of_packets = 0;
+		memset(mem, 0, hdr->actual_length);
+		memcpy(mem, src, pkt[0].caplen);
+		return;
+	}
+
+	urb->number_of_packets = hdr->npackets;
+	for (i = 0; i < hdr->npackets; ++i) {
+		urb->iso_frame_desc[i].offset = offset;
+		urb->iso_frame_desc[i].length = pkt[i].length;
+		urb->iso_frame_desc[i].actual_length = pkt[i].length;
+		urb->iso_frame_desc[i].status = pkt[i].status;
+		memset(mem + offset, 0, pkt[i].length);
+		memcpy(mem + offset, src, pkt[i].caplen);
+		src += pkt[i].caplen;
+		offset += pkt[i].length;
+	}
+}
+
+static void recorded(const char *file, unsigned int times)
+{
+	const struct myuvc_capture_hdr *hdr;
+	struct urb *urb;
+	struct result r = { 0 };
+	size_t size, pos, max_len = 0;
+	unsigned int i, max_packets = 0;
+	u8 *data, *mem;
+	s64 start;
+
+	data = load(file, &size);
+	if (size == 0) {
+		fprintf(stderr, "%s: empty\n", file);
+		exit(1);
+	}
+
+	/* 先检查所有记录, 确定URB和缓冲区要多大 */
+	for (pos = 0; pos < size; pos += hdr->size) {
+		const struct myuvc_capture_pkt *pkt;
+		size_t len = 0, caplen = 0;
+
+		hdr = record(data, size, pos);
+		pkt = (const void *)(hdr + 1);
+		for (i = 0; i < hdr->npackets; ++i) {
+			if (pkt[i].caplen > pkt[i].length)
+				break;
+			len += pkt[i].length;
+			caplen += pkt[i].caplen;
+		}
+		if (i < hdr->npackets || (hdr->flags & MYUVC_CAPTURE_BULK &&
+		    (hdr->npackets != 1 || pkt[0].length != hdr->actual_length)) ||
+		    caplen > hdr->size - sizeof *hdr - hdr->npackets * sizeof *pkt) {
+			fprintf(stderr, "bad capture record at offset %zu\n", pos);
+			exit(1);
+		}
+
+		if (hdr->npackets > max_packets)
+			max_packets = hdr->npackets;
+		if (len > max_len)
+			max_len = len;
+	}
+
+	urb = xmalloc(sizeof *urb + max_packets *
+		      sizeof(struct usb_iso_packet_descriptor));
+	mem = xmalloc(max_len);
+	urb->transfer_buffer = mem;
+
+	/* 缓冲区的大小不知道, 用8MB, 足够放下一帧未压缩的1080p */
+	hdr = (const void *)data;
+	dev_init(hdr->flags & MYUVC_CAPTURE_BULK, hdr->quirks, 8 << 20,
+		 hdr->max_payload);
+
+	while (times--) {
+		for (pos = 0; pos < size; pos += hdr->size) {
+			hdr = (const void *)(data + pos);
+			fill_record(urb, mem, hdr);
+			r.packets += hdr->npackets;
+			r.bytes += urb->actual_length;
+
+			start = now_ns();
+			dev.decode_time = start;
+			decode(urb);
+			r.ns += now_ns() - start;
+		}
+	}
+
+	report(file, &r);
+
+	free(mem);
+	free(urb);
+	free(data);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n frames] [-f frame_size] [-p packet_size] [-l loss] [-b] [-q]\n"
+		"       %s -r capture.bin [-n times]\n", name, name);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int psizes[] = { 512, 1024, 3072 };
+	static const unsigned int fsizes[] = { 65536, 614400 };
+	static const unsigned int losses[] = { 0, 10 };
+	unsigned int frames = 0, frame_size = 0, psize = 0, loss = 0;
+	const char *replay_file = NULL;
+	int bulk = 0, quirk = 0, sweep = 1, opt;
+	unsigned int i, j, k;
+
+	while ((opt = getopt(argc, argv, "n:f:p:l:bqr:")) != -1) {
+		switch (opt) {
+		case 'n': frames = atoi(optarg); break;
+		case 'f': frame_size = atoi(optarg); sweep = 0; break;
+		case 'p': psize = atoi(optarg); sweep = 0; break;
+		case 'l': loss = atoi(optarg); sweep = 0; break;
+		case 'b': bulk = 1; break;
+		case 'q': quirk = 1; break;
+		case 'r': replay_file = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	if (replay_file) {
+		recorded(replay_file, frames ? frames : 1);
+		return 0;
+	}
+
+	if (frames == 0)
+		frames = 1000;
+	if (!sweep) {
+		if (frame_size == 0)
+			frame_size = fsizes[0];
+		if (psize == 0)
+			psize = psizes[2];
+		/* 和模块中的bench相同的限制 */
+		if (loss > 1000 || psize <= MYUVC_BENCH_HEADER + 3 || psize > 32768) {
+			fprintf(stderr, "loss must be <= 1000, packet_size 16..32768\n");
+			return 2;
+		}
+		synthetic(frames, frame_size, psize, loss, bulk, quirk);
+		return 0;
+	}
+
+	for (i = 0; i < sizeof psizes / sizeof psizes[0]; ++i)
+		for (j = 0; j < sizeof fsizes / sizeof fsizes[0]; ++j)
+			for (k = 0; k < sizeof losses / sizeof losses[0]; ++k) {
+				/* 批量传输不模拟丢失 */
+				if (bulk && losses[k])
+					continue;
+				synthetic(frames, fsizes[j], psizes[i],
+					  losses[k], bulk, quirk);
+			}
+
+	return 0;
+}
@@ -0,0 +1,372 @@
+/*
+ * qbuf_stress: 多个线程同时对myuvc做QBUF/DQBUF/QUERYBUF/poll,
+ * 主线程定时STREAMOFF/STREAMON, 检查驱动返回的缓冲区是否正确.
+ *
+ * 没有摄像头时用debugfs的vsource产生帧:
+ *   ./qbuf_stress -d /dev/video0 -v "1000 65536 3072" -t 4 -s 10
+ *
+ * 检查的内容:
+ *   - DQBUF返回的index在范围内, 并且这个缓冲区不在APP手里(没有被返回两次)
+ *   - bytesused不超过length, flags中没有QUEUED
+ *   - 同一个缓冲区每次被取出时sequence都比上一次大
+ * 发现错误时返回1.
+ *
+ * gcc -O2 -Wall -pthread -o qbuf_stress qbuf_stress.c
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#define MAX_BUFFERS	32
+#define MAX_THREADS	16
+
+static int fd;
+static unsigned int nbuffers = 4;
+static unsigned int nthreads = 4;
+static unsigned int seconds = 10;
+static unsigned int cycle_ms = 1000;
+static void *mem[MAX_BUFFERS];
+static size_t mem_len[MAX_BUFFERS];
+
+/* 工作线程每次操作时持有读锁, 主线程持有写锁重启数据流 */
+static pthread_rwlock_t stream_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int stop;
+
+/* 每个缓冲区的状态, state_lock保护 */
+static struct {
+	int owned;			/* DQBUF取出后, QBUF之前 */
+	long long last_sequence;	/* 上一次取出时的sequence, -1表示还没有取出过 */
+} bufs[MAX_BUFFERS];
+
+static struct {
+	unsigned long frames;
+	unsigned long error_frames;	/* V4L2_BUF_FLAG_ERROR */
+	unsigned long gaps;		/* sequence不连续(丢帧) */
+	unsigned long querybufs;
+	unsigned long polls;
+	unsigned long restarts;
+	unsigned long failures;		/* 驱动行为错误 */
+	long long last_sequence;	/* 所有缓冲区中最新的sequence */
+} stats;
+
+static void failure(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "FAIL: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+
+	pthread_mutex_lock(&state_lock);
+	stats.failures++;
+	pthread_mutex_unlock(&state_lock);
+}
+
+static int xioctl(unsigned long request, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, request, arg);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+static void write_file(const char *path, const char *value)
+{
+	FILE *f = fopen(path, "w");
+
+	if (f == NULL || fputs(value, f) < 0 || fclose(f) != 0) {
+		fprintf(stderr, "cannot write '%s' to %s: %s\n", value, path,
+			strerror(errno));
+		exit(2);
+	}
+}
+
+static int queue_buffer(unsigned int index)
+{
+	struct v4l2_buffer buf;
+
+	memset(&buf, 0, sizeof buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+
+	return xioctl(VIDIOC_QBUF, &buf);
+}
+
+/* 取出一个缓冲区并检查, 成功时返回index */
+static int dequeue_buffer(void)
+{
+	struct v4l2_buffer buf;
+	long long last;
+
+	memset(&buf, 0, sizeof buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+
+	if (xioctl(VIDIOC_DQBUF, &buf) < 0) {
+		/* 别的线程抢先取走了, 或者数据流正在重启 */
+		if (errno != EAGAIN && errno != EINVAL && errno != EIO)
+			failure("DQBUF: %s", strerror(errno));
+		return -1;
+	}
+
+	if (buf.index >= nbuffers) {
+		failure("DQBUF returned index %u of %u", buf.index, nbuffers);
+		return -1;
+	}
+	if (buf.bytesused > buf.length)
+		failure("buffer %u: bytesused %u > length %u", buf.index,
+			buf.bytesused, buf.length);
+	if (buf.flags & V4L2_BUF_FLAG_QUEUED)
+		failure("buffer %u: QUEUED flag after DQBUF", buf.index);
+
+	pthread_mutex_lock(&state_lock);
+	if (bufs[buf.index].owned) {
+		pthread_mutex_unlock(&state_lock);
+		failure("buffer %u dequeued twice", buf.index);
+		return -1;
+	}
+	last = bufs[buf.index].last_sequence;
+	bufs[buf.index].owned = 1;
+	bufs[buf.index].last_sequence = buf.sequence;
+
+	stats.frames++;
+	if (buf.flags & V4L2_BUF_FLAG_ERROR)
+		stats.error_frames++;
+	if ((long long)buf.sequence > stats.last_sequence + 1)
+		stats.gaps += buf.sequence - stats.last_sequence - 1;
+	if ((long long)buf.sequence > stats.last_sequence)
+		stats.last_sequence = buf.sequence;
+	pthread_mutex_unlock(&state_lock);
+
+	if ((long long)buf.sequence <= last)
+		failure("buffer %u: sequence %u after %lld", buf.index,
+			buf.sequence, last);
+
+	return buf.index;
+}
+
+static void release_buffer(unsigned int index)
+{
+	pthread_mutex_lock(&state_lock);
+	bufs[index].owned = 0;
+	pthread_mutex_unlock(&state_lock);
+
+	if (queue_buffer(index) < 0 && errno != EINVAL && errno != EIO)
+		failure("QBUF %u: %s", index, strerror(errno));
+}
+
+/* 工作线程: poll, DQBUF, 读一下数据, QBUF, 中间穿插QUERYBUF */
+static void *worker(void *arg)
+{
+	unsigned int seed = (unsigned long)arg;
+	struct v4l2_buffer buf;
+	struct pollfd pfd;
+	volatile unsigned char sink;
+	int index;
+
+	while (!stop) {
+		pthread_rwlock_rdlock(&stream_lock);
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) > 0) {
+			index = dequeue_buffer();
+			if (index >= 0) {
+				sink = ((unsigned char *)mem[index])[0];
+				(void)sink;
+				if (rand_r(&seed) % 4 == 0)
+					usleep(rand_r(&seed) % 2000);
+				release_buffer(index);
+			}
+		}
+
+		memset(&buf, 0, sizeof buf);
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = rand_r(&seed) % nbuffers;
+		if (xioctl(VIDIOC_QUERYBUF, &buf) < 0)
+			failure("QUERYBUF %u: %s", buf.index, strerror(errno));
+
+		pthread_mutex_lock(&state_lock);
+		stats.polls++;
+		stats.querybufs++;
+		pthread_mutex_unlock(&state_lock);
+
+		pthread_rwlock_unlock(&stream_lock);
+	}
+
+	return NULL;
+}
+
+static void stream(int on)
+{
+	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	unsigned int i;
+
+	if (!on) {
+		if (xioctl(VIDIOC_STREAMOFF, &type) < 0)
+			failure("STREAMOFF: %s", strerror(errno));
+		return;
+	}
+
+	/* STREAMOFF后所有缓冲区都回到APP手里 */
+	for (i = 0; i < nbuffers; ++i) {
+		bufs[i].owned = 0;
+		bufs[i].last_sequence = -1;
+		if (queue_buffer(i) < 0) {
+			fprintf(stderr, "QBUF %u: %s\n", i, strerror(errno));
+			exit(2);
+		}
+	}
+	stats.last_sequence = -1;
+
+	if (xioctl(VIDIOC_STREAMON, &type) < 0) {
+		fprintf(stderr, "STREAMON: %s\n", strerror(errno));
+		exit(2);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-v \"fps frame_size packet_size\"] [-l]\n"
+		"          [-b buffers] [-t threads] [-s seconds] [-c cycle_ms]\n"
+		"  -v  write to debugfs vsource before streaming (needs debugfs)\n"
+		"  -l  set the latest_frame module parameter\n"
+		"  -c  STREAMOFF/STREAMON period, 0 to stream continuously\n",
+		name);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *device = "/dev/video0";
+	const char *vsource = NULL;
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer buf;
+	pthread_t threads[MAX_THREADS];
+	char path[128];
+	double start;
+	int latest = 0, opt, num;
+	unsigned int i;
+
+	while ((opt = getopt(argc, argv, "d:v:lb:t:s:c:")) != -1) {
+		switch (opt) {
+		case 'd': device = optarg; break;
+		case 'v': vsource = optarg; break;
+		case 'l': latest = 1; break;
+		case 'b': nbuffers = atoi(optarg); break;
+		case 't': nthreads = atoi(optarg); break;
+		case 's': seconds = atoi(optarg); break;
+		case 'c': cycle_ms = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (nbuffers < 2 || nbuffers > MAX_BUFFERS ||
+	    nthreads < 1 || nthreads > MAX_THREADS)
+		usage(argv[0]);
+
+	if (vsource) {
+		if (sscanf(device, "/dev/video%d", &num) != 1)
+			usage(argv[0]);
+		snprintf(path, sizeof path, "/sys/kernel/debug/myuvc/video%d/vsource", num);
+		write_file(path, vsource);
+	}
+	write_file("/sys/module/myuvc/parameters/latest_frame", latest ? "1" : "0");
+
+	fd = open(device, O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+		fprintf(stderr, "open %s: %s\n", device, strerror(errno));
+		return 2;
+	}
+
+	memset(&req, 0, sizeof req);
+	req.count = nbuffers;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(VIDIOC_REQBUFS, &req) < 0 || req.count < 2) {
+		fprintf(stderr, "REQBUFS: %s\n", strerror(errno));
+		return 2;
+	}
+	nbuffers = req.count;
+
+	for (i = 0; i < nbuffers; ++i) {
+		memset(&buf, 0, sizeof buf);
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		if (xioctl(VIDIOC_QUERYBUF, &buf) < 0) {
+			fprintf(stderr, "QUERYBUF: %s\n", strerror(errno));
+			return 2;
+		}
+		mem_len[i] = buf.length;
+		mem[i] = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+			      fd, buf.m.offset);
+		if (mem[i] == MAP_FAILED) {
+			fprintf(stderr, "mmap: %s\n", strerror(errno));
+			return 2;
+		}
+	}
+
+	stream(1);
+	for (i = 0; i < nthreads; ++i)
+		pthread_create(&threads[i], NULL, worker, (void *)(unsigned long)(i + 1));
+
+	start = now();
+	while (now() - start < seconds) {
+		usleep(cycle_ms ? cycle_ms * 1000 : 100000);
+		if (!cycle_ms)
+			continue;
+
+		pthread_rwlock_wrlock(&stream_lock);
+		stream(0);
+		stream(1);
+		stats.restarts++;
+		pthread_rwlock_unlock(&stream_lock);
+	}
+
+	stop = 1;
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+	stream(0);
+
+	for (i = 0; i < nbuffers; ++i)
+		munmap(mem[i], mem_len[i]);
+	close(fd);
+
+	if (vsource)
+		write_file(path, "0");
+
+	printf("frames %lu (%.1f fps), error frames %lu, sequence gaps %lu\n",
+	       stats.frames, stats.frames / (now() - start), stats.error_frames,
+	       stats.gaps);
+	printf("querybuf %lu, poll %lu, restarts %lu, failures %lu\n",
+	       stats.querybufs, stats.polls, stats.restarts, stats.failures);
+
+	return stats.failures ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# run_rig.sh: 加载myuvc, 找到它的videoN, 可选地切到vsource或回放一段抓取的数据,
+# 然后用scenarios跑各个场景并打印结果.
+#
+#   ./run_rig.sh [-g] [-k myuvc.ko] [-v "fps frame_size packet_size"] [-r capture.bin]
+#                [-s seconds] [scenario ...]
+#
+#   -g  先加载dummy_hcd和g_webcam, 用UVC gadget当摄像头. g_webcam是2.6.36才有的,
+#       本机的内核要是2.6.36以后的版本; 驱动面向的2.6.31上没有它, 这时用另一台
+#       运行较新内核, 带UDC的板子加载g_webcam接到本机上(不用-g), 或者用-v
+#   -k  要insmod的模块, 默认../myuvc/myuvc.ko; 给-k ""时使用已经加载的模块
+#   -v  STREAMON时从vsource取数据(需要MYUVC_TESTING=y编译的模块)
+#   -r  REQBUFS以后把capture.bin写进replay回放(由scenarios完成), 只给出-r
+#       而没有给出场景时只回放
+#   -s  sustained场景的秒数
+#
+# 需要root权限和挂载好的debugfs.
+
+set -e
+
+# 命令行上的相对路径相对于当前目录, 脚本在test目录中运行
+cwd=$(pwd)
+cd "$(dirname "$0")"
+
+module=../myuvc/myuvc.ko
+gadget=
+vsource=
+replay=
+seconds=10
+
+while getopts "gk:v:r:s:" opt; do
+	case $opt in
+	g) gadget=1 ;;
+	k) module=${OPTARG:+$(cd "$cwd" && realpath "$OPTARG")} ;;
+	v) vsource=$OPTARG ;;
+	r) replay=$(cd "$cwd" && realpath "$OPTARG") ;;
+	s) seconds=$OPTARG ;;
+	*) sed -n '6,7p' "$0" >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+[ -x ./scenarios ] || make scenarios
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+
+if [ -n "$gadget" ]; then
+	if ! modprobe dummy_hcd || ! modprobe g_webcam; then
+		echo "-g needs dummy_hcd and g_webcam (kernel 2.6.36 or later)" >&2
+		exit 1
+	fi
+fi
+
+if [ -n "$module" ]; then
+	rmmod myuvc 2>/dev/null || true
+	insmod "$module"
+fi
+
+# 等USB枚举完成, 找名字是myuvcvideo的video设备
+video=
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	for name in /sys/class/video4linux/video*/name; do
+		[ -e "$name" ] || continue
+		if [ "$(cat "$name")" = myuvcvideo ]; then
+			video=$(basename "$(dirname "$name")")
+			break 2
+		fi
+	done
+	sleep 1
+done
+
+if [ -z "$video" ]; then
+	echo "no myuvcvideo device" >&2
+	exit 1
+fi
+
+debugfs=/sys/kernel/debug/myuvc/$video
+echo "device /dev/$video"
+
+if [ -n "$vsource" ]; then
+	echo "$vsource" > "$debugfs/vsource"
+	trap 'echo 0 > "$debugfs/vsource"' EXIT
+fi
+
+./scenarios -d "/dev/$video" -s "$seconds" ${replay:+-r "$replay"} "$@"
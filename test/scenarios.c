@@ -0,0 +1,483 @@
+/*
+ * scenarios: 对myuvc运行几种采集场景, 每个场景前清零debugfs的stats,
+ * 结束后读出来, 每个场景打印一行结果, 用于比较不同版本的驱动.
+ *
+ *   ./scenarios -d /dev/video0 [-s seconds] [-v] [-r capture.bin] [scenario ...]
+ *
+ * 场景:
+ *   cycles     20次 STREAMON, 取10帧, STREAMOFF
+ *   sustained  30fps连续采集seconds秒
+ *   starve     采集时每次拿住所有缓冲区1秒不还, 重复5次 (frames_dropped增加)
+ *   resize     在这个格式的每种分辨率(最多4种)之间切换, 每种采集30帧
+ * 不给出场景时全部运行.
+ *
+ * -r: REQBUFS以后先把capture文件(debugfs中capture读出的数据)写入replay回放,
+ *     打印一行结果(frames是stats中解析出的帧数). 给出-r而没有给出场景时只回放.
+ *
+ * 输出的列:
+ *   frames   APP取到的帧数           fps      frames / 运行时间
+ *   gaps     sequence不连续的帧数     dropped  stats中的frames_dropped
+ *   errors   stats中的frames_error   app_ms   本进程的CPU时间(用户+内核)
+ *   irq_ms   完成函数的CPU时间        work_ms  deferred_decode工作队列的CPU时间
+ *   lat_p50/lat_p99  stats中"first payload to DQBUF"直方图的中位数/99%(us, 桶的上限)
+ *
+ * gcc -O2 -Wall -o scenarios scenarios.c
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/videodev2.h>
+
+#define NBUFFERS	4
+
+static int fd;
+static char stats_path[128];
+static char replay_path[128];
+static int verbose;
+static unsigned int seconds = 10;
+static unsigned int nbuffers;
+static void *mem[NBUFFERS];
+static size_t mem_len[NBUFFERS];
+
+/* 一个场景的结果 */
+struct result {
+	unsigned long frames;
+	unsigned long gaps;
+	long long last_sequence;
+	double start;
+	double app_cpu;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "%s: %s\n", what, strerror(errno));
+	exit(2);
+}
+
+static int xioctl(unsigned long request, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, request, arg);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+static void stats_reset(void)
+{
+	FILE *f = fopen(stats_path, "w");
+
+	if (f == NULL || fputs("0", f) < 0 || fclose(f) != 0)
+		die(stats_path);
+}
+
+/* 读出stats中的一个计数 */
+static unsigned long stats_value(const char *text, const char *name)
+{
+	char key[64];
+	const char *p;
+
+	snprintf(key, sizeof key, "\n%s:", name);
+	p = strstr(text, key);
+	return p ? strtoul(p + strlen(key), NULL, 10) : 0;
+}
+
+/* "first payload to DQBUF"直方图中累计达到pct%的桶的上限(us),
+ * 直方图的每一行是 "  <  hi count", 最后一行是 "  >= lo count"(返回lo)
+ */
+static long stats_percentile(const char *text, double pct)
+{
+	unsigned long counts[64], total = 0, sum = 0;
+	long bounds[64];
+	const char *p = strstr(text, "first payload to DQBUF");
+	unsigned int n = 0, i;
+	unsigned long count;
+	long bound;
+
+	if (p == NULL)
+		return -1;
+
+	for (p = strchr(p, '\n'); p && n < 64; p = strchr(p + 1, '\n')) {
+		if (sscanf(p, " < %ld %lu", &bound, &count) != 2 &&
+		    sscanf(p, " >= %ld %lu", &bound, &count) != 2)
+			break;
+		bounds[n] = bound;
+		counts[n++] = count;
+		total += count;
+	}
+
+	for (i = 0; i < n && total; ++i) {
+		sum += counts[i];
+		if (sum * 100.0 >= total * pct)
+			return bounds[i];
+	}
+
+	return -1;
+}
+
+static void begin(struct result *r)
+{
+	memset(r, 0, sizeof *r);
+	r->last_sequence = -1;
+	stats_reset();
+	r->start = now();
+	r->app_cpu = cpu_time();
+}
+
+/* 读出stats, 前面加一个换行, stats_value可以用"\nname:"查找 */
+static const char *stats_read(void)
+{
+	static char text[16384];
+	FILE *f = fopen(stats_path, "r");
+	size_t len;
+
+	if (f == NULL)
+		die(stats_path);
+	len = fread(text + 1, 1, sizeof text - 2, f);
+	fclose(f);
+	text[0] = '\n';
+	text[len + 1] = '\0';
+
+	return text;
+}
+
+static void report(const char *name, struct result *r)
+{
+	double elapsed = now() - r->start;
+	double app = cpu_time() - r->app_cpu;
+	const char *text = stats_read();
+
+	printf("%-10s %8lu %8.1f %6lu %8lu %7lu %8.1f %8.1f %8.1f %8ld %8ld\n",
+	       name, r->frames, r->frames / elapsed, r->gaps,
+	       stats_value(text, "frames_dropped"), stats_value(text, "frames_error"),
+	       app * 1e3, stats_value(text, "irq_ns") / 1e6,
+	       stats_value(text, "work_ns") / 1e6,
+	       stats_percentile(text, 50), stats_percentile(text, 99));
+
+	if (verbose)
+		printf("%s\n", text + 1);
+}
+
+static void request_buffers(unsigned int count)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer buf;
+	unsigned int i;
+
+	for (i = 0; i < nbuffers; ++i)
+		munmap(mem[i], mem_len[i]);
+	nbuffers = 0;
+
+	memset(&req, 0, sizeof req);
+	req.count = count;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(VIDIOC_REQBUFS, &req) < 0)
+		die("REQBUFS");
+
+	for (i = 0; i < req.count && i < NBUFFERS; ++i) {
+		memset(&buf, 0, sizeof buf);
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		if (xioctl(VIDIOC_QUERYBUF, &buf) < 0)
+			die("QUERYBUF");
+		mem_len[i] = buf.length;
+		mem[i] = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+			      fd, buf.m.offset);
+		if (mem[i] == MAP_FAILED)
+			die("mmap");
+	}
+	nbuffers = i;
+}
+
+static void queue_buffer(unsigned int index)
+{
+	struct v4l2_buffer buf;
+
+	memset(&buf, 0, sizeof buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+	if (xioctl(VIDIOC_QBUF, &buf) < 0)
+		die("QBUF");
+}
+
+static void stream(int on)
+{
+	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	unsigned int i;
+
+	if (on)
+		for (i = 0; i < nbuffers; ++i)
+			queue_buffer(i);
+
+	if (xioctl(on ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &type) < 0)
+		die(on ? "STREAMON" : "STREAMOFF");
+}
+
+/* 等待并取出一帧, 超时返回-1 */
+static int dequeue(struct result *r)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct v4l2_buffer buf;
+
+	if (poll(&pfd, 1, 2000) <= 0) {
+		fprintf(stderr, "no frame within 2 s\n");
+		return -1;
+	}
+
+	memset(&buf, 0, sizeof buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(VIDIOC_DQBUF, &buf) < 0)
+		die("DQBUF");
+
+	r->frames++;
+	if ((long long)buf.sequence > r->last_sequence + 1)
+		r->gaps += buf.sequence - r->last_sequence - 1;
+	r->last_sequence = buf.sequence;
+
+	return buf.index;
+}
+
+static void capture(struct result *r, unsigned int frames, double duration)
+{
+	double end = now() + duration;
+	unsigned int n;
+	int index;
+
+	for (n = 0; frames ? n < frames : now() < end; ++n) {
+		if ((index = dequeue(r)) < 0)
+			break;
+		queue_buffer(index);
+	}
+}
+
+static void scenario_cycles(void)
+{
+	struct result r;
+	unsigned int i;
+
+	begin(&r);
+	for (i = 0; i < 20; ++i) {
+		r.last_sequence = -1;
+		stream(1);
+		capture(&r, 10, 0);
+		stream(0);
+	}
+	report("cycles", &r);
+}
+
+static void scenario_sustained(void)
+{
+	struct v4l2_streamparm parm;
+	struct result r;
+
+	memset(&parm, 0, sizeof parm);
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	parm.parm.capture.timeperframe.numerator = 1;
+	parm.parm.capture.timeperframe.denominator = 30;
+	if (xioctl(VIDIOC_S_PARM, &parm) < 0)
+		fprintf(stderr, "S_PARM 30 fps: %s\n", strerror(errno));
+
+	begin(&r);
+	stream(1);
+	capture(&r, 0, seconds);
+	stream(0);
+	report("sustained", &r);
+}
+
+static void scenario_starve(void)
+{
+	struct result r;
+	unsigned int i, j;
+	int index[NBUFFERS];
+
+	begin(&r);
+	stream(1);
+	for (i = 0; i < 5; ++i) {
+		capture(&r, 10, 0);
+
+		/* 拿住所有缓冲区, 驱动只能丢帧 */
+		for (j = 0; j < nbuffers; ++j)
+			index[j] = dequeue(&r);
+		sleep(1);
+		for (j = 0; j < nbuffers; ++j)
+			if (index[j] >= 0)
+				queue_buffer(index[j]);
+	}
+	stream(0);
+	report("starve", &r);
+}
+
+static void scenario_resize(void)
+{
+	struct v4l2_frmsizeenum fsize;
+	struct v4l2_format fmt;
+	struct result r;
+	unsigned int i;
+
+	memset(&fmt, 0, sizeof fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (xioctl(VIDIOC_G_FMT, &fmt) < 0)
+		die("G_FMT");
+
+	begin(&r);
+	for (i = 0; i < 4; ++i) {
+		memset(&fsize, 0, sizeof fsize);
+		fsize.index = i;
+		fsize.pixel_format = fmt.fmt.pix.pixelformat;
+		if (xioctl(VIDIOC_ENUM_FRAMESIZES, &fsize) < 0 ||
+		    fsize.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+			break;
+
+		/* 分配了缓冲区时不能改格式 */
+		request_buffers(0);
+		fmt.fmt.pix.width = fsize.discrete.width;
+		fmt.fmt.pix.height = fsize.discrete.height;
+		if (xioctl(VIDIOC_S_FMT, &fmt) < 0)
+			die("S_FMT");
+		request_buffers(NBUFFERS);
+
+		r.last_sequence = -1;
+		stream(1);
+		capture(&r, 30, 0);
+		stream(0);
+	}
+	report("resize", &r);
+}
+
+/* 回放使用REQBUFS分配的缓冲区, 要在QBUF之前进行 */
+static void replay(const char *file)
+{
+	static char buf[65536];
+	struct result r;
+	FILE *in;
+	size_t n;
+	int out;
+
+	in = fopen(file, "rb");
+	if (in == NULL)
+		die(file);
+
+	begin(&r);
+	out = open(replay_path, O_WRONLY);
+	if (out < 0)
+		die(replay_path);
+	while ((n = fread(buf, 1, sizeof buf, in)) > 0)
+		if (write(out, buf, n) != (ssize_t)n)
+			die(replay_path);
+	if (close(out) < 0)
+		die(replay_path);
+	fclose(in);
+
+	r.frames = stats_value(stats_read(), "frames");
+	report("replay", &r);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} scenarios[] = {
+	{ "cycles",    scenario_cycles },
+	{ "sustained", scenario_sustained },
+	{ "starve",    scenario_starve },
+	{ "resize",    scenario_resize },
+};
+
+#define NSCENARIOS	(sizeof scenarios / sizeof scenarios[0])
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d device] [-s seconds] [-v] [-r capture.bin] [scenario ...]\n"
+		"scenarios: cycles sustained starve resize\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *device = "/dev/video0", *replay_file = NULL;
+	unsigned int i;
+	int opt, num, ran = 0;
+
+	while ((opt = getopt(argc, argv, "d:s:vr:")) != -1) {
+		switch (opt) {
+		case 'd': device = optarg; break;
+		case 'r': replay_file = optarg; break;
+		case 's': seconds = atoi(optarg); break;
+		case 'v': verbose = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (sscanf(device, "/dev/video%d", &num) != 1)
+		usage(argv[0]);
+	snprintf(stats_path, sizeof stats_path,
+		 "/sys/kernel/debug/myuvc/video%d/stats", num);
+	snprintf(replay_path, sizeof replay_path,
+		 "/sys/kernel/debug/myuvc/video%d/replay", num);
+
+	fd = open(device, O_RDWR | O_NONBLOCK);
+	if (fd < 0)
+		die(device);
+	request_buffers(NBUFFERS);
+
+	printf("%-10s %8s %8s %6s %8s %7s %8s %8s %8s %8s %8s\n", "scenario",
+	       "frames", "fps", "gaps", "dropped", "errors", "app_ms", "irq_ms",
+	       "work_ms", "lat_p50", "lat_p99");
+
+	if (replay_file) {
+		replay(replay_file);
+		ran++;
+	}
+
+	for (i = 0; i < NSCENARIOS; ++i) {
+		if (replay_file && optind == argc)
+			break;
+		if (optind < argc) {
+			int j, found = 0;
+
+			for (j = optind; j < argc; ++j)
+				found |= strcmp(argv[j], scenarios[i].name) == 0;
+			if (!found)
+				continue;
+		}
+		scenarios[i].run();
+		ran++;
+	}
+
+	request_buffers(0);
+	close(fd);
+
+	if (ran == 0)
+		usage(argv[0]);
+	return 0;
+}